@@ -0,0 +1,23 @@
+// bench.h
+// Helpers shared by the kernel microbenchmarks (crc32c_bench.c, gf_bench.c, delta_bench.c).
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <time.h>
+
+static inline double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Consume a result so that the loop computing it is not optimized away. The memory clobber also keeps the stores
+// of kernels that write a buffer instead of returning a value.
+static inline void bench_sink(uint64_t value)
+{
+    __asm__ volatile("" : : "r"(value) : "memory");
+}
+
+#endif
@@ -0,0 +1,368 @@
+#!/bin/sh
+# bench.sh - loopback benchmarks for the ftp client/server
+#
+# Usage: ./bench.sh [concurrency] [zerocopy] [memory] [checksum] [erasure] [gf] [delta] [delta-scan] [replace] [sweep]
+#   concurrency  aggregate throughput and server CPU of N simultaneous clients, per server mode (blocking, epoll, uring)
+#   zerocopy     server CPU seconds per GB sent for each GET data path (epoll mode, no throttling)
+#   memory       client throughput and peak RSS with -o memory (whole file in RAM), -o stream (pwrite in place)
+#                and -o mmap (output.dat mapped MAP_SHARED)
+#   checksum     single-core GB/s of each CRC32C kernel (crc32c_bench)
+#   erasure      6 shaped mirrors holding full copies against a 4+2 erasure-coded layout (./shard, client -E),
+#                with every mirror equally fast and with one of them slow: bytes stored and download time
+#   gf           single-core GB/s of each GF(2^8) multiply-accumulate kernel (gf_bench)
+#   delta        updating an old copy of BENCH_FILE to an edited one over a shaped link, by full download and by
+#                delta sync (client -D): bytes on the wire and time, for scattered overwrites and for an insertion
+#   delta-scan   single-core GB/s of each rolling-checksum scan kernel and of the strong checksum (delta_bench)
+#   replace      test, per server mode: a file renamed over by another one halfway through a shaped download on one
+#                connection must be served from the new copy from then on, with no checksum mismatches
+#   sweep        one client per combination of file size x mirrors x connections x buffer size (-s on client and
+#                servers): wall time, throughput, client and server CPU seconds and client peak RSS
+#
+# Environment: BENCH_FILE (file to serve, default bench_file.bin; e.g. example_file.txt from `make generate`),
+#              BENCH_SIZE_MB (size when generating BENCH_FILE, default 8), BENCH_PORT (first port, default 5024),
+#              BENCH_CLIENTS (client counts, default "1 2 4 8"), BENCH_CONNECTIONS (per client, default 8)
+#              sweep: SWEEP_SIZES_MB (default "1 16 64"), SWEEP_SERVERS (default "1 2 4"),
+#              SWEEP_CONNECTIONS (default "1 4 8"), SWEEP_BUFFERS (default "1K 4K 16K 64K 256K 1M"),
+#              SWEEP_MODE (server mode, default epoll)
+#              erasure: ERASURE_RATE (per mirror, default 2M), ERASURE_SLOW (the slow mirror's, default 256K)
+#              delta: DELTA_RATE (the mirror's, default 8M), DELTA_EDITS (4KB overwrites, default 16)
+
+BENCH_SIZE_MB=${BENCH_SIZE_MB:-8}
+BENCH_PORT=${BENCH_PORT:-5024}
+BENCH_CLIENTS=${BENCH_CLIENTS:-"1 2 4 8"}
+BENCH_CONNECTIONS=${BENCH_CONNECTIONS:-8}
+BENCH_FILE=${BENCH_FILE:-bench_file.bin}
+SWEEP_SIZES_MB=${SWEEP_SIZES_MB:-"1 16 64"}
+SWEEP_SERVERS=${SWEEP_SERVERS:-"1 2 4"}
+SWEEP_CONNECTIONS=${SWEEP_CONNECTIONS:-"1 4 8"}
+SWEEP_BUFFERS=${SWEEP_BUFFERS:-"1K 4K 16K 64K 256K 1M"}
+SWEEP_MODE=${SWEEP_MODE:-epoll}
+ERASURE_RATE=${ERASURE_RATE:-2M}
+ERASURE_SLOW=${ERASURE_SLOW:-256K}
+DELTA_RATE=${DELTA_RATE:-8M}
+DELTA_EDITS=${DELTA_EDITS:-16}
+WORK_DIR=$(mktemp -d)
+SERVER_PID=
+SERVER_PIDS=
+
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+    [ -n "$SERVER_PIDS" ] && kill $SERVER_PIDS 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT INT TERM
+
+now() {
+    date +%s.%N
+}
+
+# cpu_ticks <pid> - user + system clock ticks consumed so far
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# start_server <port> <server args...>
+start_server() {
+    port=$1
+    shift
+    ./server "$@" "$port" 2>/dev/null &
+    SERVER_PID=$!
+    echo "127.0.0.1 $port" > "$WORK_DIR/server-info.txt"
+    sleep 0.3
+}
+
+stop_server() {
+    kill "$SERVER_PID" 2>/dev/null
+    wait "$SERVER_PID" 2>/dev/null
+    SERVER_PID=
+}
+
+# run_clients <count> - launch <count> clients at once, each in its own directory so output.dat does not collide
+run_clients() {
+    count=$1
+    i=0
+    pids=
+    while [ "$i" -lt "$count" ]; do
+        mkdir -p "$WORK_DIR/client$i"
+        (cd "$WORK_DIR/client$i" && "$OLDPWD/client" "$WORK_DIR/server-info.txt" "$BENCH_CONNECTIONS" "$BENCH_FILE" >/dev/null 2>&1) &
+        pids="$pids $!"
+        i=$((i + 1))
+    done
+    for pid in $pids; do
+        wait "$pid"
+    done
+
+    i=0
+    while [ "$i" -lt "$count" ]; do
+        cmp -s "$BENCH_FILE" "$WORK_DIR/client$i/output.dat" || echo "client $i: output differs" >&2
+        rm -f "$WORK_DIR/client$i/output.dat"
+        i=$((i + 1))
+    done
+}
+
+bench_concurrency() {
+    ticks_per_sec=$(getconf CLK_TCK)
+    echo "mode,clients,seconds,aggregate_MBps,server_cpu_seconds"
+    for mode in blocking epoll uring; do
+        start_server "$BENCH_PORT" -m "$mode"
+        for clients in $BENCH_CLIENTS; do
+            cpu_start=$(cpu_ticks "$SERVER_PID")
+            start=$(now)
+            run_clients "$clients"
+            end=$(now)
+            cpu_end=$(cpu_ticks "$SERVER_PID")
+            echo "$mode $clients $start $end $(stat -c %s "$BENCH_FILE") $cpu_start $cpu_end $ticks_per_sec" | awk '{
+                t = $4 - $3
+                printf "%s,%d,%.3f,%.1f,%.2f\n", $1, $2, t, $2 * $5 / 1048576 / t, ($7 - $6) / $8
+            }'
+        done
+        stop_server
+        BENCH_PORT=$((BENCH_PORT + 1)) # io_uring tears down asynchronously, so do not rebind the same port at once
+    done
+}
+
+bench_zerocopy() {
+    rounds=${BENCH_ROUNDS:-4}
+    ticks_per_sec=$(getconf CLK_TCK)
+    echo "data_path,GB_sent,seconds,server_cpu_seconds,cpu_seconds_per_GB"
+    for path in copy sendfile splice; do
+        start_server "$BENCH_PORT" -m epoll -z "$path"
+        cpu_start=$(cpu_ticks "$SERVER_PID")
+        start=$(now)
+        round=0
+        while [ "$round" -lt "$rounds" ]; do
+            run_clients 4
+            round=$((round + 1))
+        done
+        end=$(now)
+        cpu_end=$(cpu_ticks "$SERVER_PID")
+        stop_server
+        echo "$path $start $end $cpu_start $cpu_end $ticks_per_sec $(stat -c %s "$BENCH_FILE") $rounds" | awk '{
+            gb = $7 * 4 * $8 / 1e9; cpu = ($5 - $4) / $6
+            printf "%s,%.3f,%.3f,%.2f,%.2f\n", $1, gb, $3 - $2, cpu, cpu / gb
+        }'
+    done
+}
+
+bench_memory() {
+    size=$(stat -c %s "$BENCH_FILE")
+    echo "output,connections,seconds,MBps,peak_rss_MB"
+    start_server "$BENCH_PORT" -m epoll
+    mkdir -p "$WORK_DIR/memory"
+    for output in memory stream mmap; do
+        start=$(now)
+        (cd "$WORK_DIR/memory" && "$OLDPWD/client" -o "$output" "$WORK_DIR/server-info.txt" "$BENCH_CONNECTIONS" "$BENCH_FILE" >/dev/null 2>"$WORK_DIR/memory/log")
+        end=$(now)
+        cmp -s "$BENCH_FILE" "$WORK_DIR/memory/output.dat" || echo "$output: output differs" >&2
+        rss_kb=$(awk '/^Peak RSS:/ { print $3 }' "$WORK_DIR/memory/log")
+        echo "$output $BENCH_CONNECTIONS $start $end $size $rss_kb" | awk '{
+            t = $4 - $3
+            printf "%s,%d,%.3f,%.1f,%.1f\n", $1, $2, t, $5 / 1048576 / t, $6 / 1024
+        }'
+        rm -f "$WORK_DIR/memory/output.dat"
+    done
+    stop_server
+    BENCH_PORT=$((BENCH_PORT + 1))
+}
+
+# start_servers <count> <server args...> - <count> mirrors on consecutive ports, listed in sweep-info.txt
+start_servers() {
+    count=$1
+    shift
+    : > "$WORK_DIR/sweep-info.txt"
+    i=0
+    while [ "$i" -lt "$count" ]; do
+        ./server "$@" "$BENCH_PORT" 2>/dev/null &
+        SERVER_PIDS="$SERVER_PIDS $!"
+        echo "127.0.0.1 $BENCH_PORT" >> "$WORK_DIR/sweep-info.txt"
+        BENCH_PORT=$((BENCH_PORT + 1)) # Fresh ports every time, see bench_concurrency
+        i=$((i + 1))
+    done
+    sleep 0.3
+}
+
+stop_servers() {
+    kill $SERVER_PIDS 2>/dev/null
+    for pid in $SERVER_PIDS; do
+        wait "$pid" 2>/dev/null
+    done
+    SERVER_PIDS=
+}
+
+bench_erasure() {
+    name=$(basename "$BENCH_FILE")
+    mkdir -p "$WORK_DIR/erasure/client"
+    ./shard -k 4 -m 2 -d "$WORK_DIR/erasure/mirror" "$BENCH_FILE" >/dev/null || exit 1
+    i=0
+    while [ "$i" -lt 6 ]; do
+        cp "$BENCH_FILE" "$WORK_DIR/erasure/mirror$i/$name"
+        i=$((i + 1))
+    done
+    echo "layout,slow_mirror,stored_MB,seconds,MBps"
+    for layout in replicated erasure; do
+        for slow in no yes; do
+            # Mirror 0 is the slow one; each mirror serves from its own directory
+            : > "$WORK_DIR/erasure-info.txt"
+            i=0
+            while [ "$i" -lt 6 ]; do
+                rate=$ERASURE_RATE
+                [ "$slow" = yes ] && [ "$i" = 0 ] && rate=$ERASURE_SLOW
+                (cd "$WORK_DIR/erasure/mirror$i" && exec "$OLDPWD/server" -m epoll -R "$rate" -B 1M "$BENCH_PORT" 2>/dev/null) &
+                SERVER_PIDS="$SERVER_PIDS $!"
+                echo "127.0.0.1 $BENCH_PORT" >> "$WORK_DIR/erasure-info.txt"
+                BENCH_PORT=$((BENCH_PORT + 1))
+                i=$((i + 1))
+            done
+            sleep 0.3
+            flag=
+            stored=$(stat -c %s "$WORK_DIR"/erasure/mirror*/"$name" | awk '{ total += $1 } END { print total }')
+            if [ "$layout" = erasure ]; then
+                flag=-E
+                stored=$(stat -c %s "$WORK_DIR"/erasure/mirror*/"$name.rs" | awk '{ total += $1 } END { print total }')
+            fi
+            start=$(now)
+            (cd "$WORK_DIR/erasure/client" && "$OLDPWD/client" $flag "$WORK_DIR/erasure-info.txt" 6 "$name" >/dev/null 2>"$WORK_DIR/erasure/log")
+            end=$(now)
+            cmp -s "$BENCH_FILE" "$WORK_DIR/erasure/client/output.dat" || echo "$layout, slow mirror $slow: output differs" >&2
+            rm -f "$WORK_DIR/erasure/client/output.dat"
+            stop_servers
+            echo "$layout $slow $stored $start $end $(stat -c %s "$BENCH_FILE")" | awk '{
+                t = $5 - $4
+                printf "%s,%s,%.1f,%.3f,%.1f\n", $1, $2, $3 / 1048576, t, $6 / 1048576 / t
+            }'
+        done
+    done
+}
+
+bench_delta() {
+    name=$(basename "$BENCH_FILE")
+    size=$(stat -c %s "$BENCH_FILE")
+    mkdir -p "$WORK_DIR/delta/mirror" "$WORK_DIR/delta/client"
+    (cd "$WORK_DIR/delta/mirror" && exec "$OLDPWD/server" -m epoll -R "$DELTA_RATE" -B 1M "$BENCH_PORT" 2>/dev/null) &
+    SERVER_PIDS=$!
+    echo "127.0.0.1 $BENCH_PORT" > "$WORK_DIR/delta-info.txt"
+    BENCH_PORT=$((BENCH_PORT + 1))
+    sleep 0.3
+    echo "edit,mode,wire_MB,seconds"
+    for edit in overwrite insert; do
+        # The new version: DELTA_EDITS scattered 4KB overwrites, plus 100 bytes inserted halfway for insert
+        new="$WORK_DIR/delta/mirror/$name"
+        if [ "$edit" = insert ]; then
+            { head -c $((size / 2)) "$BENCH_FILE"; head -c 100 /dev/urandom; tail -c +$((size / 2 + 1)) "$BENCH_FILE"; } > "$new"
+        else
+            cp "$BENCH_FILE" "$new"
+        fi
+        i=0
+        while [ "$i" -lt "$DELTA_EDITS" ]; do
+            dd if=/dev/urandom of="$new" bs=4096 count=1 seek=$(( (size / 4096) * i / DELTA_EDITS + 7 )) conv=notrunc 2>/dev/null
+            i=$((i + 1))
+        done
+        for mode in full delta; do
+            flag=
+            rm -f "$WORK_DIR/delta/client/output.dat"
+            if [ "$mode" = delta ]; then
+                flag=-D
+                cp "$BENCH_FILE" "$WORK_DIR/delta/client/output.dat"
+            fi
+            start=$(now)
+            (cd "$WORK_DIR/delta/client" && "$OLDPWD/client" $flag -i 0 "$WORK_DIR/delta-info.txt" 4 "$name" >/dev/null 2>"$WORK_DIR/delta/log")
+            end=$(now)
+            cmp -s "$new" "$WORK_DIR/delta/client/output.dat" || echo "$edit, $mode: output differs" >&2
+            # Signatures and data on the wire, as the client reports them; a full download is the file itself
+            wire=$(awk '/on the wire/ { print $3 }' "$WORK_DIR/delta/log")
+            echo "$edit $mode ${wire:-$(stat -c %s "$new")} $start $end" | awk '{
+                printf "%s,%s,%.3f,%.3f\n", $1, $2, $3 / 1048576, $5 - $4
+            }'
+        done
+    done
+    stop_servers
+}
+
+bench_replace() {
+    size=$(stat -c %s "$BENCH_FILE")
+    mkdir -p "$WORK_DIR/replace/mirror" "$WORK_DIR/replace/client"
+    head -c "$size" /dev/urandom > "$WORK_DIR/replace/new"
+    tail -c 65536 "$WORK_DIR/replace/new" > "$WORK_DIR/replace/new_tail"
+    echo "mode,checksum_mismatches,tail_from"
+    for mode in blocking epoll uring; do
+        cp "$BENCH_FILE" "$WORK_DIR/replace/mirror/replaced.bin"
+        # Shaped so that the replacement lands halfway, while the connection keeps requesting pieces
+        (cd "$WORK_DIR/replace/mirror" && exec "$OLDPWD/server" -m "$mode" -r $((size / 2)) -b 256K "$BENCH_PORT" 2>/dev/null) &
+        SERVER_PIDS=$!
+        echo "127.0.0.1 $BENCH_PORT" > "$WORK_DIR/replace-info.txt"
+        BENCH_PORT=$((BENCH_PORT + 1))
+        sleep 0.3
+        rm -f "$WORK_DIR/replace/client/output.dat"
+        (cd "$WORK_DIR/replace/client" && "$OLDPWD/client" -i 0 "$WORK_DIR/replace-info.txt" 1 replaced.bin >/dev/null 2>"$WORK_DIR/replace/log") &
+        client=$!
+        sleep 1
+        cp "$WORK_DIR/replace/new" "$WORK_DIR/replace/mirror/replacing.bin"
+        mv "$WORK_DIR/replace/mirror/replacing.bin" "$WORK_DIR/replace/mirror/replaced.bin"
+        wait "$client"
+        stop_servers
+        mismatches=$(grep -c "Checksum mismatch" "$WORK_DIR/replace/log")
+        tail_from=old
+        tail -c 65536 "$WORK_DIR/replace/client/output.dat" | cmp -s - "$WORK_DIR/replace/new_tail" && tail_from=new
+        [ "$mismatches" = 0 ] && [ "$tail_from" = new ] || echo "$mode: replaced file served stale data" >&2
+        echo "$mode,$mismatches,$tail_from"
+    done
+}
+
+bench_sweep() {
+    ticks_per_sec=$(getconf CLK_TCK)
+    mkdir -p "$WORK_DIR/sweep"
+    echo "file_MB,servers,connections,buffer,seconds,MBps,client_cpu_seconds,server_cpu_seconds,peak_rss_MB"
+    for size_mb in $SWEEP_SIZES_MB; do
+        file="$WORK_DIR/sweep_${size_mb}M.bin"
+        dd if=/dev/urandom of="$file" bs=1M count="$size_mb" 2>/dev/null
+        for servers in $SWEEP_SERVERS; do
+            for buffer in $SWEEP_BUFFERS; do
+                # Server-side buffer size is fixed at startup, so one set of servers serves every connection count
+                start_servers "$servers" -m "$SWEEP_MODE" -s "$buffer"
+                for connections in $SWEEP_CONNECTIONS; do
+                    cpu_start=0
+                    for pid in $SERVER_PIDS; do
+                        cpu_start=$((cpu_start + $(cpu_ticks "$pid")))
+                    done
+                    start=$(now)
+                    (cd "$WORK_DIR/sweep" && "$OLDPWD/client" -s "$buffer" "$WORK_DIR/sweep-info.txt" "$connections" "$file" >/dev/null 2>"$WORK_DIR/sweep/log")
+                    end=$(now)
+                    cpu_end=0
+                    for pid in $SERVER_PIDS; do
+                        cpu_end=$((cpu_end + $(cpu_ticks "$pid")))
+                    done
+                    cmp -s "$file" "$WORK_DIR/sweep/output.dat" || echo "$size_mb MB, $servers servers, $connections connections, $buffer: output differs" >&2
+                    rm -f "$WORK_DIR/sweep/output.dat"
+                    client=$(awk '/^Peak RSS:/ { rss = $3 } /^CPU:/ { cpu = $2 + $5 } END { print rss, cpu }' "$WORK_DIR/sweep/log")
+                    echo "$size_mb $servers $connections $buffer $start $end $client $cpu_start $cpu_end $ticks_per_sec" | awk '{
+                        t = $6 - $5
+                        printf "%d,%d,%d,%s,%.3f,%.1f,%.3f,%.2f,%.1f\n", $1, $2, $3, $4, t, $1 / t, $8, ($10 - $9) / $11, $7 / 1024
+                    }'
+                done
+                stop_servers
+            done
+        done
+        rm -f "$file"
+    done
+}
+
+make -s all || exit 1
+if [ ! -f "$BENCH_FILE" ]; then
+    dd if=/dev/urandom of="$BENCH_FILE" bs=1M count="$BENCH_SIZE_MB" 2>/dev/null
+fi
+
+for scenario in ${@:-concurrency}; do
+    case "$scenario" in
+    concurrency) bench_concurrency ;;
+    zerocopy) bench_zerocopy ;;
+    memory) bench_memory ;;
+    checksum) make -s crc32c_bench && ./crc32c_bench ;;
+    erasure) bench_erasure ;;
+    gf) make -s gf_bench && ./gf_bench ;;
+    delta) bench_delta ;;
+    delta-scan) make -s delta_bench && ./delta_bench ;;
+    replace) bench_replace ;;
+    sweep) bench_sweep ;;
+    *) echo "Unknown scenario: $scenario" >&2; exit 1 ;;
+    esac
+done
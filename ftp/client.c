@@ -3,208 +3,4190 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
-#define BUFFER_SIZE 1048576 // todo: benchmark with 1024 (1KB), 4096 (4KB), 8192 (8KB), 16384 (16KB), 65536 (64KB), 131072 (128KB), (256KB), 1048576 (1MB)etc on 16BG RAM
+#include "protocol.h"
+#include "crc32c.h"
+#include "stats.h"
+#include "pool.h"
+#include "rs.h"
+#include "delta.h"
 
+#define BUFFER_SIZE 1048576 // Default for -s (1MB); ./bench.sh sweep compares sizes
+
+#define PIPELINE_PIECE 1048576 // Bytes per GET request; a work unit is fetched as several pipelined pieces
+#define PIPELINE_DEPTH 4 // Full-size GET requests kept in flight on one connection...
+#define PIPELINE_MAX 32 // ...or up to this many smaller ones (e.g. small manifest files), as long as they add up to less
+#define HEADER_SIZE 64 // Longest response status line ("OK <n>\n" or "ERROR <message>\n")
+#define REQUEST_MAX (FRAME_HEADER_SIZE + FRAME_MAX_NAME + 1) // Longest CHECK or GET request
+#define UNIT_MIN 262144 // Smallest work unit (256KB); also the least a worker keeps when half its unit is stolen
+#define UNIT_MAX 67108864 // Largest work unit (64MB)
+#define UNIT_TARGET 0.5 // Seconds a work unit should take at the claiming worker's measured throughput
+#define PROBE_SAMPLE 262144 // Bytes fetched from each mirror to rank it (256KB)
+#define CHECK_BATCH 64 // CHECK requests a probe writes at once before reading their replies
+#define CORRUPT_LIMIT 4 // Responses with bad checksums a connection may return before its mirror is dropped
+#define REPAIR_ROUNDS 3 // Passes over the missing ranges, so blocks that fail their checksum get fetched again
+#define STALL_TIMEOUT 5 // Seconds a recv may wait for data before the connection counts as stalled and is dropped
+#define WORKER_RETRIES 3 // Broken connections a worker replaces, moving down the mirror ranking, before it gives up
+#define HEDGE_FACTOR 3 // A piece is late once it takes this many times what it would at the workers' mean rate...
+#define HEDGE_MIN_DELAY 0.2 // ...and at least this many seconds
+#define HEDGE_POLL 10000 // Microseconds an idle worker sleeps between looks for requeued or late work
+#define EVENT_TICK 10 // -e epoll: milliseconds between an event loop's looks for requeued work and stalled streams
+#define EVENT_BATCH 256 // -e epoll: events taken from epoll_wait() at once
+#define EVENT_BURST 16 // -e epoll: most recv() calls for one stream per wakeup
+#define SWARM_INTERVAL 0.5 // -T: seconds between announcements to the tracker
+#define SWARM_PEERS 64 // -T: most peers remembered from the tracker's replies
+#define SWARM_RETRY 2.0 // -T: seconds a peer is left alone after its connection failed
+#define SWARM_UPLOADS 16 // -T: most peer connections the GET responder serves at once
+#define SWARM_UNIT (PIPELINE_DEPTH * PIPELINE_PIECE) // -T: largest unit of a mirror connection, so it picks often
+#define ERASURE_BATCH 1048576 // -E: bytes of one shard per batch (1MB), fetched as one run of pipelined GETs
+#define ERASURE_WINDOW 16 // -E: batches from the oldest unwritten one that may be fetched, which bounds the memory held
+#define DELTA_COPY_RUN 4194304 // -D: most bytes of the old copy moved at once (4MB)
+#define DELTA_NONE ((size_t)-1)
+#define OUTPUT_FILE "output.dat"
+#define JOURNAL_FILE OUTPUT_FILE ".journal" // Completed blocks of OUTPUT_FILE, for resuming
+#define JOURNAL_BLOCK SWARM_BLOCK // Bytes of OUTPUT_FILE per journal bit (1MB), the same blocks a swarm announces
+#define JOURNAL_MAGIC "FTPJRNL1"
+#define JOURNAL_HEADER_SIZE (32 + FRAME_MAX_NAME + 1)
+
+// Request/response encoding; binary frames by default, text for servers that predate them
+typedef enum {
+    WIRE_TEXT,
+    WIRE_BINARY
+} WireProtocol;
+
+WireProtocol wire_protocol = WIRE_BINARY; // Tried first on every mirror
+size_t buffer_size = BUFFER_SIZE; // Most bytes asked of one recv(), and the size of each stream-mode buffer
+int checksums = 1; // Ask binary servers for per-block CRC32Cs and verify data against them
+double report_interval = 1; // Seconds between progress reports (-i), 0 for none
+int report_json = 0; // Reports and per-file completions as JSON lines on stdout (-j)
+
+// How connections are driven: a thread each, or many per event loop thread (-e)
+typedef enum {
+    ENGINE_THREADS,
+    ENGINE_EPOLL
+} Engine;
+
+Engine engine = ENGINE_THREADS;
+int event_loops = 1; // -e epoll: loop threads, 0 for one per online CPU
+
+#define FILE_MISSING ((size_t)-1)
+
+// Why probing dropped a mirror
+typedef enum {
+    PROBE_UNREACHABLE, // Connecting failed
+    PROBE_TIMED_OUT, // Connected, but CHECK had no answer within STALL_TIMEOUT
+    PROBE_NO_FILE, // Answered "not found" for every file
+    PROBE_CHECK_FAILED // Answered something else
+} ProbeFailure;
+
+// One mirror from server-info.txt and what probing learned about it
 typedef struct {
-    char *server_ip;
-    int server_port;
-    char *filename;
-    size_t offset;
-    size_t size;
-    char *output;
-} DownloadTask;
+    char ip[256];
+    int port;
+    WireProtocol protocol;
+    int reachable;
+    ProbeFailure failure; // Why probing dropped it, unless it is reachable
+    size_t file_size; // Total of the batch's files
+    size_t *sizes; // Size of each batch file from CHECK, FILE_MISSING where the mirror refused it
+    uint64_t mtime; // Newest modification time reported by CHECK, 0 if the server does not send one
+    double rtt; // Seconds for connect + CHECK
+    double throughput; // Bytes/sec over the PROBE_SAMPLE GET, 0 if it failed
+} Server;
 
-void *download_chunk(void *arg) {
-    DownloadTask *task = (DownloadTask *)arg;
+// Swarm mode (-T): another client downloading the same file, as listed by the tracker. Its GET responder serves
+// the blocks it has completed. Only touched under queue.lock.
+typedef struct {
+    Server server;
+    unsigned char *have; // Bitmap of its SWARM_BLOCK blocks, from its latest announcement
+    unsigned char *fetching; // Blocks it is downloading, in the same allocation as have
+    int listed; // In the tracker's latest reply
+    int workers; // Peer connections currently downloading from it
+    double idle_until; // Not picked again before this, after its connection failed
+} Peer;
+
+// Hedged requests: when a worker's oldest in-flight piece is late compared with how fast pieces land on the other
+// connections, an idle worker requests the same piece over its own connection. The first complete, verified copy
+// is kept and the other connection is shut down. The Hedge lives in the worker whose piece is duplicated and is
+// only touched under queue.lock.
+typedef enum {
+    HEDGE_PENDING = 1, // Both copies on their way
+    HEDGE_OWNER_WON, // The worker's own copy landed first; the hedger discards its copy
+    HEDGE_HEDGER_WON, // The hedger's copy landed first; it writes the piece
+    HEDGE_ORPHANED, // The worker's copy failed; the piece is the hedger's alone
+    HEDGE_HEDGER_FAILED // The hedger's copy failed; the piece is the worker's alone
+} HedgeState;
+
+typedef struct {
+    struct Worker *by; // Worker fetching the duplicate, NULL if the piece is not hedged
+    FrameRange range;
+    HedgeState state;
+    int parties; // Sides not yet done with the piece; the hedge is cleared when both are
+} Hedge;
+
+// Counters of one thread, bumped on the hot path and read by the reporter. Padded to a cache line so that workers
+// never write to the same one.
+typedef struct {
+    uint64_t bytes; // File data landed in the output (a piece at a time)
+    uint64_t recvs; // recv() calls for file data
+    uint64_t retries; // Connections replaced after they broke or lost a hedge race
+    uint64_t stalls; // recv() calls that timed out after STALL_TIMEOUT
+} __attribute__((aligned(64))) Counters;
 
+// One connection's download thread and its current work unit
+typedef struct Worker {
+    Server *server; // Mirror of the current connection
+    Peer *peer; // -T: the peer the current connection downloads from, NULL for a mirror connection
+    int sock; // -1 while disconnected; closed under queue.lock, so nobody shuts down a reused descriptor
+    size_t unit_next; // Next unrequested byte of the current unit
+    size_t unit_end; // End of the current unit; lowered by thieves, under queue.lock
+    double throughput; // Smoothed bytes/sec, 0 until the first piece lands
+    double window_bytes, window_seconds; // Decaying sums behind throughput
+    int steals; // Times other workers took the end of this worker's unit
+    int corrupt; // Responses that failed their checksum
+    FrameRange in_flight[PIPELINE_MAX]; // Pieces requested but not yet received, oldest first; under queue.lock
+    int head, count;
+    double waiting_since; // When the oldest in-flight piece became the one awaited
+    int receiving; // Landing its oldest piece into the output
+    int served; // A reply has started arriving on the current connection
+    Hedge hedge; // Duplicate request for its oldest piece
+    struct Worker *hedging; // Worker whose piece this one is duplicating, NULL if none
+    char *scratch; // PIPELINE_PIECE bytes where a duplicate lands before it wins
+    int hedges, hedges_won; // Duplicates this worker requested, and those that arrived first
+    int shard; // -E: the shard its mirror serves, -1 until the mirror's header is read
+    Counters counters;
+} Worker;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t file_size;
+    size_t next_offset; // Start of the part of the file no worker has claimed yet
+    FrameRange *returned; // Ranges handed back by workers whose connection broke
+    int returned_count, returned_capacity;
+    Worker *workers;
+    int worker_count;
+    Server *servers; // Reachable mirrors, best first
+    int server_count;
+    int mirror_workers; // Mirror connection threads still running
+    pthread_cond_t landed; // Signalled when a worker stops receiving its oldest piece
+} WorkQueue;
+
+// Swarm mode (-T): the client serves the blocks it has completed from a GET responder, announces them to a tracker
+// and downloads from the peers the tracker lists over extra connections
+typedef struct {
+    int enabled;
+    Server tracker;
+    int listen_sock; // The GET responder's
+    int port;
+    int fd; // OUTPUT_FILE, read-only, for the responder
+    int complete; // Every block is in OUTPUT_FILE, journal or not; under journal.lock
+    size_t bitmap_size; // Bytes of an announced bitmap
+    Peer peers[SWARM_PEERS]; // Under queue.lock, like the rest below
+    int peer_count;
+    unsigned char *available; // Blocks some listed peer we can reach has or is downloading
+    int peer_workers; // -P: connections downloading from peers; with none, mirror connections fetch everything
+    int uploads; // Peer connections being served
+    int stop; // Set for the announcer's last round
+    pthread_t announcer;
+    double linger; // -L: seconds to keep serving after the download
+    uint64_t served; // Bytes sent to peers
+} Swarm;
+
+Swarm swarm = { .listen_sock = -1, .fd = -1 };
+
+// Erasure-coded download (-E): each mirror serves one shard of <file>.rs (see rs.h). A batch is the stripes that
+// ERASURE_BATCH bytes of each shard cover. Connections fetch batches of their mirror's shard, and the first k shards
+// of a batch to land rebuild it: shards that land later are dropped, so the slowest mirrors can be left behind.
+// Under queue.lock.
+typedef struct {
+    char *shards[RS_MAX_SHARDS]; // Landed data of each shard, NULL until then; the rebuilding thread's once decoded
+    uint32_t requested; // Shards requested or landed, a bit per index
+    uint32_t landed;
+    int decoded; // k shards landed and the batch is being rebuilt
+    int written;
+} ErasureBatch;
+
+typedef struct {
+    int enabled;
+    RsLayout layout; // From the fastest mirror's shard header; every other mirror must agree
+    size_t batch_stripes;
+    size_t batch_count;
+    ErasureBatch *batches;
+    size_t oldest; // First batch not yet written
+    int live[RS_MAX_SHARDS]; // Connections still fetching each shard
+    int pending; // Connections that have not read their mirror's header yet
+    int failed; // Some batch can no longer be written
+    pthread_cond_t changed; // Signalled when a batch is written, a request is given up or a connection ends
+    uint64_t wire_bytes; // Shard bytes received
+    uint64_t late; // Shards that landed after their batch was rebuilt
+} Erasure;
+
+Erasure erasure = { .changed = PTHREAD_COND_INITIALIZER };
+
+// Delta sync (-D): OUTPUT_FILE holds an old copy of the file. A mirror signs every block of the new file
+// (SIGNATURES), the blocks found anywhere in the old copy are moved to their offsets, and only the rest is fetched.
+typedef struct {
+    int enabled;
+    size_t block; // Bytes per signed block, from the file size
+    uint64_t signature_bytes; // Received from mirrors
+    size_t found; // Bytes of the new file found in the old copy
+    size_t in_place; // Blocks found at their own offset, which did not move
+    double scan_seconds;
+} Delta;
+
+Delta delta;
+
+// Connect to a server, retrying a few times. Returns the socket or -1.
+int connect_to_server(const char *server_ip, int server_port)
+{
     // Create client socket
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1)
     {
         perror("Socket creation failed\n");
-        pthread_exit(NULL);
+        return -1;
     }
 
     // Construct server address info
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(task->server_port);
-    inet_pton(AF_INET, task->server_ip, &server_addr.sin_addr);
+    server_addr.sin_port = htons(server_port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
 
     // Connect to server
     int retries = 3;
-    while (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 && retries > 0) {
+    while (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        if (retries-- == 0) {
+            fprintf(stderr, "Unable to connect to %s:%d\n", server_ip, server_port);
+            close(sock);
+            return -1;
+        }
         perror("Connection failed, retrying...");
-        retries--;
         sleep(1);
     }
-    if (retries == 0) {
-        fprintf(stderr, "Unable to connect to %s:%d\n", task->server_ip, task->server_port);
-        close(sock);
-        pthread_exit(NULL);
+    return sock;
+}
+
+// Parse a status line without its newline. Returns 0 and sets *value (and *mtime, if given) for OK, -1 otherwise.
+int parse_status(const char *line, size_t *value, uint64_t *mtime)
+{
+    unsigned long long stamp = 0; // CHECK replies may carry the modification time after the size
+    if (sscanf(line, "OK %zu %llu", value, &stamp) < 1) {
+        fprintf(stderr, "Server replied: %s\n", line);
+        return -1;
     }
+    if (mtime) {
+        *mtime = stamp;
+    }
+    return 0;
+}
 
-    fprintf(stdout, "Connected to %s:%d.\n", task->server_ip, task->server_port);
+// Encode a CHECK or GET in the given wire protocol into request (REQUEST_MAX bytes). Returns its length, or -1 if
+// it does not fit.
+int format_request(WireProtocol protocol, int opcode, uint32_t request_id, const char *filename, size_t offset, size_t length, char *request)
+{
+    size_t request_len;
 
-    // Make GET request
-    char request[BUFFER_SIZE];
-    snprintf(request, BUFFER_SIZE, "GET %s %zu %zu", task->filename, task->offset, task->size);
-    if (write(sock, request, strlen(request)) == -1)
-    {
+    if (protocol == WIRE_BINARY) {
+        size_t name_len = strlen(filename);
+        if (name_len > FRAME_MAX_NAME) {
+            fprintf(stderr, "Filename too long: %s\n", filename);
+            return -1;
+        }
+        FrameHeader header = {
+            .version = FRAME_VERSION, .opcode = opcode, .name_len = name_len,
+            .request_id = request_id, .offset = offset, .length = length,
+            .flags = (opcode != FRAME_CHECK && checksums) ? FRAME_FLAG_CRC32C : 0
+        };
+        frame_encode(&header, (unsigned char *)request);
+        memcpy(request + FRAME_HEADER_SIZE, filename, name_len);
+        request_len = FRAME_HEADER_SIZE + name_len;
+    } else if (opcode == FRAME_CHECK) {
+        request_len = snprintf(request, REQUEST_MAX, "CHECK %s\n", filename);
+    } else {
+        request_len = snprintf(request, REQUEST_MAX, "GET %s %zu %zu\n", filename, offset, length);
+    }
+    if (request_len >= REQUEST_MAX) {
+        fprintf(stderr, "Request too long for %s\n", filename);
+        return -1;
+    }
+    return request_len;
+}
+
+// Send a CHECK or GET in the current wire protocol. Returns -1 on failure.
+int send_request(int sock, WireProtocol protocol, int opcode, uint32_t request_id, const char *filename, size_t offset, size_t length)
+{
+    char request[REQUEST_MAX];
+    int request_len = format_request(protocol, opcode, request_id, filename, offset, length, request);
+    if (request_len == -1 || write(sock, request, request_len) != request_len) {
         perror("Write failed.");
-        close(sock);
-        pthread_exit(NULL);
+        return -1;
+    }
+    return 0;
+}
+
+// Decode a reply frame and check that it answers request <request_id>. Returns 0 and fills *reply if it does, -1 if
+// the server refused the request, -2 if the frame is malformed or answers something else.
+int check_frame(const unsigned char *frame, int opcode, uint32_t request_id, FrameHeader *reply)
+{
+    FrameHeader header;
+    if (frame_decode(frame, &header) == -1) {
+        fprintf(stderr, "Missing or malformed response frame\n");
+        return -2;
+    }
+    if (header.status != STATUS_OK) {
+        fprintf(stderr, "Server replied: %s\n", status_message(header.status));
+        return -1;
+    }
+    if (header.version != FRAME_VERSION || header.opcode != opcode || header.request_id != request_id) {
+        fprintf(stderr, "Unexpected response frame (opcode %d, request %u)\n", header.opcode, header.request_id);
+        return -2;
+    }
+    *reply = header;
+    return 0;
+}
+
+// read_reply() for callers that read the socket themselves: parse the reply from the len bytes received so far.
+// Returns the length of the header and fills *reply, 0 if more bytes are needed, or read_reply()'s -1 and -2.
+int parse_reply(const char *data, size_t len, WireProtocol protocol, int opcode, uint32_t request_id, FrameHeader *reply)
+{
+    if (protocol == WIRE_TEXT) {
+        const char *newline = memchr(data, '\n', (len < HEADER_SIZE) ? len : HEADER_SIZE);
+        if (!newline) {
+            return (len < HEADER_SIZE) ? 0 : -2;
+        }
+        char line[HEADER_SIZE + 1];
+        size_t line_len = newline - data;
+        memcpy(line, data, line_len);
+        line[line_len] = '\0';
+        size_t value;
+        uint64_t mtime;
+        if (parse_status(line, &value, &mtime) == -1) {
+            return -1;
+        }
+        *reply = (FrameHeader){ .opcode = opcode, .request_id = request_id, .offset = mtime, .length = value };
+        return line_len + 1;
+    }
+
+    if (len > 0 && (unsigned char)data[0] != (FRAME_MAGIC >> 8)) {
+        fprintf(stderr, "Missing or malformed response frame\n");
+        return -2;
+    }
+    if (len < FRAME_HEADER_SIZE) {
+        return 0;
+    }
+    int status = check_frame((const unsigned char *)data, opcode, request_id, reply);
+    return (status == 0) ? FRAME_HEADER_SIZE : status;
+}
+
+// Read the reply to the request <request_id>: a frame header, or a text status line.
+// Returns 0 and fills *reply on success: length is the file size for CHECK and the body length for GET, offset
+// the mtime for CHECK, flags whether checksums follow. Returns -1 if the server refused the request, -2 if the
+// reply is missing or not understood.
+int read_reply(int sock, WireProtocol protocol, int opcode, uint32_t request_id, FrameHeader *reply)
+{
+    if (protocol == WIRE_TEXT) {
+        // Take the status line as it arrives and hand it to parse_reply() once it is whole. Only bytes up to its
+        // newline are consumed, leaving the data after it to the caller.
+        char line[HEADER_SIZE];
+        size_t len = 0;
+        int status = 0;
+        while (status == 0) {
+            ssize_t peeked = recv(sock, line + len, sizeof(line) - len, MSG_PEEK); // Blocks until more arrives
+            if (peeked <= 0) {
+                fprintf(stderr, "Missing or malformed response header\n");
+                return -2;
+            }
+            char *newline = memchr(line + len, '\n', peeked);
+            size_t taken = newline ? (size_t)(newline - (line + len)) + 1 : (size_t)peeked;
+            if (recv(sock, line + len, taken, 0) != (ssize_t)taken) {
+                return -2;
+            }
+            len += taken;
+            status = parse_reply(line, len, protocol, opcode, request_id, reply);
+        }
+        if (status == -2) {
+            fprintf(stderr, "Missing or malformed response header\n");
+        }
+        return (status > 0) ? 0 : status;
+    }
+
+    // A server without binary support may answer in text, which is shorter than a frame: check the first byte
+    // before waiting for a whole header
+    unsigned char frame[FRAME_HEADER_SIZE];
+    if (recv(sock, frame, 1, MSG_PEEK) != 1 || frame[0] != (FRAME_MAGIC >> 8)
+        || recv(sock, frame, sizeof(frame), MSG_WAITALL) != sizeof(frame)) {
+        fprintf(stderr, "Missing or malformed response frame\n");
+        return -2;
+    }
+    return check_frame(frame, opcode, request_id, reply);
+}
+
+// Receive the checksums that precede a range's data in a reply flagged FRAME_FLAG_CRC32C.
+// Returns -1 if the connection breaks.
+int read_checksums(int sock, size_t length, uint32_t *crcs)
+{
+    size_t count = (length + CHECKSUM_BLOCK - 1) / CHECKSUM_BLOCK;
+    if (count > CHECKSUM_MAX_BLOCKS || recv(sock, crcs, 4 * count, MSG_WAITALL) != (ssize_t)(4 * count)) {
+        fprintf(stderr, "Missing checksums\n");
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        crcs[i] = be32toh(crcs[i]);
     }
+    return 0;
+}
 
-    // Retrieve GET response
-    ssize_t bytes_remaining = task->size;
-    char *output_ptr = task->output;
+// Counters of the calling thread: its worker's, or repair_counters on the main thread; NULL while probing
+__thread Counters *thread_counters;
+Counters repair_counters;
+
+// Receive exactly length bytes of file data into output. Returns -1 if the connection breaks first.
+int recv_body(int sock, char *output, size_t length)
+{
+    ssize_t bytes_remaining = length;
+    char *output_ptr = output;
     while (bytes_remaining > 0) {
-        size_t bytes_to_read = (bytes_remaining > BUFFER_SIZE) ? BUFFER_SIZE : bytes_remaining;
+        size_t bytes_to_read = ((size_t)bytes_remaining > buffer_size) ? buffer_size : (size_t)bytes_remaining;
         ssize_t bytes_received = recv(sock, output_ptr, bytes_to_read, 0);
-
-        fprintf(stderr, "Before recv: bytes_remaining=%zd\n", bytes_remaining);
+        if (thread_counters) {
+            counter_add(&thread_counters->recvs, 1);
+        }
 
         if (bytes_received <= 0) {
             if (bytes_received == 0) {
                 fprintf(stderr, "Server closed connection prematurely. Bytes remaining: %zd\n", bytes_remaining);
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                fprintf(stderr, "No data for %d s, %zd bytes remaining\n", STALL_TIMEOUT, bytes_remaining);
+                if (thread_counters) {
+                    counter_add(&thread_counters->stalls, 1);
+                }
             } else {
                 perror("Error reading from socket");
             }
-            close(sock);
-            pthread_exit((void *)1); // Failure
-        }
-
-        // Defensive check
-        if (bytes_received > bytes_remaining) {
-            fprintf(stderr, "Error: Received more data than expected! bytes_received=%zd, bytes_remaining=%zd\n", bytes_received, bytes_remaining);
-            pthread_exit(NULL);
+            return -1;
         }
 
         bytes_remaining -= bytes_received;
         output_ptr += bytes_received;
+        LOG_DEBUG("Received %zd bytes, %zd bytes remaining\n", bytes_received, bytes_remaining);
+    }
+    return 0;
+}
+
+// Shared work queue: workers claim units from the unclaimed tail of the file, sized to their own throughput.
+// Once the tail is gone, an idle worker steals the unrequested end of the slowest-to-finish worker's unit.
+WorkQueue queue;
 
-        fprintf(stderr, "Received %zd bytes, %zd bytes remaining\n", bytes_received, bytes_remaining);
+// Queue a range for another worker (or the final repair pass)
+void return_range(size_t offset, size_t length)
+{
+    if (length == 0) {
+        return;
+    }
+    if (queue.returned_count == queue.returned_capacity) {
+        queue.returned_capacity = queue.returned_capacity ? queue.returned_capacity * 2 : 16;
+        queue.returned = realloc(queue.returned, queue.returned_capacity * sizeof(FrameRange));
+        if (!queue.returned) {
+            perror("Failed to grow the work queue");
+            exit(EXIT_FAILURE);
+        }
     }
+    queue.returned[queue.returned_count++] = (FrameRange){ offset, length };
+}
 
-    close(sock);
-    // pthread_exit((void *)0); // Success
+// Sidecar journal of the JOURNAL_BLOCK blocks of OUTPUT_FILE that have landed, so an interrupted download resumes
+// where it stopped. Layout: JOURNAL_MAGIC, then file size, mtime and block size as big-endian u64, the filename
+// padded to FRAME_MAX_NAME + 1 bytes, then one bit per block. A block's bit is written once all its bytes are in.
+typedef struct {
+    int fd; // -1 when there is no journal (-o memory)
+    size_t file_size;
+    size_t block_count;
+    unsigned char *bitmap;
+    uint32_t *landed; // Bytes of each block received by this run
+    pthread_mutex_t lock;
+} Journal;
+
+Journal journal = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+size_t journal_block_length(size_t block)
+{
+    size_t start = block * JOURNAL_BLOCK;
+    return (journal.file_size - start > JOURNAL_BLOCK) ? JOURNAL_BLOCK : journal.file_size - start;
 }
 
-int main(int argc, char *argv[]) {
+// Open the journal for this download. If it describes the same file (name, size and mtime from CHECK) and
+// OUTPUT_FILE is still there at full size, its blocks are kept; otherwise it starts over. Returns the bytes
+// already landed by earlier runs.
+size_t journal_open(const char *filename, size_t file_size, uint64_t mtime)
+{
+    unsigned char header[JOURNAL_HEADER_SIZE] = {0};
+    uint64_t fields[3] = { htobe64(file_size), htobe64(mtime), htobe64(JOURNAL_BLOCK) };
+    memcpy(header, JOURNAL_MAGIC, 8);
+    memcpy(header + 8, fields, sizeof(fields));
+    strncpy((char *)header + 32, filename, FRAME_MAX_NAME);
 
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <server-info.txt> <num-connections> <filename>\n", argv[0]);
+    journal.file_size = file_size;
+    journal.block_count = (file_size + JOURNAL_BLOCK - 1) / JOURNAL_BLOCK;
+    size_t bitmap_size = (journal.block_count + 7) / 8;
+    journal.bitmap = calloc(bitmap_size, 1);
+    journal.landed = calloc(journal.block_count, sizeof(uint32_t));
+    journal.fd = open(JOURNAL_FILE, O_RDWR | O_CREAT, 0644);
+    if (!journal.bitmap || !journal.landed || journal.fd == -1) {
+        perror("Failed to open " JOURNAL_FILE);
         exit(EXIT_FAILURE);
     }
 
-    char *server_info_file = argv[1];
-    int num_connections = atoi(argv[2]);
-    char *filename = argv[3];
+    unsigned char existing[JOURNAL_HEADER_SIZE];
+    struct stat st;
+    if (pread(journal.fd, existing, sizeof(existing), 0) == sizeof(existing) && memcmp(existing, header, sizeof(header)) == 0
+        && pread(journal.fd, journal.bitmap, bitmap_size, JOURNAL_HEADER_SIZE) == (ssize_t)bitmap_size
+        && stat(OUTPUT_FILE, &st) == 0 && (size_t)st.st_size == file_size) {
+        size_t done = 0;
+        for (size_t block = 0; block < journal.block_count; block++) {
+            if (journal.bitmap[block / 8] & (1 << (block % 8))) {
+                done += journal_block_length(block);
+            }
+        }
+        return done;
+    }
 
-    FILE *file = fopen(server_info_file, "r");
-    if (!file) {
-        perror("Server info file open failed");
+    memset(journal.bitmap, 0, bitmap_size);
+    if (ftruncate(journal.fd, 0) == -1 || pwrite(journal.fd, header, sizeof(header), 0) != sizeof(header)
+        || pwrite(journal.fd, journal.bitmap, bitmap_size, JOURNAL_HEADER_SIZE) != (ssize_t)bitmap_size) {
+        perror("Failed to write " JOURNAL_FILE);
         exit(EXIT_FAILURE);
     }
+    return 0;
+}
 
-    char servers[10][256];
-    int ports[10], server_count = 0;
+// Count a range that has fully landed; blocks it completes are recorded in the journal straight away
+void journal_mark(size_t offset, size_t length)
+{
+    if (journal.fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&journal.lock);
+    while (length > 0) {
+        size_t block = offset / JOURNAL_BLOCK;
+        size_t bytes = (block + 1) * JOURNAL_BLOCK - offset;
+        if (bytes > length) {
+            bytes = length;
+        }
+        journal.landed[block] += bytes;
+        if (journal.landed[block] == journal_block_length(block)) {
+            journal.bitmap[block / 8] |= 1 << (block % 8);
+            if (pwrite(journal.fd, &journal.bitmap[block / 8], 1, JOURNAL_HEADER_SIZE + block / 8) != 1) {
+                perror("Error updating " JOURNAL_FILE); // The block is fetched again if the download is resumed
+            }
+        }
+        offset += bytes;
+        length -= bytes;
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
 
-    while (fscanf(file, "%s %d", servers[server_count], &ports[server_count]) != EOF) {
-        server_count++;
+// The download completed: the journal is no longer needed
+void journal_remove(void)
+{
+    if (journal.fd != -1) {
+        close(journal.fd);
+        unlink(JOURNAL_FILE);
     }
-    fclose(file);
+    pthread_mutex_lock(&journal.lock); // The swarm responder may be looking
+    free(journal.bitmap);
+    free(journal.landed);
+    journal.bitmap = NULL;
+    journal.landed = NULL;
+    pthread_mutex_unlock(&journal.lock);
+}
 
-    // Assume the first server for file size check
-    char buffer[BUFFER_SIZE];
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+// The files of one run. A plain download is a batch of one file, landing in OUTPUT_FILE; a manifest (-M) lists
+// many, each with its own destination. The work queue sees the batch as one file with the files laid end to end,
+// so its units pack runs of small files onto one connection and stripe large files over several. Pieces never
+// cross from one file into the next, and requests name the piece's file and its offset in that file.
+typedef struct {
+    char name[FRAME_MAX_NAME + 1]; // On the mirrors
+    char *path; // Destination
+    size_t start; // Offset of the file in the batch
+    size_t size;
+    int missing; // No mirror has it; it takes no space in the batch
+    int fd; // -o stream: the destination while it is being written, -1 otherwise; under output.lock
+    size_t landed; // Bytes verified and written; under output.lock
+} BatchFile;
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(ports[0]);
-    inet_pton(AF_INET, servers[0], &server_addr.sin_addr);
+typedef struct {
+    BatchFile *files;
+    int count;
+    const char *manifest; // -M, NULL for a single file
+} Batch;
 
-    connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    snprintf(buffer, BUFFER_SIZE, "CHECK %s", filename);
-    write(sock, buffer, strlen(buffer));
-    bzero(buffer, BUFFER_SIZE);
+Batch batch;
 
-    read(sock, buffer, BUFFER_SIZE);
-    size_t file_size;
-    sscanf(buffer, "OK %zu", &file_size);
-    fprintf(stderr, "server CHECK response: %s\n", buffer);
-    close(sock);
+// The file holding a byte of the batch. Empty files start where the next file does, so the last file starting at
+// or before offset is the one that holds it.
+BatchFile *batch_file(size_t offset)
+{
+    int low = 0, high = batch.count - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (batch.files[middle].start <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return &batch.files[low];
+}
+
+// Add a file to the batch
+void batch_add(const char *name, const char *path)
+{
+    if (strlen(name) > FRAME_MAX_NAME) {
+        fprintf(stderr, "Filename too long: %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    BatchFile *files = realloc(batch.files, (batch.count + 1) * sizeof(BatchFile));
+    if (!files || !(path = strdup(path))) {
+        perror("Failed to allocate the batch");
+        exit(EXIT_FAILURE);
+    }
+    batch.files = files;
+    BatchFile *file = &batch.files[batch.count++];
+    memset(file, 0, sizeof(BatchFile));
+    snprintf(file->name, sizeof(file->name), "%s", name);
+    file->path = (char *)path;
+    file->fd = -1;
+}
 
-    if (file_size <= 0) {
-        fprintf(stderr, "Error: Invalid file size (%zu)\n", file_size);
+// Read a manifest: one "<filename> [<destination>]" per line, the destination defaulting to the filename's last
+// component. Blank lines and lines starting with '#' are skipped.
+void batch_load(const char *manifest)
+{
+    FILE *file = fopen(manifest, "r");
+    if (!file) {
+        perror("Manifest open failed");
         exit(EXIT_FAILURE);
     }
-    if (num_connections > file_size) {
-        fprintf(stderr, "Warning: More connections than file size. Reducing connections.\n");
-        num_connections = file_size;
+    char line[2 * PATH_MAX], name[PATH_MAX], path[PATH_MAX];
+    while (fgets(line, sizeof(line), file)) {
+        int fields = sscanf(line, "%4095s %4095s", name, path);
+        if (fields < 1 || name[0] == '#') {
+            continue;
+        }
+        const char *base = strrchr(name, '/');
+        batch_add(name, (fields == 2) ? path : (base ? base + 1 : name));
+    }
+    fclose(file);
+    batch.manifest = manifest;
+    if (batch.count == 0) {
+        fprintf(stderr, "%s lists no files\n", manifest);
+        exit(EXIT_FAILURE);
     }
+}
 
-    // Set chunk size (minimum: 1)
-    size_t chunk_size = file_size / num_connections;
-    if (chunk_size < 1) {
-        chunk_size = 1;
+// Create the missing directories on the way to path
+void make_parents(const char *path)
+{
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", path);
+    for (char *slash = strchr(parent + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(parent, 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "Failed to create %s: %s\n", parent, strerror(errno));
+        }
+        *slash = '/';
     }
-    fprintf(stderr, "file_size: %zu, chunk_size: %zu, num_connections: %d\n", file_size, chunk_size, num_connections);
+}
 
-    pthread_t threads[num_connections];
-    DownloadTask tasks[num_connections];
-    // char *file_data = malloc(file_size);
-    char *file_data = calloc(file_size, sizeof(char));
-    if (!file_data) {
-        perror("Failed to allocate file_data");
-        exit(EXIT_FAILURE);
+// Where received file data goes: the whole file in memory, written out once complete; output.dat written
+// in place with pwrite() through a pool of buffer_size buffers, so memory stays proportional to connections;
+// or output.dat mapped MAP_SHARED, so data is received straight into the page cache and the kernel writes it back
+typedef enum {
+    OUTPUT_MEMORY,
+    OUTPUT_STREAM,
+    OUTPUT_MMAP
+} OutputMode;
+
+typedef struct {
+    OutputMode mode;
+    char *data; // OUTPUT_MEMORY: the whole file; OUTPUT_MMAP: the mapping of fd
+    int fd; // OUTPUT_STREAM, OUTPUT_MMAP: OUTPUT_FILE, preallocated to the file size
+    char **pool; // OUTPUT_STREAM: buffers not currently lent to a worker
+    int pool_count, pool_size;
+    pthread_mutex_t lock;
+    pthread_cond_t returned;
+} Output;
+
+Output output = { .mode = OUTPUT_STREAM, .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .returned = PTHREAD_COND_INITIALIZER };
+
+// Reserve a file's blocks up front: scattered pwrite()s then neither fragment it nor run out of space halfway.
+// Returns 0 or an errno.
+int reserve_file(int fd, size_t size)
+{
+    int err = posix_fallocate(fd, 0, size);
+    if (err == EOPNOTSUPP || err == EINVAL) {
+        err = (ftruncate(fd, size) == -1) ? errno : 0;
+    }
+    return err;
+}
+
+// Open a manifest file's destination, creating missing directories. Returns the descriptor, or -1.
+// Called with output.lock held, or before the workers start.
+int batch_open(BatchFile *file)
+{
+    if (file->fd != -1) {
+        return file->fd;
+    }
+    make_parents(file->path);
+    int fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int err = (fd == -1) ? errno : reserve_file(fd, file->size);
+    if (err) {
+        fprintf(stderr, "Failed to open %s: %s\n", file->path, strerror(err));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
     }
+    file->fd = fd;
+    return fd;
+}
 
-    for (int i = 0; i < num_connections; i++) {
-        tasks[i].server_ip = servers[i % server_count];
-        tasks[i].server_port = ports[i % server_count];
-        tasks[i].filename = filename;
-        tasks[i].offset = i * chunk_size;
+// A manifest file is complete: close it and report it, as a line on stderr or, with -j, a JSON object on stdout.
+// Called with output.lock held, or once the workers are done.
+void batch_complete(BatchFile *file)
+{
+    if (file->fd != -1 && close(file->fd) == -1) {
+        fprintf(stderr, "Error closing %s: %s\n", file->path, strerror(errno));
+    }
+    file->fd = -1;
+    if (report_json) {
+        printf("{\"file\": \"%s\", \"path\": \"%s\", \"bytes\": %zu, \"complete\": true}\n", file->name, file->path, file->size);
+        fflush(stdout);
+    } else {
+        LOG_INFO("Completed %s -> %s (%zu bytes)\n", file->name, file->path, file->size);
+    }
+}
 
-        // Adjust the last chunk to handle any remaining bytes
-        tasks[i].size = (i == num_connections - 1) ? file_size - (chunk_size * i) : chunk_size;
+// Bytes of the batch were verified and written. Manifest files that are now complete are closed and reported; in
+// memory mode that waits until output_close() writes them out.
+void batch_settle(size_t offset, size_t length)
+{
+    pthread_mutex_lock(&output.lock);
+    while (length > 0) {
+        BatchFile *file = batch_file(offset);
+        size_t part = (file->start + file->size - offset < length) ? file->start + file->size - offset : length;
+        file->landed += part;
+        if (file->landed == file->size && batch.manifest && output.mode == OUTPUT_STREAM) {
+            batch_complete(file);
+        }
+        offset += part;
+        length -= part;
+    }
+    pthread_mutex_unlock(&output.lock);
+}
 
-        // Validate the chunk size & offset
-        if (tasks[i].size <= 0 || tasks[i].offset + tasks[i].size > file_size) {
-            fprintf(stderr, "Error: Invalid chunk calculation assigned to thread %d (Offset: %zu, Size: %zu)\n", i, tasks[i].offset, tasks[i].size);
-            free(file_data);
+// Set up the destination for file_size bytes. A stream pool gets buffers buffers: one per connection, or one per
+// event loop.
+void output_open(size_t file_size, int buffers, int resume)
+{
+    if (output.mode == OUTPUT_MEMORY) {
+        output.data = calloc(file_size ? file_size : 1, sizeof(char));
+        if (!output.data) {
+            perror("Failed to allocate file_data");
             exit(EXIT_FAILURE);
         }
+        return;
+    }
 
-        fprintf(stderr, "Thread %d: Assigned chunk - Offset: %zu, Size: %zu\n", i, tasks[i].offset, tasks[i].size);
-
-        tasks[i].output = file_data + tasks[i].offset;
+    if (!batch.manifest) {
+        // A resumed download keeps the blocks earlier runs left in the file
+        output.fd = open(OUTPUT_FILE, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+        if (output.fd == -1) {
+            perror("Failed to open " OUTPUT_FILE);
+            exit(EXIT_FAILURE);
+        }
+        int err = reserve_file(output.fd, file_size);
+        if (err) {
+            fprintf(stderr, "Failed to preallocate " OUTPUT_FILE ": %s\n", strerror(err));
+            exit(EXIT_FAILURE);
+        }
+        batch.files[0].fd = output.fd;
+    } else {
+        // Manifest destinations are opened by the first write to them; empty files never get one
+        for (int i = 0; i < batch.count; i++) {
+            BatchFile *file = &batch.files[i];
+            if (!file->missing && file->size == 0 && batch_open(file) != -1) {
+                batch_complete(file);
+            }
+        }
+    }
 
-        // Create the thread
-        if (pthread_create(&threads[i], NULL, download_chunk, (void *)&tasks[i]) != 0) {
-            perror("Error creating thread");
-            free(file_data);
+    if (output.mode == OUTPUT_MMAP) {
+        output.data = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, output.fd, 0);
+        if (output.data == MAP_FAILED) {
+            perror("Failed to map " OUTPUT_FILE);
             exit(EXIT_FAILURE);
         }
+        // Each worker fills its units front to back; nothing is read back before msync()
+        madvise(output.data, file_size, MADV_SEQUENTIAL);
+        return;
+    }
+
+    output.pool = malloc(buffers * sizeof(char *));
+    for (int i = 0; output.pool && i < buffers; i++) {
+        output.pool[i] = pool_get(buffer_size);
+        if (!output.pool[i]) {
+            output.pool = NULL;
+        }
+    }
+    if (!output.pool) {
+        perror("Failed to allocate output buffers");
+        exit(EXIT_FAILURE);
+    }
+    output.pool_count = output.pool_size = buffers;
+}
+
+// Take a stream buffer from the pool, waiting for one if all are lent out
+char *output_borrow(void)
+{
+    pthread_mutex_lock(&output.lock);
+    while (output.pool_count == 0) {
+        pthread_cond_wait(&output.returned, &output.lock);
+    }
+    char *buffer = output.pool[--output.pool_count];
+    pthread_mutex_unlock(&output.lock);
+    return buffer;
+}
+
+void output_return(char *buffer)
+{
+    pthread_mutex_lock(&output.lock);
+    output.pool[output.pool_count++] = buffer;
+    pthread_cond_signal(&output.returned);
+    pthread_mutex_unlock(&output.lock);
+}
+
+// Check length bytes of a range's data, starting first_block blocks into the range, against the range's
+// checksums. Returns a mask of the blocks that do not match, by their index in the range.
+uint64_t verify_blocks(const char *data, size_t length, size_t first_block, const uint32_t *crcs)
+{
+    uint64_t corrupt = 0;
+    for (size_t done = 0; done < length; done += CHECKSUM_BLOCK) {
+        size_t bytes = (length - done > CHECKSUM_BLOCK) ? CHECKSUM_BLOCK : length - done;
+        size_t block = first_block + done / CHECKSUM_BLOCK;
+        if (crc32c(0, data + done, bytes) != crcs[block]) {
+            corrupt |= 1ULL << block;
+        }
     }
+    return corrupt;
+}
 
-    int thread_status;
-    for (int i = 0; i < num_connections; i++) {
-        pthread_join(threads[i], (void **)&thread_status);
-        if (thread_status != 0)
-        {
-            fprintf(stderr, "Thread %d failed to download its chunk\n", i);
+// Like verify_blocks() for data that arrives in pieces of any size: bytes of a range's data starting position bytes
+// into the range (length bytes long), with *crc the checksum so far of the block position falls in. Returns a mask
+// of the blocks completed here that do not match.
+uint64_t verify_partial(const char *data, size_t bytes, size_t position, size_t length, uint32_t *crc, const uint32_t *crcs)
+{
+    uint64_t corrupt = 0;
+    for (size_t done = 0; done < bytes; ) {
+        size_t block = (position + done) / CHECKSUM_BLOCK;
+        size_t block_end = (length - block * CHECKSUM_BLOCK > CHECKSUM_BLOCK) ? (block + 1) * CHECKSUM_BLOCK : length;
+        size_t part = (block_end - position - done < bytes - done) ? block_end - position - done : bytes - done;
+        *crc = crc32c(*crc, data + done, part);
+        done += part;
+        if (position + done == block_end) {
+            if (*crc != crcs[block]) {
+                corrupt |= 1ULL << block;
+            }
+            *crc = 0;
         }
     }
+    return corrupt;
+}
 
-    FILE *output_file = fopen("output.dat", "wb");
-    fwrite(file_data, 1, file_size, output_file);
-    fclose(output_file);
+// A range has been received in full: record its good blocks in the journal and queue the corrupt ones to be
+// fetched again, by whichever worker claims them next. Returns -2 if any block was corrupt, 0 otherwise.
+int settle_range(size_t offset, size_t length, uint64_t corrupt)
+{
+    if (!corrupt) {
+        journal_mark(offset, length);
+        batch_settle(offset, length);
+        return 0;
+    }
+    for (size_t done = 0, block = 0; done < length; done += CHECKSUM_BLOCK, block++) {
+        size_t bytes = (length - done > CHECKSUM_BLOCK) ? CHECKSUM_BLOCK : length - done;
+        if (corrupt & (1ULL << block)) {
+            fprintf(stderr, "Checksum mismatch for %zu bytes at offset %zu, fetching them again\n", bytes, offset + done);
+            pthread_mutex_lock(&queue.lock);
+            return_range(offset + done, bytes);
+            pthread_mutex_unlock(&queue.lock);
+        } else {
+            journal_mark(offset + done, bytes);
+            batch_settle(offset + done, bytes);
+        }
+    }
+    return -2;
+}
 
-    free(file_data);
+// Copy data that was received elsewhere (a hedged piece) to its offset in the output. Returns -1 if the write fails.
+int write_output(const char *data, size_t length, size_t offset)
+{
+    if (output.mode != OUTPUT_STREAM) {
+        memcpy(output.data + offset, data, length);
+        return 0;
+    }
+    for (size_t written = 0; written < length; ) {
+        BatchFile *file = batch_file(offset + written);
+        pthread_mutex_lock(&output.lock);
+        int fd = batch_open(file);
+        pthread_mutex_unlock(&output.lock);
+        size_t end = file->start + file->size;
+        size_t part = (end - offset - written < length - written) ? end - offset - written : length - written;
+        ssize_t result = (fd == -1) ? -1 : pwrite(fd, data + written, part, offset + written - file->start);
+        if (result <= 0) {
+            fprintf(stderr, "Error writing %s: %s\n", file->path, strerror(errno));
+            return -1;
+        }
+        written += result;
+    }
     return 0;
 }
+
+// Receive length bytes of file data straight to offset in the output. With crcs (the range's checksums), every
+// block is verified as it arrives and *corrupt gets the mask of blocks that failed. Returns -1 on a broken
+// connection or a failed write.
+int receive_body(int sock, size_t offset, size_t length, const uint32_t *crcs, uint64_t *corrupt)
+{
+    *corrupt = 0;
+    if (output.mode != OUTPUT_STREAM) {
+        if (recv_body(sock, output.data + offset, length) == -1) {
+            return -1;
+        }
+        if (crcs) {
+            *corrupt = verify_blocks(output.data + offset, length, 0, crcs);
+        }
+        return 0;
+    }
+
+    char *buffer = output_borrow();
+
+    // Buffers need not hold whole blocks, so each block's checksum is carried from one buffer to the next
+    int status = 0;
+    uint32_t crc = 0;
+    for (size_t landed = 0; status == 0 && landed < length; ) {
+        size_t bytes = (length - landed > buffer_size) ? buffer_size : length - landed;
+        status = recv_body(sock, buffer, bytes);
+        if (status == 0 && crcs) {
+            *corrupt |= verify_partial(buffer, bytes, landed, length, &crc, crcs);
+        }
+        if (status == 0) {
+            status = write_output(buffer, bytes, offset + landed);
+        }
+        landed += bytes;
+    }
+
+    output_return(buffer);
+    return status;
+}
+
+// Receive a range into the output and settle it: record it in the journal, queueing corrupt blocks again.
+// Returns -1 on a broken connection or a failed write, -2 if some blocks were corrupt (the connection is still
+// usable).
+int land_body(int sock, size_t offset, size_t length, const uint32_t *crcs)
+{
+    uint64_t corrupt;
+    if (receive_body(sock, offset, length, crcs, &corrupt) == -1) {
+        return -1;
+    }
+    if (thread_counters) {
+        counter_add(&thread_counters->bytes, length);
+    }
+    return settle_range(offset, length, corrupt);
+}
+
+// Every byte has landed: write the in-memory file out, or finish the streamed one
+void output_close(size_t file_size)
+{
+    if (output.mode == OUTPUT_MEMORY && batch.manifest) {
+        for (int i = 0; i < batch.count; i++) {
+            BatchFile *file = &batch.files[i];
+            if (file->missing) {
+                continue;
+            }
+            make_parents(file->path);
+            FILE *output_file = fopen(file->path, "wb");
+            if (!output_file || fwrite(output.data + file->start, 1, file->size, output_file) != file->size
+                || fclose(output_file) != 0) {
+                fprintf(stderr, "Error writing %s: %s\n", file->path, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            batch_complete(file);
+        }
+        free(output.data);
+        return;
+    }
+    if (output.mode == OUTPUT_MEMORY) {
+        FILE *output_file = fopen(OUTPUT_FILE, "wb");
+        fwrite(output.data, 1, file_size, output_file);
+        fclose(output_file);
+        free(output.data);
+        return;
+    }
+    if (output.mode == OUTPUT_MMAP) {
+        if (msync(output.data, file_size, MS_SYNC) == -1) {
+            perror("Error syncing " OUTPUT_FILE);
+            exit(EXIT_FAILURE);
+        }
+        munmap(output.data, file_size);
+    }
+
+    // Manifest files were closed as they completed
+    if (!batch.manifest && close(output.fd) == -1) {
+        perror("Error closing " OUTPUT_FILE);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < output.pool_size; i++) {
+        pool_put(output.pool[i], buffer_size);
+    }
+    free(output.pool);
+}
+
+// The download cannot be completed. With a journal the partial output is kept for the next run to resume, and a
+// delta sync keeps it for the next run to sync from; otherwise nothing partial is left behind.
+void output_discard(size_t file_size)
+{
+    if (output.mode == OUTPUT_MEMORY) {
+        free(output.data);
+        return;
+    }
+    if (output.mode == OUTPUT_MMAP) {
+        munmap(output.data, file_size);
+    }
+    if (batch.manifest) {
+        // Complete files stay; the rest are removed
+        for (int i = 0; i < batch.count; i++) {
+            if (batch.files[i].fd != -1) {
+                close(batch.files[i].fd);
+                unlink(batch.files[i].path);
+                fprintf(stderr, "Incomplete: %s\n", batch.files[i].name);
+            }
+        }
+        return;
+    }
+    close(output.fd);
+    if (journal.fd == -1 && !delta.enabled) {
+        unlink(OUTPUT_FILE);
+    }
+}
+
+// Fetch up to FRAME_MAX_RANGES scattered ranges of one batch file over one connection, landing each at its offset
+// in the output. Binary servers get one GET_RANGES request, text servers one pipelined GET per range.
+// Returns how many ranges, from the first, were received in full.
+int fetch_ranges(int sock, WireProtocol protocol, const BatchFile *file, const FrameRange *ranges, int range_count)
+{
+    const char *filename = file->name;
+    if (protocol == WIRE_TEXT) {
+        for (int i = 0; i < range_count; i++) {
+            if (send_request(sock, protocol, FRAME_GET, i, filename, ranges[i].offset - file->start, ranges[i].length) == -1) {
+                return 0;
+            }
+        }
+        for (int i = 0; i < range_count; i++) {
+            FrameHeader reply;
+            if (read_reply(sock, protocol, FRAME_GET, i, &reply) != 0 || reply.length != ranges[i].length
+                || land_body(sock, ranges[i].offset, reply.length, NULL) == -1) {
+                return i;
+            }
+        }
+        return range_count;
+    }
+
+    char request[FRAME_HEADER_SIZE + FRAME_MAX_NAME + FRAME_MAX_RANGES * FRAME_RANGE_SIZE];
+    size_t name_len = strlen(filename);
+    if (name_len > FRAME_MAX_NAME || range_count > FRAME_MAX_RANGES) {
+        return 0;
+    }
+    FrameHeader header = {
+        .version = FRAME_VERSION, .opcode = FRAME_GET_RANGES, .name_len = name_len, .length = range_count,
+        .flags = checksums ? FRAME_FLAG_CRC32C : 0
+    };
+    frame_encode(&header, (unsigned char *)request);
+    memcpy(request + FRAME_HEADER_SIZE, filename, name_len);
+    size_t request_len = FRAME_HEADER_SIZE + name_len;
+    for (int i = 0; i < range_count; i++) {
+        FrameRange range = { ranges[i].offset - file->start, ranges[i].length };
+        range_encode(&range, (unsigned char *)request + request_len);
+        request_len += FRAME_RANGE_SIZE;
+    }
+    if (write(sock, request, request_len) != (ssize_t)request_len) {
+        perror("Write failed.");
+        return 0;
+    }
+
+    // The reply lists the ranges again, each header followed by its checksums (if the server sends them) and data
+    FrameHeader reply;
+    if (read_reply(sock, protocol, FRAME_GET_RANGES, 0, &reply) != 0 || reply.length != (uint64_t)range_count) {
+        return 0;
+    }
+    for (int i = 0; i < range_count; i++) {
+        unsigned char range_header[FRAME_RANGE_SIZE];
+        FrameRange range;
+        if (recv(sock, range_header, sizeof(range_header), MSG_WAITALL) != sizeof(range_header)) {
+            return i;
+        }
+        range_decode(range_header, &range);
+        if (range.offset != ranges[i].offset - file->start || range.length != ranges[i].length) {
+            fprintf(stderr, "Unexpected range %" PRIu64 "+%" PRIu64 " in response\n", range.offset, range.length);
+            return i;
+        }
+        range.offset = ranges[i].offset;
+        uint32_t crcs[CHECKSUM_MAX_BLOCKS];
+        int checked = reply.flags & FRAME_FLAG_CRC32C;
+        if ((checked && read_checksums(sock, range.length, crcs) == -1)
+            || land_body(sock, range.offset, range.length, checked ? crcs : NULL) == -1) {
+            return i;
+        }
+    }
+    return range_count;
+}
+
+double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Bytes a worker should claim at once: UNIT_TARGET seconds of its measured throughput
+size_t unit_size(const Worker *worker)
+{
+    double unit = (worker->throughput > 0) ? worker->throughput * UNIT_TARGET : UNIT_MIN;
+    size_t max = (swarm.enabled && !worker->peer) ? SWARM_UNIT : UNIT_MAX;
+    if (unit < UNIT_MIN) {
+        return UNIT_MIN;
+    }
+    return (unit > max) ? max : (size_t)unit;
+}
+
+// First byte at or after offset, before end, in a block whose bit in a SWARM_BLOCK bitmap is wanted; end if none
+size_t bitmap_scan(const unsigned char *bitmap, size_t offset, size_t end, int wanted)
+{
+    while (offset < end) {
+        size_t block = offset / SWARM_BLOCK;
+        if (((bitmap[block / 8] >> (block % 8)) & 1) == wanted) {
+            break;
+        }
+        offset = (block + 1) * SWARM_BLOCK;
+    }
+    return (offset < end) ? offset : end;
+}
+
+// Set the bits of the blocks [offset, end) overlaps
+void bitmap_mark(unsigned char *bitmap, size_t offset, size_t end)
+{
+    for (size_t block = offset / SWARM_BLOCK; offset < end && block <= (end - 1) / SWARM_BLOCK; block++) {
+        bitmap[block / 8] |= 1 << (block % 8);
+    }
+}
+
+// The first run of bytes in [offset, end) in blocks whose bit is wanted, up to the worker's unit, as
+// [*start, *stop). Returns 0 if there is none.
+int bitmap_run(const Worker *worker, const unsigned char *bitmap, int wanted, size_t offset, size_t end, size_t *start, size_t *stop)
+{
+    *start = bitmap_scan(bitmap, offset, end, wanted);
+    if (*start == end) {
+        return 0;
+    }
+    *stop = bitmap_scan(bitmap, *start, end, !wanted);
+    if (*stop - *start > unit_size(worker)) {
+        *stop = *start + unit_size(worker);
+    }
+    return 1;
+}
+
+// Swarm mode (-T): make the first run of returned bytes at or after from (wrapping around) in blocks whose bit is
+// wanted, up to a unit, the worker's unit. The rest of its range stays queued. In swarm mode all unclaimed work
+// is in the returned ranges. Called with queue.lock held. Returns 0 if there is no such run.
+int claim_returned(Worker *worker, const unsigned char *bitmap, int wanted, size_t from)
+{
+    int best = -1;
+    size_t best_start = 0, best_stop = 0, start, stop;
+    for (int pass = 0; pass < 2 && best == -1; pass++, from = 0) {
+        for (int i = 0; i < queue.returned_count; i++) {
+            size_t end = queue.returned[i].offset + queue.returned[i].length;
+            size_t offset = (queue.returned[i].offset > from) ? queue.returned[i].offset : from;
+            if (offset < end && bitmap_run(worker, bitmap, wanted, offset, end, &start, &stop)
+                && (best == -1 || start < best_start)) {
+                best = i;
+                best_start = start;
+                best_stop = stop;
+            }
+        }
+    }
+    if (best == -1) {
+        return 0;
+    }
+
+    FrameRange range = queue.returned[best];
+    if (best_start > range.offset) {
+        queue.returned[best].length = best_start - range.offset;
+    } else {
+        memmove(&queue.returned[best], &queue.returned[best + 1], (queue.returned_count - best - 1) * sizeof(FrameRange));
+        queue.returned_count--;
+    }
+    return_range(best_stop, range.offset + range.length - best_stop);
+    worker->unit_next = best_start;
+    worker->unit_end = best_stop;
+    return 1;
+}
+
+// claim_unit() for a peer connection: a run of bytes in blocks its peer has, from the returned ranges or else
+// from the unrequested part of another worker's unit. Called with queue.lock held. Returns 0 if the peer has none
+// of the work left.
+int claim_from_peer(Worker *worker)
+{
+    if (claim_returned(worker, worker->peer->have, 1, 0)) {
+        return 1;
+    }
+    size_t start, stop;
+    for (int i = 0; i < queue.worker_count; i++) {
+        Worker *other = &queue.workers[i];
+        if (other == worker || !bitmap_run(worker, worker->peer->have, 1, other->unit_next, other->unit_end, &start, &stop)) {
+            continue;
+        }
+        return_range(stop, other->unit_end - stop);
+        other->unit_end = start;
+        other->steals++;
+        worker->unit_next = start;
+        worker->unit_end = stop;
+        return 1;
+    }
+    return 0;
+}
+
+// Give a worker a new unit: returned ranges first, then the unclaimed tail, then stolen work.
+// Called with queue.lock held. Returns 0 if no work is left to claim.
+int claim_unit(Worker *worker)
+{
+    if (worker->peer) {
+        return claim_from_peer(worker);
+    }
+    // A mirror connection in swarm mode first fetches blocks no peer has or is downloading, from a random block on,
+    // so that clients fetch different blocks from the mirrors and have something to give each other
+    size_t block_count = (queue.file_size + SWARM_BLOCK - 1) / SWARM_BLOCK;
+    if (swarm.enabled && block_count > 0 && claim_returned(worker, swarm.available, 0, (rand() % block_count) * SWARM_BLOCK)) {
+        return 1;
+    }
+    if (swarm.enabled && swarm.peer_workers > 0) {
+        return 0; // The rest is left to the peer connections, unless they fall behind and get hedged
+    }
+    size_t unit = unit_size(worker);
+
+    if (queue.returned_count > 0) {
+        FrameRange *range = &queue.returned[queue.returned_count - 1];
+        worker->unit_next = range->offset;
+        if (range->length > unit) {
+            range->offset += unit;
+            range->length -= unit;
+        } else {
+            unit = range->length;
+            queue.returned_count--;
+        }
+        worker->unit_end = worker->unit_next + unit;
+        return 1;
+    }
+
+    if (queue.next_offset < queue.file_size) {
+        worker->unit_next = queue.next_offset;
+        worker->unit_end = (queue.file_size - queue.next_offset > unit) ? queue.next_offset + unit : queue.file_size;
+        queue.next_offset = worker->unit_end;
+        return 1;
+    }
+
+    // Steal from the worker whose unrequested work would take longest to finish at its own rate
+    Worker *victim = NULL;
+    double victim_seconds = 0;
+    for (int i = 0; i < queue.worker_count; i++) {
+        Worker *other = &queue.workers[i];
+        size_t remaining = other->unit_end - other->unit_next;
+        if (other == worker || remaining < 2 * UNIT_MIN) {
+            continue;
+        }
+        double seconds = (other->throughput > 0) ? remaining / other->throughput : 1e9;
+        if (!victim || seconds > victim_seconds) {
+            victim = other;
+            victim_seconds = seconds;
+        }
+    }
+    if (!victim) {
+        return 0;
+    }
+
+    // Take the end of its unit, sized so both finish together: a slow thief takes little from a fast victim
+    size_t remaining = victim->unit_end - victim->unit_next;
+    double mine = worker->throughput, theirs = victim->throughput;
+    size_t share = (mine > 0 && theirs > 0) ? remaining * (mine / (mine + theirs)) : remaining / 2;
+    if (share > unit) {
+        share = unit;
+    }
+    if (share < UNIT_MIN) {
+        return 0;
+    }
+    worker->unit_next = victim->unit_end - share;
+    worker->unit_end = victim->unit_end;
+    victim->unit_end = worker->unit_next;
+    victim->steals++;
+    return 1;
+}
+
+// Take the next piece of the worker's unit, claiming a new unit when it runs out, and add it to the worker's
+// in-flight pieces. Returns 0 when no work is left.
+// Pieces are at most a quarter of a unit, so a slow server never holds much more than a unit of requested work
+// that nobody else can steal. A piece ends where its file does.
+int next_piece(Worker *worker, FrameRange *piece)
+{
+    pthread_mutex_lock(&queue.lock);
+    if (worker->unit_next == worker->unit_end && !claim_unit(worker)) {
+        pthread_mutex_unlock(&queue.lock);
+        return 0;
+    }
+    size_t max_piece = unit_size(worker) / PIPELINE_DEPTH;
+    if (max_piece > PIPELINE_PIECE) {
+        max_piece = PIPELINE_PIECE;
+    }
+    const BatchFile *file = batch_file(worker->unit_next);
+    size_t end = (file->start + file->size < worker->unit_end) ? file->start + file->size : worker->unit_end;
+    piece->offset = worker->unit_next;
+    piece->length = (end - worker->unit_next > max_piece) ? max_piece : end - worker->unit_next;
+    worker->unit_next += piece->length;
+    worker->in_flight[(worker->head + worker->count) % PIPELINE_MAX] = *piece;
+    if (worker->count++ == 0) {
+        worker->waiting_since = now_seconds();
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return 1;
+}
+
+// Whether the worker has requested enough: PIPELINE_DEPTH pieces' worth of bytes, or PIPELINE_MAX pieces.
+// Large files come in full pieces, so their connections keep PIPELINE_DEPTH in flight; runs of small files are
+// packed onto a connection many at a time.
+int pipeline_full(const Worker *worker)
+{
+    if (worker->count < PIPELINE_DEPTH) {
+        return 0;
+    }
+    if (worker->count == PIPELINE_MAX) {
+        return 1;
+    }
+    size_t bytes = 0;
+    for (int i = 0; i < worker->count; i++) {
+        bytes += worker->in_flight[(worker->head + i) % PIPELINE_MAX].length;
+    }
+    size_t budget = unit_size(worker);
+    return bytes >= ((budget < PIPELINE_DEPTH * PIPELINE_PIECE) ? budget : PIPELINE_DEPTH * PIPELINE_PIECE);
+}
+
+// The hedge on the worker's oldest in-flight piece, NULL if it has none. Called with queue.lock held.
+Hedge *head_hedge(Worker *worker)
+{
+    Hedge *hedge = &worker->hedge;
+    if (!hedge->by || worker->count == 0 || hedge->range.offset != worker->in_flight[worker->head].offset) {
+        return NULL;
+    }
+    return hedge;
+}
+
+// One side of a hedge is done with the piece. Called with queue.lock held.
+void finish_hedge(Hedge *hedge)
+{
+    if (--hedge->parties == 0) {
+        memset(hedge, 0, sizeof(Hedge));
+    }
+}
+
+// A worker's connection broke: hand its in-flight pieces and the rest of its unit back to the queue.
+// An oldest piece that is being hedged is left to the hedger.
+void abandon_work(Worker *worker)
+{
+    pthread_mutex_lock(&queue.lock);
+    Hedge *hedge = head_hedge(worker);
+    if (hedge && (hedge->state == HEDGE_PENDING || hedge->state == HEDGE_HEDGER_WON)) {
+        if (hedge->state == HEDGE_PENDING) {
+            hedge->state = HEDGE_ORPHANED;
+        }
+        finish_hedge(hedge);
+        worker->head = (worker->head + 1) % PIPELINE_MAX;
+        worker->count--;
+    } else if (hedge) {
+        finish_hedge(hedge);
+    }
+    for (int i = 0; i < worker->count; i++) {
+        const FrameRange *piece = &worker->in_flight[(worker->head + i) % PIPELINE_MAX];
+        return_range(piece->offset, piece->length);
+    }
+    worker->count = 0;
+    return_range(worker->unit_next, worker->unit_end - worker->unit_next);
+    worker->unit_next = worker->unit_end;
+    pthread_mutex_unlock(&queue.lock);
+}
+
+// Whether any other worker still has work that could come back to the queue or be hedged.
+// Called with queue.lock held.
+int work_outstanding(const Worker *worker)
+{
+    if (queue.returned_count > 0 || queue.next_offset < queue.file_size) {
+        return 1;
+    }
+    for (int i = 0; i < queue.worker_count; i++) {
+        const Worker *other = &queue.workers[i];
+        if (other != worker && (other->count > 0 || other->unit_next < other->unit_end || other->hedging)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Find the worker whose oldest piece is the most overdue and hedge that piece on behalf of worker, which has
+// nothing else to do. A piece is overdue once it has been awaited HEDGE_FACTOR times as long as it would take at
+// the mean rate of the connections. Called with queue.lock held. Returns the victim, or NULL if nothing is late.
+Worker *pick_straggler(Worker *worker)
+{
+    double pace = 0;
+    int paced = 0;
+    for (int i = 0; i < queue.worker_count; i++) {
+        if (queue.workers[i].throughput > 0) {
+            pace += queue.workers[i].throughput;
+            paced++;
+        }
+    }
+    if (paced == 0 || worker->sock == -1 || worker->peer) {
+        return NULL; // A peer connection can only fetch what its peer has
+    }
+    pace /= paced;
+
+    double now = now_seconds();
+    Worker *victim = NULL;
+    double victim_lateness = 1;
+    for (int i = 0; i < queue.worker_count; i++) {
+        Worker *other = &queue.workers[i];
+        if (other == worker || other->count == 0 || other->hedge.by) {
+            continue;
+        }
+        double allowed = HEDGE_FACTOR * other->in_flight[other->head].length / pace;
+        if (allowed < HEDGE_MIN_DELAY) {
+            allowed = HEDGE_MIN_DELAY;
+        }
+        double lateness = (now - other->waiting_since) / allowed;
+        if (lateness > victim_lateness) {
+            victim = other;
+            victim_lateness = lateness;
+        }
+    }
+    if (victim) {
+        victim->hedge = (Hedge){ worker, victim->in_flight[victim->head], HEDGE_PENDING, 2 };
+        worker->hedging = victim;
+        worker->hedges++;
+    }
+    return victim;
+}
+
+// Queue the blocks earlier runs did not finish, in file order, in place of the whole file
+void journal_queue_gaps(void)
+{
+    // Returned ranges are claimed last first, so queue the gaps from the end of the file
+    for (size_t block = journal.block_count; block > 0; ) {
+        size_t end = block;
+        while (block > 0 && !(journal.bitmap[(block - 1) / 8] & (1 << ((block - 1) % 8)))) {
+            block--;
+        }
+        if (block < end) {
+            size_t offset = block * JOURNAL_BLOCK;
+            return_range(offset, (end - 1) * JOURNAL_BLOCK + journal_block_length(end - 1) - offset);
+        }
+        while (block > 0 && (journal.bitmap[(block - 1) / 8] & (1 << ((block - 1) % 8)))) {
+            block--;
+        }
+    }
+    queue.next_offset = queue.file_size;
+}
+
+// Connect a worker to queue.servers[first], or failing that to the mirrors after it in rank order.
+// Returns 0 once connected, -1 if no mirror accepts the connection.
+int connect_worker(Worker *worker, int first)
+{
+    for (int i = 0; i < queue.server_count; i++) {
+        Server *server = &queue.servers[(first + i) % queue.server_count];
+        int sock = connect_to_server(server->ip, server->port);
+        if (sock == -1) {
+            continue;
+        }
+
+        // A mirror that stops sending mid-piece makes recv fail instead of blocking forever
+        struct timeval timeout = { STALL_TIMEOUT, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        LOG_INFO("Connected to %s:%d.\n", server->ip, server->port);
+        pthread_mutex_lock(&queue.lock);
+        worker->server = server;
+        worker->sock = sock;
+        pthread_mutex_unlock(&queue.lock);
+        return 0;
+    }
+    return -1;
+}
+
+void disconnect_worker(Worker *worker)
+{
+    if (worker->sock == -1) {
+        return;
+    }
+    pthread_mutex_lock(&queue.lock);
+    close(worker->sock);
+    worker->sock = -1;
+    pthread_mutex_unlock(&queue.lock);
+}
+
+// A blocking mirror serves one connection at a time, and closes one with no request pending once another client is
+// waiting for it: whether it has closed this one, without waiting
+int mirror_closed(int sock)
+{
+    char byte;
+    return recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+// Wait for the next reply to start arriving on the worker's connection. Returns 0 once it has, 1 if the mirror
+// closed the connection instead, -1 on a timeout or error. Until the first one arrives, a mirror connection may be
+// queued in a blocking mirror's backlog behind other clients rather than stalled, so it waits without STALL_TIMEOUT;
+// a hedge of its pieces, or the hedge race it lost, shuts it down if that takes too long.
+int await_reply(Worker *worker)
+{
+    struct pollfd fd = { .fd = worker->sock, .events = POLLIN };
+    while (!worker->served && !worker->peer && poll(&fd, 1, -1) == -1 && errno == EINTR) {
+    }
+    char byte;
+    ssize_t peeked = recv(worker->sock, &byte, 1, MSG_PEEK);
+    worker->served |= (peeked == 1);
+    return (peeked == 1) ? 0 : (peeked == 0) ? 1 : -1;
+}
+
+// Fetch a duplicate of the victim's oldest piece over the worker's connection, racing the victim's own request.
+// Returns 0 if the connection is still usable, 1 if the victim won and shut it down, 2 if the mirror closed it
+// before answering, -1 if it broke.
+int hedge_piece(Worker *worker, Worker *victim, uint32_t request_id)
+{
+    Hedge *hedge = &victim->hedge; // Stays put until this worker calls finish_hedge
+    FrameRange piece = hedge->range;
+    Server *server = worker->server;
+    if (!worker->scratch && !(worker->scratch = pool_get(PIPELINE_PIECE))) {
+        perror("Failed to allocate hedge buffer");
+        exit(EXIT_FAILURE);
+    }
+    LOG_INFO("Offset %" PRIu64 " is late from %s:%d, requesting it from %s:%d too\n", piece.offset,
+            victim->server->ip, victim->server->port, server->ip, server->port);
+
+    FrameHeader reply;
+    uint32_t crcs[CHECKSUM_MAX_BLOCKS];
+    int landed = -1, closed = 0;
+    BatchFile *file = batch_file(piece.offset);
+    if (send_request(worker->sock, server->protocol, FRAME_GET, request_id, file->name, piece.offset - file->start, piece.length) == 0
+        && !(closed = (await_reply(worker) == 1))
+        && read_reply(worker->sock, server->protocol, FRAME_GET, request_id, &reply) == 0 && reply.length == piece.length) {
+        int checked = reply.flags & FRAME_FLAG_CRC32C;
+        if ((!checked || read_checksums(worker->sock, piece.length, crcs) == 0)
+            && recv_body(worker->sock, worker->scratch, piece.length) == 0) {
+            landed = (checked && verify_blocks(worker->scratch, piece.length, 0, crcs)) ? -2 : 0;
+        }
+    }
+
+    pthread_mutex_lock(&queue.lock);
+    HedgeState state = hedge->state;
+    int won = (landed == 0 && (state == HEDGE_PENDING || state == HEDGE_ORPHANED));
+    if (won) {
+        hedge->state = HEDGE_HEDGER_WON;
+        if (state == HEDGE_PENDING) {
+            // Cancel the original, and wait until the victim has stopped landing it in the output
+            shutdown(victim->sock, SHUT_RDWR);
+            while (victim->receiving) {
+                pthread_cond_wait(&queue.landed, &queue.lock);
+            }
+        }
+    } else if (state == HEDGE_PENDING) {
+        hedge->state = HEDGE_HEDGER_FAILED;
+    } else if (state == HEDGE_ORPHANED) {
+        return_range(piece.offset, piece.length); // Neither copy made it
+    }
+    pthread_mutex_unlock(&queue.lock);
+
+    if (won && write_output(worker->scratch, piece.length, piece.offset) == 0) {
+        settle_range(piece.offset, piece.length, 0);
+        worker->hedges_won++;
+        counter_add(&worker->counters.bytes, piece.length);
+    } else if (won) {
+        pthread_mutex_lock(&queue.lock);
+        return_range(piece.offset, piece.length);
+        pthread_mutex_unlock(&queue.lock);
+        landed = -1;
+    }
+    if (landed == -2) {
+        fprintf(stderr, "Checksum mismatch in the duplicate of offset %" PRIu64 " from %s:%d\n", piece.offset, server->ip, server->port);
+        worker->corrupt++;
+    }
+
+    pthread_mutex_lock(&queue.lock);
+    finish_hedge(hedge);
+    worker->hedging = NULL;
+    pthread_mutex_unlock(&queue.lock);
+    if (state == HEDGE_OWNER_WON) {
+        return 1;
+    }
+    return (landed == -1) ? (closed ? 2 : -1) : 0;
+}
+
+// Wait until the worker has a unit to fetch, claiming one as soon as there is. Returns 0 if nothing is left.
+int await_work(Worker *worker)
+{
+    while (1) {
+        pthread_mutex_lock(&queue.lock);
+        int claimed = worker->unit_next < worker->unit_end || claim_unit(worker);
+        int outstanding = claimed || work_outstanding(worker);
+        pthread_mutex_unlock(&queue.lock);
+        if (claimed || !outstanding) {
+            return claimed;
+        }
+        usleep(HEDGE_POLL);
+    }
+}
+
+// A piece of length bytes arrived on the worker's connection; *last_arrival is when the previous one did.
+// Throughput is measured over the gaps between recent arrivals. Bytes and seconds decay separately, so a burst of
+// fast pieces (e.g. a throttled server's bucket draining) does not outweigh the steady rate.
+void record_arrival(Worker *worker, size_t length, double *last_arrival)
+{
+    double now = now_seconds();
+    pthread_mutex_lock(&queue.lock); // Thieves read throughput
+    worker->window_bytes = 0.7 * worker->window_bytes + length;
+    worker->window_seconds = 0.7 * worker->window_seconds + (now - *last_arrival);
+    if (worker->window_seconds > 0) {
+        worker->throughput = worker->window_bytes / worker->window_seconds;
+    }
+    pthread_mutex_unlock(&queue.lock);
+    counter_add(&worker->counters.bytes, length);
+    *last_arrival = now;
+}
+
+// Download over the worker's connection until no work is left (0), a hedge race shut the connection down (1), the
+// mirror closed it between replies (2), or it broke or returned too many corrupt pieces (-1). When it returns
+// nonzero, the worker's in-flight pieces and the rest of its unit are back in the queue.
+int run_connection(Worker *worker)
+{
+    Server *server = worker->server;
+    int sock = worker->sock;
+    uint32_t requested = 0, received = 0; // The request id is the piece's sequence number on this connection
+    double last_arrival = now_seconds();
+    worker->served = 0;
+
+    while (1) {
+        // Keep up to PIPELINE_DEPTH GETs in flight before reading their responses
+        FrameRange piece;
+        while (!pipeline_full(worker) && next_piece(worker, &piece)) {
+            BatchFile *file = batch_file(piece.offset);
+            if (send_request(sock, server->protocol, FRAME_GET, requested++, file->name, piece.offset - file->start, piece.length) == -1) {
+                abandon_work(worker);
+                return -1;
+            }
+        }
+
+        // Nothing left to claim or steal: duplicate a late piece, or wait for work to come back to the queue. A peer
+        // connection returns instead, to look for another peer.
+        if (worker->count == 0) {
+            if (!worker->peer && mirror_closed(sock)) {
+                return 2;
+            }
+            pthread_mutex_lock(&queue.lock);
+            Worker *victim = pick_straggler(worker);
+            int outstanding = victim || work_outstanding(worker);
+            pthread_mutex_unlock(&queue.lock);
+            if (victim) {
+                int hedged = hedge_piece(worker, victim, requested++);
+                received++;
+                if (hedged != 0) {
+                    return hedged;
+                }
+            } else if (outstanding && !worker->peer) {
+                usleep(HEDGE_POLL);
+            } else {
+                return 0;
+            }
+            continue;
+        }
+
+        // Responses come back in request order, each a header (frame or "OK <length>\n"), then checksums from a
+        // server that sends them, then the data. A hedger that already won has shut this connection down.
+        piece = worker->in_flight[worker->head];
+        pthread_mutex_lock(&queue.lock);
+        Hedge *hedge = head_hedge(worker);
+        int cancelled = hedge && hedge->state == HEDGE_HEDGER_WON;
+        worker->receiving = !cancelled;
+        pthread_mutex_unlock(&queue.lock);
+
+        FrameHeader reply;
+        uint32_t crcs[CHECKSUM_MAX_BLOCKS];
+        uint64_t corrupt = 0;
+        int landed = -1;
+        int awaited = cancelled ? -1 : await_reply(worker);
+        int closed = received > 0 && awaited == 1; // Gave way between replies
+        if (awaited == 0 && read_reply(sock, server->protocol, FRAME_GET, received, &reply) == 0 && reply.length == piece.length) {
+            int checked = reply.flags & FRAME_FLAG_CRC32C;
+            if (!checked || read_checksums(sock, piece.length, crcs) == 0) {
+                landed = receive_body(sock, piece.offset, piece.length, checked ? crcs : NULL, &corrupt);
+            }
+        }
+
+        // If the piece was hedged, the first complete and verified copy wins
+        pthread_mutex_lock(&queue.lock);
+        worker->receiving = 0;
+        pthread_cond_broadcast(&queue.landed);
+        int settle = 1;
+        hedge = head_hedge(worker);
+        if (hedge) {
+            if (hedge->state == HEDGE_PENDING && landed == 0 && !corrupt) {
+                hedge->state = HEDGE_OWNER_WON;
+                shutdown(hedge->by->sock, SHUT_RDWR); // Cancel the duplicate
+            } else if (hedge->state == HEDGE_PENDING) {
+                hedge->state = HEDGE_ORPHANED;
+                settle = 0;
+            } else if (hedge->state == HEDGE_HEDGER_WON) {
+                cancelled = 1;
+                settle = 0;
+            }
+            finish_hedge(hedge);
+        }
+        if (landed == -1 && settle) {
+            pthread_mutex_unlock(&queue.lock);
+            if (!closed) {
+                fprintf(stderr, "Bad GET response for offset %" PRIu64 " from %s:%d\n", piece.offset, server->ip, server->port);
+            }
+            abandon_work(worker);
+            return closed ? 2 : -1;
+        }
+        worker->head = (worker->head + 1) % PIPELINE_MAX;
+        worker->count--;
+        worker->waiting_since = now_seconds();
+        pthread_mutex_unlock(&queue.lock);
+        received++;
+
+        if (cancelled || landed == -1) {
+            abandon_work(worker);
+            return cancelled ? 1 : (closed ? 2 : -1);
+        }
+        if (settle) {
+            settle_range(piece.offset, piece.length, corrupt);
+        }
+
+        // Corrupt blocks are already queued again; a mirror that keeps sending them is given up on
+        if (corrupt && ++worker->corrupt >= CORRUPT_LIMIT) {
+            fprintf(stderr, "Too many corrupt responses from %s:%d, dropping the connection\n", server->ip, server->port);
+            abandon_work(worker);
+            return -1;
+        }
+
+        record_arrival(worker, piece.length, &last_arrival);
+    }
+}
+
+// A worker's thread. A connection that breaks is replaced, by one to the next mirror in rank order, up to
+// WORKER_RETRIES times; one that lost a hedge race is replaced by a fresh one to the same mirror, or to the next one
+// if that mirror had not answered it yet, and one the mirror closed between replies by a fresh one once the worker
+// has work again.
+void *download_chunk(void *arg) {
+    Worker *worker = (Worker *)arg;
+    int failures = 0, first = worker->server - queue.servers;
+    thread_counters = &worker->counters;
+
+    void *result = (void *)1; // Failure
+    while (connect_worker(worker, first) == 0) {
+        int status = run_connection(worker);
+        disconnect_worker(worker);
+        if (status == 0) {
+            result = (void *)0; // Success
+            break;
+        }
+        first = worker->server - queue.servers;
+        if (status == 2) {
+            if (!await_work(worker)) {
+                result = (void *)0;
+                break;
+            }
+            continue;
+        }
+        if (status == -1) {
+            if (++failures > WORKER_RETRIES) {
+                break;
+            }
+            first = (first + 1) % queue.server_count;
+        } else if (!worker->served) {
+            first = (first + 1) % queue.server_count; // Hedged away while still waiting for the mirror to get to it
+        }
+        counter_add(&worker->counters.retries, 1);
+    }
+    abandon_work(worker); // A unit claimed for a connection that could not be made
+    pthread_mutex_lock(&queue.lock); // Peer connections stop waiting for work once no mirror connection is left
+    queue.mirror_workers--;
+    pthread_mutex_unlock(&queue.lock);
+    pthread_exit(result);
+}
+
+// Swarm mode (-T). Besides its mirror connections, the client runs a GET responder for the blocks it has completed,
+// announces them every SWARM_INTERVAL to a tracker (any server, which keeps the latest announcement of each peer)
+// and downloads from the peers the tracker lists over -P more connections. A peer connection only claims returned
+// ranges in blocks its peer has; the rest of the file still comes from the mirrors. Peers are trusted to serve the
+// same file: their checksums only cover the hop from them.
+
+// Whether OUTPUT_FILE holds every block of a range, so the responder may serve it
+int swarm_has_range(size_t offset, size_t length)
+{
+    pthread_mutex_lock(&journal.lock);
+    int has = 1;
+    for (size_t block = offset / SWARM_BLOCK; !swarm.complete && has && block <= (offset + length - 1) / SWARM_BLOCK; block++) {
+        has = journal.bitmap && (journal.bitmap[block / 8] & (1 << (block % 8)));
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return has;
+}
+
+// Send all of data. Returns -1 if the connection breaks.
+int send_all(int sock, const void *data, size_t length)
+{
+    for (size_t sent = 0; sent < length; ) {
+        ssize_t result = send(sock, (const char *)data + sent, length - sent, MSG_NOSIGNAL);
+        if (result <= 0) {
+            return -1;
+        }
+        sent += result;
+    }
+    return 0;
+}
+
+// One peer connection to the GET responder: binary GETs of OUTPUT_FILE, answered from the file with checksums
+// if asked, for ranges whose blocks are all complete. Anything else is refused.
+void *serve_peer(void *arg)
+{
+    int sock = (int)(intptr_t)arg;
+    const BatchFile *file = &batch.files[0];
+    size_t max_length = CHECKSUM_MAX_BLOCKS * CHECKSUM_BLOCK;
+    char *buffer = pool_get(max_length);
+    unsigned char frame[FRAME_HEADER_SIZE];
+    char name[FRAME_MAX_NAME + 1];
+    FrameHeader request;
+
+    while (buffer && recv(sock, frame, sizeof(frame), MSG_WAITALL) == sizeof(frame) && frame_decode(frame, &request) == 0
+           && request.name_len > 0 && request.name_len <= FRAME_MAX_NAME
+           && recv(sock, name, request.name_len, MSG_WAITALL) == request.name_len) {
+        name[request.name_len] = '\0';
+        int status = STATUS_OK;
+        if (request.version != FRAME_VERSION || request.opcode != FRAME_GET) {
+            status = STATUS_INVALID_REQUEST;
+        } else if (strcmp(name, file->name) != 0) {
+            status = STATUS_NOT_FOUND;
+        } else if (request.length == 0 || request.length > max_length || request.offset >= file->size
+                   || request.length > file->size - request.offset || !swarm_has_range(request.offset, request.length)) {
+            status = STATUS_INVALID_RANGE;
+        }
+
+        int checked = (status == STATUS_OK && (request.flags & FRAME_FLAG_CRC32C));
+        FrameHeader reply = {
+            .version = FRAME_VERSION, .opcode = request.opcode, .status = status, .request_id = request.request_id,
+            .flags = checked ? FRAME_FLAG_CRC32C : 0, .offset = request.offset, .length = (status == STATUS_OK) ? request.length : 0
+        };
+        frame_encode(&reply, frame);
+        if (status != STATUS_OK) {
+            if (send_all(sock, frame, sizeof(frame)) == -1 || status == STATUS_INVALID_REQUEST) {
+                break;
+            }
+            continue;
+        }
+
+        uint32_t crcs[CHECKSUM_MAX_BLOCKS];
+        size_t crc_count = 0;
+        if (pread(swarm.fd, buffer, request.length, request.offset) != (ssize_t)request.length) {
+            perror("Error reading " OUTPUT_FILE " for a peer");
+            break;
+        }
+        for (size_t done = 0; checked && done < request.length; done += CHECKSUM_BLOCK) {
+            size_t bytes = (request.length - done > CHECKSUM_BLOCK) ? CHECKSUM_BLOCK : request.length - done;
+            crcs[crc_count++] = htobe32(crc32c(0, buffer + done, bytes));
+        }
+        if (send_all(sock, frame, sizeof(frame)) == -1 || (checked && send_all(sock, crcs, 4 * crc_count) == -1)
+            || send_all(sock, buffer, request.length) == -1) {
+            break;
+        }
+        counter_add(&swarm.served, request.length);
+    }
+
+    pool_put(buffer, max_length);
+    close(sock);
+    pthread_mutex_lock(&queue.lock);
+    swarm.uploads--;
+    pthread_mutex_unlock(&queue.lock);
+    return NULL;
+}
+
+// Accept peer connections, a thread each, up to SWARM_UPLOADS at once; more are closed straight away
+void *run_responder(void *arg)
+{
+    (void)arg;
+    while (1) {
+        int sock = accept(swarm.listen_sock, NULL, NULL);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Swarm responder accept failed");
+            return NULL;
+        }
+        struct timeval timeout = { STALL_TIMEOUT, 0 }; // A peer that stops reading is dropped
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        pthread_mutex_lock(&queue.lock);
+        int busy = (swarm.uploads >= SWARM_UPLOADS);
+        swarm.uploads += !busy;
+        pthread_mutex_unlock(&queue.lock);
+        pthread_t thread;
+        if (busy || pthread_create(&thread, NULL, serve_peer, (void *)(intptr_t)sock) != 0) {
+            close(sock);
+            pthread_mutex_lock(&queue.lock);
+            swarm.uploads -= !busy;
+            pthread_mutex_unlock(&queue.lock);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+// Take the tracker's list of the other peers, one "<ip>:<port> <have> [<fetching>]" line each. Peers whose bitmaps
+// are not the size of ours are downloading another version of the file and are skipped.
+void swarm_update_peers(char *lines)
+{
+    pthread_mutex_lock(&queue.lock);
+    for (int i = 0; i < swarm.peer_count; i++) {
+        swarm.peers[i].listed = 0;
+    }
+    char *save;
+    for (char *line = strtok_r(lines, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char ip[256];
+        int port, bitmap_at = 0;
+        size_t hex = 2 * swarm.bitmap_size;
+        if (sscanf(line, "%255[^:]:%d %n", ip, &port, &bitmap_at) != 2 || bitmap_at == 0
+            || (strlen(line + bitmap_at) != hex && (strlen(line + bitmap_at) != 2 * hex + 1 || line[bitmap_at + hex] != ' '))) {
+            continue;
+        }
+        Peer *peer = NULL;
+        for (int i = 0; i < swarm.peer_count && !peer; i++) {
+            if (swarm.peers[i].server.port == port && strcmp(swarm.peers[i].server.ip, ip) == 0) {
+                peer = &swarm.peers[i];
+            }
+        }
+        if (!peer && swarm.peer_count < SWARM_PEERS) {
+            unsigned char *have = malloc(2 * swarm.bitmap_size + 1);
+            if (!have) {
+                continue;
+            }
+            peer = &swarm.peers[swarm.peer_count++];
+            memset(peer, 0, sizeof(Peer));
+            snprintf(peer->server.ip, sizeof(peer->server.ip), "%s", ip);
+            peer->server.port = port;
+            peer->server.protocol = WIRE_BINARY;
+            peer->server.reachable = 1;
+            peer->have = have;
+            peer->fetching = have + swarm.bitmap_size;
+            LOG_INFO("New peer %s:%d\n", ip, port);
+        }
+        if (!peer) {
+            continue;
+        }
+        int fetching = (line[bitmap_at + hex] == ' ');
+        for (size_t i = 0; i < swarm.bitmap_size; i++) {
+            unsigned int byte = 0, next = 0;
+            sscanf(line + bitmap_at + 2 * i, "%2x", &byte);
+            if (fetching) {
+                sscanf(line + bitmap_at + hex + 1 + 2 * i, "%2x", &next);
+            }
+            peer->have[i] = byte;
+            peer->fetching[i] = next;
+        }
+        peer->listed = 1;
+    }
+    double now = now_seconds();
+    memset(swarm.available, 0, swarm.bitmap_size);
+    for (int i = 0; i < swarm.peer_count; i++) {
+        int reachable = swarm.peers[i].listed && swarm.peers[i].idle_until <= now;
+        for (size_t j = 0; reachable && j < swarm.bitmap_size; j++) {
+            swarm.available[j] |= swarm.peers[i].have[j] | swarm.peers[i].fetching[j];
+        }
+    }
+    pthread_mutex_unlock(&queue.lock);
+}
+
+// Send one ANNOUNCE over the tracker connection, from the responder at ip, and take the reply.
+// Returns -1 if the connection broke or the tracker refused it.
+int swarm_announce(int sock, uint32_t request_id, const char *ip)
+{
+    const char *name = batch.files[0].name;
+    size_t name_len = strlen(name);
+    size_t size = FRAME_HEADER_SIZE + name_len + INET_ADDRSTRLEN + 8 + 4 * swarm.bitmap_size + 2;
+    char request[size];
+    char *payload = request + FRAME_HEADER_SIZE + name_len;
+    int payload_len = snprintf(payload, size - FRAME_HEADER_SIZE - name_len, "%s:%d ", ip, swarm.port);
+    pthread_mutex_lock(&journal.lock);
+    for (size_t i = 0; i < swarm.bitmap_size; i++) {
+        payload_len += sprintf(payload + payload_len, "%02x", swarm.complete ? 0xff : journal.bitmap[i]);
+    }
+    pthread_mutex_unlock(&journal.lock);
+
+    // Blocks of the units and in-flight pieces of every connection
+    unsigned char fetching[swarm.bitmap_size + 1];
+    memset(fetching, 0, sizeof(fetching));
+    pthread_mutex_lock(&queue.lock);
+    for (int i = 0; i < queue.worker_count; i++) {
+        const Worker *worker = &queue.workers[i];
+        bitmap_mark(fetching, worker->unit_next, worker->unit_end);
+        for (int j = 0; j < worker->count; j++) {
+            const FrameRange *piece = &worker->in_flight[(worker->head + j) % PIPELINE_MAX];
+            bitmap_mark(fetching, piece->offset, piece->offset + piece->length);
+        }
+    }
+    pthread_mutex_unlock(&queue.lock);
+    payload[payload_len++] = ' ';
+    for (size_t i = 0; i < swarm.bitmap_size; i++) {
+        payload_len += sprintf(payload + payload_len, "%02x", fetching[i]);
+    }
+
+    FrameHeader header = {
+        .version = FRAME_VERSION, .opcode = FRAME_ANNOUNCE, .name_len = name_len, .request_id = request_id,
+        .length = payload_len
+    };
+    frame_encode(&header, (unsigned char *)request);
+    memcpy(request + FRAME_HEADER_SIZE, name, name_len);
+    FrameHeader reply;
+    if (send_all(sock, request, FRAME_HEADER_SIZE + name_len + payload_len) == -1
+        || read_reply(sock, WIRE_BINARY, FRAME_ANNOUNCE, request_id, &reply) != 0) {
+        return -1;
+    }
+    char *lines = malloc(reply.length + 1);
+    if (!lines || (reply.length > 0 && recv(sock, lines, reply.length, MSG_WAITALL) != (ssize_t)reply.length)) {
+        free(lines);
+        return -1;
+    }
+    lines[reply.length] = '\0';
+    swarm_update_peers(lines);
+    free(lines);
+    return 0;
+}
+
+// Announce our blocks every SWARM_INTERVAL until swarm.stop. Each announcement has a connection of its own, so
+// that a blocking-mode tracker, which serves one connection at a time, is never held up by one client. The
+// responder's address is the one the tracker sees us at.
+void *run_announcer(void *arg)
+{
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&queue.lock);
+        int stop = swarm.stop;
+        pthread_mutex_unlock(&queue.lock);
+
+        int sock = connect_to_server(swarm.tracker.ip, swarm.tracker.port);
+        if (sock != -1) {
+            struct sockaddr_in local;
+            socklen_t local_len = sizeof(local);
+            char ip[INET_ADDRSTRLEN];
+            struct timeval timeout = { STALL_TIMEOUT, 0 };
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            if (getsockname(sock, (struct sockaddr *)&local, &local_len) == -1
+                || !inet_ntop(AF_INET, &local.sin_addr, ip, sizeof(ip)) || swarm_announce(sock, 0, ip) == -1) {
+                fprintf(stderr, "Announcement to the swarm tracker %s:%d failed\n", swarm.tracker.ip, swarm.tracker.port);
+            }
+            close(sock);
+        }
+        if (stop) {
+            break;
+        }
+        usleep(SWARM_INTERVAL * 1e6);
+    }
+    return NULL;
+}
+
+// Whether any returned range or unrequested part of a unit lies partly in a block the peer has.
+// Called with queue.lock held.
+int peer_has_work(const Peer *peer)
+{
+    for (int i = 0; i < queue.returned_count; i++) {
+        size_t end = queue.returned[i].offset + queue.returned[i].length;
+        if (bitmap_scan(peer->have, queue.returned[i].offset, end, 1) < end) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < queue.worker_count; i++) {
+        if (bitmap_scan(peer->have, queue.workers[i].unit_next, queue.workers[i].unit_end, 1) < queue.workers[i].unit_end) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The listed peer with work for us that the fewest peer connections are using, NULL if there is none.
+// Called with queue.lock held.
+Peer *pick_peer(void)
+{
+    double now = now_seconds();
+    Peer *best = NULL;
+    for (int i = 0; i < swarm.peer_count; i++) {
+        Peer *peer = &swarm.peers[i];
+        if (peer->listed && peer->idle_until <= now && (!best || peer->workers < best->workers) && peer_has_work(peer)) {
+            best = peer;
+        }
+    }
+    return best;
+}
+
+// Connect to a peer's responder, once: the tracker will list others. Returns the socket or -1.
+int connect_peer(const Peer *peer)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(peer->server.port) };
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1 || inet_pton(AF_INET, peer->server.ip, &addr.sin_addr) != 1
+        || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "Unable to connect to peer %s:%d\n", peer->server.ip, peer->server.port);
+        if (sock != -1) {
+            close(sock);
+        }
+        return -1;
+    }
+    struct timeval timeout = { STALL_TIMEOUT, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+// A peer connection's thread: download from one peer after another while work is outstanding. It gives up once
+// no peer has any of the work left and no mirror connection is left to wait for.
+void *download_from_peers(void *arg)
+{
+    Worker *worker = (Worker *)arg;
+    thread_counters = &worker->counters;
+
+    while (1) {
+        pthread_mutex_lock(&queue.lock);
+        int outstanding = work_outstanding(worker);
+        Peer *peer = outstanding ? pick_peer() : NULL;
+        if (peer) {
+            peer->workers++;
+        }
+        int stranded = (!peer && queue.mirror_workers == 0);
+        pthread_mutex_unlock(&queue.lock);
+        if (!outstanding || stranded) {
+            break;
+        }
+        if (!peer) {
+            usleep(SWARM_INTERVAL * 1e6); // Until the next announcement
+            continue;
+        }
+
+        int status = -1;
+        int sock = connect_peer(peer);
+        if (sock != -1) {
+            LOG_INFO("Connected to peer %s:%d.\n", peer->server.ip, peer->server.port);
+            pthread_mutex_lock(&queue.lock);
+            worker->server = &peer->server;
+            worker->peer = peer;
+            worker->sock = sock;
+            pthread_mutex_unlock(&queue.lock);
+            status = run_connection(worker);
+            disconnect_worker(worker);
+        }
+        pthread_mutex_lock(&queue.lock);
+        worker->peer = NULL;
+        peer->workers--;
+        if (status != 0) {
+            peer->idle_until = now_seconds() + SWARM_RETRY;
+        }
+        pthread_mutex_unlock(&queue.lock);
+        if (status != 0) {
+            counter_add(&worker->counters.retries, 1);
+        }
+    }
+    pthread_exit((void *)0);
+}
+
+// Queue the whole file as a returned range, where peer connections look for work
+void swarm_queue_file(void)
+{
+    return_range(0, queue.file_size);
+    queue.next_offset = queue.file_size;
+}
+
+// Open the GET responder and start announcing. Called once the journal is open.
+void swarm_start(void)
+{
+    swarm.bitmap_size = (journal.block_count + 7) / 8;
+    if (swarm.bitmap_size > SWARM_MAX_BITMAP) {
+        fprintf(stderr, "%s is too large for swarm mode (at most %d MB)\n", batch.files[0].name, SWARM_MAX_BITMAP * 8);
+        exit(EXIT_FAILURE);
+    }
+    srand(getpid() ^ time(NULL));
+    swarm.available = calloc(swarm.bitmap_size ? swarm.bitmap_size : 1, 1);
+    if (!swarm.available) {
+        perror("Failed to allocate the swarm bitmap");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY) };
+    socklen_t addr_len = sizeof(addr);
+    swarm.fd = open(OUTPUT_FILE, O_RDONLY);
+    swarm.listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    pthread_t responder;
+    if (swarm.fd == -1 || swarm.listen_sock == -1 || bind(swarm.listen_sock, (struct sockaddr *)&addr, sizeof(addr)) == -1
+        || listen(swarm.listen_sock, SOMAXCONN) == -1 || getsockname(swarm.listen_sock, (struct sockaddr *)&addr, &addr_len) == -1
+        || pthread_create(&responder, NULL, run_responder, NULL) != 0
+        || pthread_create(&swarm.announcer, NULL, run_announcer, NULL) != 0) {
+        perror("Failed to start the swarm responder");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(responder);
+    swarm.port = ntohs(addr.sin_port);
+    LOG_INFO("Swarm: serving completed blocks on port %d, tracker %s:%d\n", swarm.port, swarm.tracker.ip, swarm.tracker.port);
+}
+
+// The download is complete, from_peers bytes of it over peer connections: serve every block for -L seconds, then
+// make a last announcement and stop
+void swarm_finish(uint64_t from_peers)
+{
+    if (swarm.linger > 0) {
+        LOG_INFO("Serving peers for %.1f s\n", swarm.linger);
+        usleep(swarm.linger * 1e6);
+    }
+    pthread_mutex_lock(&queue.lock);
+    swarm.stop = 1;
+    pthread_mutex_unlock(&queue.lock);
+    pthread_join(swarm.announcer, NULL);
+    LOG_INFO("Swarm: %" PRIu64 " bytes from %d peers, %" PRIu64 " bytes served to them\n", from_peers, swarm.peer_count, counter_read(&swarm.served));
+    for (int i = 0; i < swarm.peer_count; i++) {
+        free(swarm.peers[i].have);
+    }
+    free(swarm.available);
+}
+
+// -E: receive length bytes of the shard from offset into data, as pipelined GETs of at most PIPELINE_PIECE bytes,
+// each checked against its checksums if the mirror sends them. Returns -1 on a broken connection, -2 if some data
+// was corrupt (the connection is still usable).
+int fetch_shard(int sock, WireProtocol protocol, size_t offset, char *data, size_t length)
+{
+    int pieces = (length + PIPELINE_PIECE - 1) / PIPELINE_PIECE;
+    for (int i = 0; i < pieces; i++) {
+        size_t bytes = (length - i * PIPELINE_PIECE > PIPELINE_PIECE) ? PIPELINE_PIECE : length - i * PIPELINE_PIECE;
+        if (send_request(sock, protocol, FRAME_GET, i, batch.files[0].name, offset + i * PIPELINE_PIECE, bytes) == -1) {
+            return -1;
+        }
+    }
+    int status = 0;
+    for (int i = 0; i < pieces; i++) {
+        size_t bytes = (length - i * PIPELINE_PIECE > PIPELINE_PIECE) ? PIPELINE_PIECE : length - i * PIPELINE_PIECE;
+        char *piece = data + i * PIPELINE_PIECE;
+        uint32_t crcs[CHECKSUM_MAX_BLOCKS];
+        FrameHeader reply;
+        if (read_reply(sock, protocol, FRAME_GET, i, &reply) != 0 || reply.length != bytes
+            || ((reply.flags & FRAME_FLAG_CRC32C) && read_checksums(sock, bytes, crcs) == -1)
+            || recv_body(sock, piece, bytes) == -1) {
+            return -1;
+        }
+        if ((reply.flags & FRAME_FLAG_CRC32C) && verify_blocks(piece, bytes, 0, crcs)) {
+            fprintf(stderr, "Checksum mismatch in %zu shard bytes at offset %zu\n", bytes, offset + i * PIPELINE_PIECE);
+            status = -2;
+        }
+    }
+    counter_add(&erasure.wire_bytes, length);
+    return status;
+}
+
+// -E: learn the layout from the fastest mirror's shard header and set up the batches. Returns the file size.
+size_t erasure_open(const Server *server)
+{
+    char header[RS_HEADER_SIZE];
+    int sock = connect_to_server(server->ip, server->port);
+    if (sock == -1 || fetch_shard(sock, server->protocol, 0, header, RS_HEADER_SIZE) != 0
+        || rs_parse_header(header, RS_HEADER_SIZE, &erasure.layout) == -1) {
+        fprintf(stderr, "%s:%d does not serve a shard of %s\n", server->ip, server->port, batch.files[0].name);
+        exit(EXIT_FAILURE);
+    }
+    close(sock);
+    size_t stripes = rs_stripes(&erasure.layout);
+    if (server->file_size != RS_HEADER_SIZE + stripes * erasure.layout.unit) {
+        fprintf(stderr, "%s:%d: %s is %zu bytes, its header says %zu\n", server->ip, server->port, batch.files[0].name,
+                server->file_size, RS_HEADER_SIZE + stripes * erasure.layout.unit);
+        exit(EXIT_FAILURE);
+    }
+    erasure.batch_stripes = (erasure.layout.unit < ERASURE_BATCH) ? ERASURE_BATCH / erasure.layout.unit : 1;
+    erasure.batch_count = (stripes + erasure.batch_stripes - 1) / erasure.batch_stripes;
+    erasure.batches = calloc(erasure.batch_count ? erasure.batch_count : 1, sizeof(ErasureBatch));
+    if (!erasure.batches) {
+        perror("Failed to allocate batches");
+        exit(EXIT_FAILURE);
+    }
+    LOG_INFO("Erasure-coded: %d data + %d parity shards, %zu KB units, %zu batches of %zu stripes, %s kernel\n",
+             erasure.layout.k, erasure.layout.m, erasure.layout.unit / 1024, erasure.batch_count, erasure.batch_stripes,
+             gf_implementation());
+    return erasure.layout.file_size;
+}
+
+// Whether some batch not yet rebuilt can no longer get k shards, from those that landed and those still fetched.
+// Called with queue.lock held.
+int erasure_stranded(void)
+{
+    if (erasure.pending > 0) {
+        return 0; // Their shards are not known yet
+    }
+    uint32_t live = 0;
+    for (int i = 0; i < erasure.layout.k + erasure.layout.m; i++) {
+        if (erasure.live[i] > 0) {
+            live |= 1u << i;
+        }
+    }
+    for (size_t b = erasure.oldest; b < erasure.batch_count; b++) {
+        if (!erasure.batches[b].decoded && __builtin_popcount(erasure.batches[b].landed | live) < erasure.layout.k) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The next batch for a worker's shard, called with queue.lock held: the oldest one in the window that fewer than k
+// shards are requested for, or else, rather than idle, the oldest one still short of k landed shards (a hedge against
+// slower mirrors). Waits while there is neither. Returns -1 once every batch is written or some batch cannot be.
+long claim_batch(Worker *worker, int *hedged)
+{
+    uint32_t bit = 1u << worker->shard;
+    while (!erasure.failed && erasure.oldest < erasure.batch_count) {
+        size_t end = (erasure.batch_count - erasure.oldest > ERASURE_WINDOW) ? erasure.oldest + ERASURE_WINDOW : erasure.batch_count;
+        long hedge = -1;
+        for (size_t b = erasure.oldest; b < end; b++) {
+            ErasureBatch *batch = &erasure.batches[b];
+            if (batch->decoded || (batch->requested & bit)) {
+                continue;
+            }
+            if (__builtin_popcount(batch->requested) < erasure.layout.k) {
+                batch->requested |= bit;
+                *hedged = 0;
+                return b;
+            }
+            if (hedge == -1) {
+                hedge = b;
+            }
+        }
+        if (hedge != -1) {
+            erasure.batches[hedge].requested |= bit;
+            worker->hedges++;
+            *hedged = 1;
+            return hedge;
+        }
+        pthread_cond_wait(&erasure.changed, &queue.lock);
+    }
+    return -1;
+}
+
+// Rebuild batch b from its k landed shards (length bytes each) and write its stripes to the output. Data shards
+// that did not land are combined from the others through the inverse of their rows of the encoding matrix.
+// Returns -1 if the write fails.
+int rebuild_batch(size_t b, char **shards, size_t length)
+{
+    int k = erasure.layout.k, rows[RS_MAX_SHARDS], row_count = 0;
+    for (int i = 0; i < k + erasure.layout.m && row_count < k; i++) {
+        if (shards[i]) {
+            rows[row_count++] = i;
+        }
+    }
+    uint8_t inverse[RS_MAX_SHARDS][RS_MAX_SHARDS];
+    char *data[RS_MAX_SHARDS];
+    int inverted = 0, status = 0;
+    for (int j = 0; j < k; j++) {
+        data[j] = shards[j];
+        if (data[j]) {
+            continue;
+        }
+        if (!inverted) {
+            rs_invert(k, rows, inverse); // Distinct rows of the encoding matrix are always independent
+            inverted = 1;
+        }
+        data[j] = pool_get(length);
+        if (!data[j]) {
+            perror("Failed to allocate a rebuilt shard");
+            status = -1;
+            continue;
+        }
+        memset(data[j], 0, length);
+        for (int c = 0; c < k; c++) {
+            gf_mul_add(data[j], shards[rows[c]], inverse[j][c], length);
+        }
+    }
+
+    // Stripe by stripe, the units of the data shards are the file's bytes in order
+    size_t unit = erasure.layout.unit, stripes = length / unit;
+    size_t offset = b * erasure.batch_stripes * k * unit;
+    size_t bytes = (erasure.layout.file_size - offset < stripes * k * unit) ? erasure.layout.file_size - offset : stripes * k * unit;
+    char *file_data = (status == 0) ? pool_get(stripes * k * unit) : NULL;
+    if (file_data) {
+        for (size_t s = 0; s < stripes; s++) {
+            for (int j = 0; j < k; j++) {
+                memcpy(file_data + (s * k + j) * unit, data[j] + s * unit, unit);
+            }
+        }
+        status = write_output(file_data, bytes, offset);
+        counter_add(&thread_counters->bytes, bytes);
+        pool_put(file_data, stripes * k * unit);
+    } else if (status == 0) {
+        perror("Failed to allocate a rebuilt batch");
+        status = -1;
+    }
+    for (int j = 0; j < k; j++) {
+        if (!shards[j]) {
+            pool_put(data[j], length);
+        }
+    }
+    return status;
+}
+
+// A worker's shard of batch b landed. The k-th shard to land rebuilds and writes the batch; later ones are dropped.
+// Returns -1 if the write fails.
+int land_shard(Worker *worker, size_t b, char *data, size_t length, int hedged)
+{
+    ErasureBatch *batch = &erasure.batches[b];
+    pthread_mutex_lock(&queue.lock);
+    if (batch->decoded) {
+        erasure.late++;
+        pthread_mutex_unlock(&queue.lock);
+        pool_put(data, length);
+        return 0;
+    }
+    worker->hedges_won += hedged;
+    batch->shards[worker->shard] = data;
+    batch->landed |= 1u << worker->shard;
+    if (__builtin_popcount(batch->landed) < erasure.layout.k) {
+        pthread_mutex_unlock(&queue.lock);
+        return 0;
+    }
+    batch->decoded = 1;
+    pthread_mutex_unlock(&queue.lock);
+
+    int status = rebuild_batch(b, batch->shards, length);
+
+    pthread_mutex_lock(&queue.lock);
+    for (int i = 0; i < erasure.layout.k + erasure.layout.m; i++) {
+        pool_put(batch->shards[i], length);
+        batch->shards[i] = NULL;
+    }
+    batch->written = 1;
+    while (erasure.oldest < erasure.batch_count && erasure.batches[erasure.oldest].written) {
+        erasure.oldest++;
+    }
+    if (status == -1) {
+        erasure.failed = 1;
+    }
+    if (erasure.oldest == erasure.batch_count || erasure.failed) {
+        // Shards still on their way are not needed: stop waiting for slow mirrors
+        for (int i = 0; i < queue.worker_count; i++) {
+            if (queue.workers[i].sock != -1) {
+                shutdown(queue.workers[i].sock, SHUT_RDWR);
+            }
+        }
+    }
+    pthread_cond_broadcast(&erasure.changed);
+    pthread_mutex_unlock(&queue.lock);
+    return status;
+}
+
+// One connection to a worker's mirror: check its shard header, then fetch batches of the shard until none is left
+// for it. Returns 0 when done, -1 if the connection broke, -2 if the mirror cannot be used.
+int shard_connection(Worker *worker, int sock)
+{
+    Server *server = worker->server;
+    char header[RS_HEADER_SIZE];
+    RsLayout layout;
+    if (fetch_shard(sock, server->protocol, 0, header, RS_HEADER_SIZE) != 0) {
+        return -1;
+    }
+    if (rs_parse_header(header, RS_HEADER_SIZE, &layout) == -1 || layout.k != erasure.layout.k
+        || layout.m != erasure.layout.m || layout.unit != erasure.layout.unit || layout.file_size != erasure.layout.file_size
+        || (worker->shard != -1 && layout.index != worker->shard)) {
+        fprintf(stderr, "Dropping %s:%d: its %s is not a shard of the same layout\n", server->ip, server->port, batch.files[0].name);
+        return -2;
+    }
+    pthread_mutex_lock(&queue.lock);
+    if (worker->shard == -1) {
+        worker->shard = layout.index;
+        erasure.live[layout.index]++;
+        erasure.pending--;
+    }
+    pthread_mutex_unlock(&queue.lock);
+
+    while (1) {
+        int hedged;
+        pthread_mutex_lock(&queue.lock);
+        long b = claim_batch(worker, &hedged);
+        pthread_mutex_unlock(&queue.lock);
+        if (b == -1) {
+            return 0;
+        }
+
+        size_t first = b * erasure.batch_stripes;
+        size_t stripes = (rs_stripes(&erasure.layout) - first < erasure.batch_stripes) ? rs_stripes(&erasure.layout) - first : erasure.batch_stripes;
+        size_t length = stripes * erasure.layout.unit;
+        char *data = pool_get(length);
+        double start = now_seconds();
+        int status = data ? fetch_shard(sock, server->protocol, RS_HEADER_SIZE + first * erasure.layout.unit, data, length) : -1;
+        if (status != 0) {
+            pool_put(data, length);
+            pthread_mutex_lock(&queue.lock);
+            erasure.batches[b].requested &= ~(1u << worker->shard);
+            pthread_cond_broadcast(&erasure.changed);
+            pthread_mutex_unlock(&queue.lock);
+            if (status == -2 && ++worker->corrupt < CORRUPT_LIMIT) {
+                continue;
+            }
+            if (status == -2) {
+                fprintf(stderr, "Dropping %s:%d: %d corrupt responses\n", server->ip, server->port, worker->corrupt);
+            }
+            return status;
+        }
+        worker->window_bytes += length;
+        worker->window_seconds += now_seconds() - start;
+        worker->throughput = worker->window_bytes / worker->window_seconds;
+        if (land_shard(worker, b, data, length, hedged) == -1) {
+            return 0; // The download failed; the other connections stop too
+        }
+    }
+}
+
+// -E: a connection's thread. A broken connection is replaced, to the same mirror since it is the only one with the
+// shard, up to WORKER_RETRIES times.
+void *download_shards(void *arg)
+{
+    Worker *worker = (Worker *)arg;
+    thread_counters = &worker->counters;
+    Server *server = worker->server;
+    int status = -1;
+    for (int attempt = 0; attempt <= WORKER_RETRIES && status == -1; attempt++) {
+        pthread_mutex_lock(&queue.lock);
+        int finished = erasure.oldest == erasure.batch_count || erasure.failed;
+        pthread_mutex_unlock(&queue.lock);
+        if (finished) {
+            status = 0; // Shut down because the file is complete
+            break;
+        }
+        if (attempt > 0) {
+            counter_add(&worker->counters.retries, 1);
+        }
+        int sock = connect_to_server(server->ip, server->port);
+        if (sock == -1) {
+            break;
+        }
+        struct timeval timeout = { STALL_TIMEOUT, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        pthread_mutex_lock(&queue.lock);
+        worker->sock = sock;
+        pthread_mutex_unlock(&queue.lock);
+        status = shard_connection(worker, sock);
+        disconnect_worker(worker);
+    }
+
+    pthread_mutex_lock(&queue.lock);
+    if (worker->shard == -1) {
+        erasure.pending--;
+    } else {
+        erasure.live[worker->shard]--;
+    }
+    if (erasure_stranded()) {
+        erasure.failed = 1;
+    }
+    pthread_cond_broadcast(&erasure.changed);
+    pthread_mutex_unlock(&queue.lock);
+    pthread_exit((void *)(intptr_t)(status != 0));
+}
+
+// -D: ask a mirror for the signatures of every block of the new file, SIGNATURE_MAX_SPAN bytes per request with up
+// to PIPELINE_DEPTH requests in flight. Returns -1 if the mirror is unreachable or does not sign blocks.
+int fetch_signatures(const Server *server, const char *name, size_t file_size, FrameSignature *signatures)
+{
+    int sock = connect_to_server(server->ip, server->port);
+    if (sock == -1) {
+        return -1;
+    }
+    struct timeval timeout = { STALL_TIMEOUT, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    size_t spans = (file_size + SIGNATURE_MAX_SPAN - 1) / SIGNATURE_MAX_SPAN;
+    unsigned char *body = malloc((SIGNATURE_MAX_SPAN / SIGNATURE_MIN_BLOCK) * FRAME_SIGNATURE_SIZE);
+    int status = body ? 0 : -1;
+    for (size_t sent = 0, received = 0; status == 0 && received < spans; ) {
+        size_t offset = ((sent < spans && sent < received + PIPELINE_DEPTH) ? sent : received) * SIGNATURE_MAX_SPAN;
+        size_t length = (file_size - offset < SIGNATURE_MAX_SPAN) ? file_size - offset : SIGNATURE_MAX_SPAN;
+        if (sent < spans && sent < received + PIPELINE_DEPTH) {
+            status = send_request(sock, WIRE_BINARY, FRAME_SIGNATURES, sent, name, offset, length);
+            sent++;
+            continue;
+        }
+        size_t count = (length + delta.block - 1) / delta.block;
+        FrameHeader reply;
+        if (read_reply(sock, WIRE_BINARY, FRAME_SIGNATURES, received, &reply) != 0 || reply.offset != count
+            || reply.length != count * FRAME_SIGNATURE_SIZE
+            || recv(sock, body, reply.length, MSG_WAITALL) != (ssize_t)reply.length) {
+            status = -1;
+            break;
+        }
+        for (size_t i = 0; i < count; i++) {
+            signature_decode(body + i * FRAME_SIGNATURE_SIZE, &signatures[offset / delta.block + i]);
+        }
+        delta.signature_bytes += FRAME_HEADER_SIZE + reply.length;
+        received++;
+    }
+    free(body);
+    close(sock);
+    return status;
+}
+
+// -D: move length bytes of OUTPUT_FILE from source to destination through buffer (DELTA_COPY_RUN bytes), which
+// lets the two ranges overlap
+void delta_copy(int fd, char *buffer, size_t source, size_t destination, size_t length)
+{
+    for (size_t done = 0; done < length; ) {
+        ssize_t bytes = pread(fd, buffer + done, length - done, source + done);
+        if (bytes <= 0) {
+            fprintf(stderr, "Error reading %s: %s\n", OUTPUT_FILE, bytes ? strerror(errno) : "file truncated");
+            exit(EXIT_FAILURE);
+        }
+        done += bytes;
+    }
+    for (size_t done = 0; done < length; ) {
+        ssize_t bytes = pwrite(fd, buffer + done, length - done, destination + done);
+        if (bytes <= 0) {
+            perror("Error writing " OUTPUT_FILE);
+            exit(EXIT_FAILURE);
+        }
+        done += bytes;
+    }
+}
+
+// -D: whether moving the block at source would read a block that an earlier move overwrote
+int delta_clobbered(const unsigned char *written, size_t source, size_t count)
+{
+    size_t first = source / delta.block, last = (source + delta.block - 1) / delta.block;
+    return (first < count && (written[first / 8] >> (first % 8) & 1))
+           || (last < count && (written[last / 8] >> (last % 8) & 1));
+}
+
+// -D: rebuild as much of the file_size-byte file as OUTPUT_FILE, an old copy, allows, in place. Each block of the
+// new file is looked for at every offset of the old copy, then the blocks found are moved to their offsets: those
+// that move towards the start front to back, then those that move towards the end back to front, so that no move
+// overwrites a block a later one reads within its pass. A block whose old bytes a move of the first pass overwrote
+// is fetched instead. The blocks not found are queued for the connections, like the gaps of a resumed download.
+// Returns the bytes found; 0, with nothing queued, if there is no old copy or no mirror signs blocks.
+size_t delta_sync(const Server *servers, int server_count, const char *name, size_t file_size)
+{
+    if (file_size == 0) {
+        return 0;
+    }
+    int fd = open(OUTPUT_FILE, O_RDWR);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1 || info.st_size == 0) {
+        LOG_INFO("Delta sync: no old copy in %s, downloading all of %s\n", OUTPUT_FILE, name);
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+    size_t basis_size = info.st_size;
+    size_t block = delta.block = signature_block_size(file_size);
+    size_t count = (file_size + block - 1) / block;
+    size_t full = file_size / block; // Only whole blocks are looked for: a short last block is always fetched
+    int slot_bits = 4;
+    while (((size_t)1 << slot_bits) < 2 * full) {
+        slot_bits++;
+    }
+    size_t slots = (size_t)1 << slot_bits;
+    FrameSignature *signatures = malloc(count * sizeof(FrameSignature));
+    size_t *sources = malloc(count * sizeof(size_t)); // Offset of each block in the old copy, DELTA_NONE if not found
+    size_t *table = malloc(slots * sizeof(size_t)); // Open addressing by weak checksum: the first block of each signature
+    size_t *same = malloc(count * sizeof(size_t)); // Next block with the same signature (e.g. all-zero blocks), DELTA_NONE
+    unsigned char *filled = calloc((count + 7) / 8, 1); // Of the first blocks: every block with the signature has a source
+    unsigned char *written = calloc((count + 7) / 8, 1);
+    char *buffer = pool_get(DELTA_COPY_RUN);
+    DeltaFilter filter;
+    if (!signatures || !sources || !table || !same || !filled || !written || !buffer || delta_filter_init(&filter, full) == -1) {
+        perror("Failed to allocate delta sync tables");
+        exit(EXIT_FAILURE);
+    }
+
+    const Server *signer = NULL;
+    for (int i = 0; i < server_count && !signer; i++) {
+        if (servers[i].protocol == WIRE_BINARY && fetch_signatures(&servers[i], name, file_size, signatures) == 0) {
+            signer = &servers[i];
+        }
+    }
+    if (!signer) {
+        fprintf(stderr, "No mirror signs the blocks of %s, downloading all of it\n", name);
+        close(fd);
+        free(signatures);
+        free(sources);
+        free(table);
+        free(same);
+        free(filled);
+        free(written);
+        free(filter.bits);
+        pool_put(buffer, DELTA_COPY_RUN);
+        return 0;
+    }
+
+    memset(table, 0xff, slots * sizeof(size_t));
+    for (size_t j = 0; j < count; j++) {
+        sources[j] = same[j] = DELTA_NONE;
+        if (j < full) {
+            delta_filter_add(&filter, signatures[j].weak);
+            size_t slot = ((uint64_t)signatures[j].weak * 0x9E3779B97F4A7C15ULL) >> (64 - slot_bits);
+            while (table[slot] != DELTA_NONE && (signatures[table[slot]].weak != signatures[j].weak
+                                                 || signatures[table[slot]].strong != signatures[j].strong)) {
+                slot = (slot + 1) & (slots - 1);
+            }
+            if (table[slot] == DELTA_NONE) {
+                table[slot] = j;
+            } else {
+                same[j] = same[table[slot]];
+                same[table[slot]] = j;
+            }
+        }
+    }
+
+    double start = now_seconds();
+    const uint8_t *basis = (basis_size >= block && full > 0) ? mmap(NULL, basis_size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    if (basis == MAP_FAILED) {
+        perror("Failed to map " OUTPUT_FILE);
+        exit(EXIT_FAILURE);
+    }
+    size_t positions = basis ? basis_size - block + 1 : 0;
+    if (basis) {
+        madvise((void *)basis, basis_size, MADV_SEQUENTIAL);
+    }
+
+    // Blocks still at their own offset, the bulk of a lightly edited file, are checked first: they need no move
+    for (size_t j = 0; basis && j < full && (j + 1) * block <= basis_size; j++) {
+        if (delta_weak(basis + j * block, block) == signatures[j].weak
+            && delta_strong(basis + j * block, block) == signatures[j].strong) {
+            sources[j] = j * block;
+        }
+    }
+
+    // The rolling scan finds the rest wherever they moved. After a match it jumps a block ahead, where the next
+    // block usually follows.
+    uint32_t weak = basis ? delta_weak(basis, block) : 0;
+    for (size_t p = 0; p < positions; ) {
+        p += delta_scan(basis + p, block, positions - p, &weak, &filter);
+        if (p == positions) {
+            break;
+        }
+        int found = 0, hashed = 0;
+        uint64_t strong = 0;
+        size_t slot = ((uint64_t)weak * 0x9E3779B97F4A7C15ULL) >> (64 - slot_bits);
+        for (; table[slot] != DELTA_NONE && !found; slot = (slot + 1) & (slots - 1)) {
+            size_t j = table[slot];
+            if (signatures[j].weak != weak) {
+                continue;
+            }
+            if (!hashed) {
+                strong = delta_strong(basis + p, block);
+                hashed = 1;
+            }
+            if (signatures[j].strong != strong) {
+                continue;
+            }
+            found = 1;
+            // Any copy of a block will do, so the first found serves every block with its signature not in place
+            if (!(filled[j / 8] >> (j % 8) & 1)) {
+                for (size_t k = j; k != DELTA_NONE; k = same[k]) {
+                    if (sources[k] == DELTA_NONE) {
+                        sources[k] = p;
+                    }
+                }
+                filled[j / 8] |= 1 << (j % 8);
+            }
+        }
+        if (found && p + block < positions) {
+            p += block;
+            weak = delta_weak(basis + p, block);
+        } else if (found) {
+            break;
+        } else {
+            if (p + 1 < positions) {
+                weak = delta_roll(weak, basis[p], basis[p + block], block);
+            }
+            p++;
+        }
+    }
+    delta.scan_seconds = now_seconds() - start;
+    if (basis) {
+        munmap((void *)basis, basis_size);
+    }
+
+    // First pass, blocks moving towards the start: front to back, in runs of consecutive sources
+    for (size_t j = 0; j < count; ) {
+        if (sources[j] == DELTA_NONE || sources[j] <= j * block) {
+            j++;
+            continue;
+        }
+        size_t first = j;
+        do {
+            written[j / 8] |= 1 << (j % 8);
+            j++;
+        } while (j < count && (j - first) * block < DELTA_COPY_RUN && sources[j] != DELTA_NONE
+                 && sources[j] == sources[j - 1] + block);
+        delta_copy(fd, buffer, sources[first], first * block, (j - first) * block);
+    }
+    // Second pass, blocks moving towards the end: back to front. Sources the first pass overwrote are given up.
+    for (size_t j = count; j > 0; ) {
+        size_t last = j - 1;
+        if (sources[last] != DELTA_NONE && sources[last] < last * block && delta_clobbered(written, sources[last], count)) {
+            sources[last] = DELTA_NONE;
+        }
+        if (sources[last] == DELTA_NONE || sources[last] >= last * block) {
+            j--;
+            continue;
+        }
+        do {
+            j--;
+        } while (j > 0 && (last + 1 - j) * block < DELTA_COPY_RUN && sources[j - 1] != DELTA_NONE
+                 && sources[j - 1] + block == sources[j] && !delta_clobbered(written, sources[j - 1], count));
+        delta_copy(fd, buffer, sources[j], j * block, (last + 1 - j) * block);
+    }
+    if (basis_size != file_size && ftruncate(fd, file_size) == -1) {
+        perror("Failed to resize " OUTPUT_FILE);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    // Returned ranges are claimed last first, so queue the missing runs from the end of the file
+    size_t found = 0;
+    for (size_t j = count; j > 0; ) {
+        if (sources[j - 1] != DELTA_NONE) {
+            found += block;
+            delta.in_place += (sources[j - 1] == (j - 1) * block);
+            j--;
+            continue;
+        }
+        size_t end = j;
+        while (j > 0 && sources[j - 1] == DELTA_NONE) {
+            j--;
+        }
+        size_t stop = (end * block < file_size) ? end * block : file_size;
+        return_range(j * block, stop - j * block);
+    }
+    queue.next_offset = file_size;
+    delta.found = found;
+
+    LOG_INFO("Delta sync: %zu of %zu blocks of %zu KB found in %s (%zu already in place), %zu bytes to fetch\n",
+             found / block, count, block / 1024, OUTPUT_FILE, delta.in_place, file_size - found);
+    LOG_INFO("Delta sync: %" PRIu64 " bytes of signatures from %s:%d; scanned %zu bytes in %.3f s with the %s kernel\n",
+             delta.signature_bytes, signer->ip, signer->port, basis_size, delta.scan_seconds, delta_implementation());
+    free(signatures);
+    free(sources);
+    free(table);
+    free(same);
+    free(filled);
+    free(written);
+    free(filter.bits);
+    pool_put(buffer, DELTA_COPY_RUN);
+    return found;
+}
+
+// Event-driven engine (-e epoll): instead of a thread per connection, each of a few loop threads drives its share
+// of the connections, non-blocking, from one epoll instance. Each connection is still a Worker, which keeps the
+// unit, the in-flight pieces and the counters, so claiming, stealing and requeueing work as in the threaded engine;
+// a Stream adds the state of the response being parsed. Data is received straight to its offset in the output
+// (-o memory, mmap) or through the loop's one buffer (-o stream). Late pieces are not hedged.
+typedef enum {
+    STREAM_CONNECTING, // Non-blocking connect() in progress
+    STREAM_REPLY, // Waiting for the header of the oldest in-flight piece, or idle
+    STREAM_CHECKSUMS, // Waiting for the oldest piece's checksums
+    STREAM_BODY, // Receiving the oldest piece's data
+    STREAM_IDLE, // Disconnected: the mirror closed the connection between replies, and there was no work to reconnect for
+    STREAM_DEAD // Out of mirrors or retries; its work went back to the queue
+} StreamPhase;
+
+typedef struct {
+    Worker *worker;
+    StreamPhase phase;
+    int server_index; // Mirror of the current connection, in queue.servers
+    int failures; // Broken connections so far, up to WORKER_RETRIES
+    int tries; // Mirrors that refused the connection being made
+    int moved; // Left a mirror that never answered; waits on this one until it does
+    uint32_t events; // Registered with epoll
+    char out[PIPELINE_MAX * REQUEST_MAX]; // Requests not yet (fully) sent
+    size_t out_sent, out_len;
+    char in[FRAME_HEADER_SIZE + 4 * CHECKSUM_MAX_BLOCKS]; // Header and checksum bytes not yet parsed
+    size_t in_len;
+    int checked; // The oldest piece's response carries checksums
+    uint32_t crcs[CHECKSUM_MAX_BLOCKS];
+    size_t body_done; // Bytes of the oldest piece landed
+    uint32_t crc; // Checksum so far of the block being received (-o stream)
+    uint64_t corrupt;
+    uint32_t requested, received; // Request ids, as in run_connection()
+    double last_activity; // Last data received, or when the stream last started waiting for some
+    double last_arrival; // Last piece completed
+} Stream;
+
+typedef struct {
+    Stream *streams;
+    int count;
+    int epoll_fd;
+    char *buffer; // -o stream: where data is received before it is written out
+    double now; // Time of the last wakeup
+    int failed; // Streams that died
+} EventLoop;
+
+// Register the events the stream waits for, if they changed. Returns -1 on failure.
+int stream_watch(EventLoop *loop, Stream *stream, uint32_t events)
+{
+    if (events == stream->events) {
+        return 0;
+    }
+    struct epoll_event event = { .events = events, .data.ptr = stream };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, stream->worker->sock, &event) == -1) {
+        perror("Failed to update epoll registration");
+        return -1;
+    }
+    stream->events = events;
+    return 0;
+}
+
+// Start a non-blocking connect to queue.servers[stream->server_index], or failing that to the mirrors after it in
+// rank order. Returns -1, leaving the stream dead, once every mirror has refused.
+int stream_connect(EventLoop *loop, Stream *stream)
+{
+    for (; stream->tries < queue.server_count; stream->tries++) {
+        Server *server = &queue.servers[stream->server_index];
+        struct sockaddr_in server_addr = { .sin_family = AF_INET, .sin_port = htons(server->port) };
+        inet_pton(AF_INET, server->ip, &server_addr.sin_addr);
+
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (sock == -1) {
+            perror("Socket creation failed");
+            break;
+        }
+        struct epoll_event event = { .events = EPOLLOUT, .data.ptr = stream };
+        if ((connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 && errno != EINPROGRESS)
+            || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, sock, &event) == -1) {
+            fprintf(stderr, "Unable to connect to %s:%d: %s\n", server->ip, server->port, strerror(errno));
+            close(sock);
+            stream->server_index = (stream->server_index + 1) % queue.server_count;
+            continue;
+        }
+        stream->events = EPOLLOUT;
+        stream->phase = STREAM_CONNECTING;
+        pthread_mutex_lock(&queue.lock);
+        stream->worker->server = server;
+        stream->worker->sock = sock;
+        pthread_mutex_unlock(&queue.lock);
+        return 0;
+    }
+    stream->phase = STREAM_DEAD;
+    loop->failed++;
+    return -1;
+}
+
+// Send as much of the unsent requests as the socket takes, and wait for the socket to take the rest.
+// Returns -1 if the connection broke.
+int stream_flush(EventLoop *loop, Stream *stream)
+{
+    while (stream->out_sent < stream->out_len) {
+        ssize_t sent = send(stream->worker->sock, stream->out + stream->out_sent, stream->out_len - stream->out_sent, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("Write failed.");
+            return -1;
+        }
+        stream->out_sent += sent;
+    }
+    if (stream->out_sent == stream->out_len) {
+        stream->out_sent = stream->out_len = 0;
+    }
+    return stream_watch(loop, stream, EPOLLIN | (stream->out_len ? EPOLLOUT : 0));
+}
+
+// Keep the pipeline full, as run_connection() does. Returns -1 if the connection broke.
+int stream_fill(EventLoop *loop, Stream *stream)
+{
+    Worker *worker = stream->worker;
+    memmove(stream->out, stream->out + stream->out_sent, stream->out_len - stream->out_sent);
+    stream->out_len -= stream->out_sent;
+    stream->out_sent = 0;
+
+    FrameRange piece;
+    while (!pipeline_full(worker) && next_piece(worker, &piece)) {
+        if (worker->count == 1) {
+            stream->last_activity = loop->now; // Stall time counts from the first request after being idle
+        }
+        BatchFile *file = batch_file(piece.offset);
+        int request_len = format_request(worker->server->protocol, FRAME_GET, stream->requested++, file->name,
+                                         piece.offset - file->start, piece.length, stream->out + stream->out_len);
+        if (request_len == -1) {
+            return -1;
+        }
+        stream->out_len += request_len;
+    }
+    return stream_flush(loop, stream);
+}
+
+// The connection is up (or failed): start requesting pieces, or try the next mirror
+int stream_connected(EventLoop *loop, Stream *stream)
+{
+    Worker *worker = stream->worker;
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(worker->sock, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0) {
+        fprintf(stderr, "Unable to connect to %s:%d: %s\n", worker->server->ip, worker->server->port, strerror(error));
+        disconnect_worker(worker);
+        stream->tries++;
+        stream->server_index = (stream->server_index + 1) % queue.server_count;
+        return stream_connect(loop, stream);
+    }
+
+    LOG_INFO("Connected to %s:%d.\n", worker->server->ip, worker->server->port);
+    stream->tries = 0;
+    stream->phase = STREAM_REPLY;
+    stream->events = EPOLLOUT;
+    stream->out_sent = stream->out_len = stream->in_len = 0;
+    stream->requested = stream->received = 0;
+    stream->last_activity = stream->last_arrival = loop->now;
+    worker->served = 0;
+    return stream_fill(loop, stream);
+}
+
+// The connection broke: requeue its work and connect to the next mirror, up to WORKER_RETRIES times
+void stream_fail(EventLoop *loop, Stream *stream)
+{
+    Worker *worker = stream->worker;
+    abandon_work(worker);
+    disconnect_worker(worker); // Closing the socket also drops it from the epoll set
+    counter_add(&worker->counters.retries, 1);
+    if (++stream->failures > WORKER_RETRIES) {
+        stream->phase = STREAM_DEAD;
+        loop->failed++;
+        return;
+    }
+    stream->server_index = (stream->server_index + 1) % queue.server_count;
+    stream_connect(loop, stream);
+}
+
+// The mirror closed the connection between replies (see mirror_closed()): requeue its work and stay disconnected
+// until loop_tick() finds more
+void stream_idle(Stream *stream)
+{
+    abandon_work(stream->worker);
+    disconnect_worker(stream->worker);
+    stream->phase = STREAM_IDLE;
+}
+
+// The oldest piece has been received in full: settle it and request more
+int stream_finish_piece(EventLoop *loop, Stream *stream)
+{
+    Worker *worker = stream->worker;
+    Server *server = worker->server;
+    FrameRange piece = worker->in_flight[worker->head];
+    if (stream->checked && output.mode != OUTPUT_STREAM) {
+        stream->corrupt = verify_blocks(output.data + piece.offset, piece.length, 0, stream->crcs);
+    }
+
+    pthread_mutex_lock(&queue.lock);
+    worker->head = (worker->head + 1) % PIPELINE_MAX;
+    worker->count--;
+    worker->waiting_since = loop->now;
+    pthread_mutex_unlock(&queue.lock);
+    stream->received++;
+    stream->phase = STREAM_REPLY;
+    settle_range(piece.offset, piece.length, stream->corrupt);
+
+    // Corrupt blocks are already queued again; a mirror that keeps sending them is given up on
+    if (stream->corrupt && ++worker->corrupt >= CORRUPT_LIMIT) {
+        fprintf(stderr, "Too many corrupt responses from %s:%d, dropping the connection\n", server->ip, server->port);
+        return -1;
+    }
+    record_arrival(worker, piece.length, &stream->last_arrival);
+    return stream_fill(loop, stream);
+}
+
+// Land bytes of the oldest piece's data, received at data, in the output. Returns -1 if the write fails or the
+// piece completes a mirror's CORRUPT_LIMIT.
+int stream_land(EventLoop *loop, Stream *stream, const char *data, size_t bytes)
+{
+    Worker *worker = stream->worker;
+    FrameRange piece = worker->in_flight[worker->head];
+    size_t offset = piece.offset + stream->body_done;
+
+    if (output.mode == OUTPUT_STREAM) {
+        if (stream->checked) {
+            stream->corrupt |= verify_partial(data, bytes, stream->body_done, piece.length, &stream->crc, stream->crcs);
+        }
+        if (write_output(data, bytes, offset) == -1) {
+            return -1;
+        }
+    } else if (data != output.data + offset) {
+        memcpy(output.data + offset, data, bytes); // Arrived together with a text status line
+    }
+    stream->body_done += bytes;
+    return (stream->body_done == piece.length) ? stream_finish_piece(loop, stream) : 0;
+}
+
+// Parse what has been collected in stream->in: the oldest piece's header and checksums, and any data that a text
+// status line was received with. Returns -1 if a response is bad.
+int stream_parse(EventLoop *loop, Stream *stream)
+{
+    Worker *worker = stream->worker;
+    Server *server = worker->server;
+    while (1) {
+        if (stream->in_len > 0 && worker->count == 0) {
+            fprintf(stderr, "Unexpected data from %s:%d\n", server->ip, server->port);
+            return -1;
+        }
+        FrameRange piece = worker->in_flight[worker->head];
+        size_t used;
+        if (stream->phase == STREAM_REPLY) {
+            FrameHeader reply;
+            int status = parse_reply(stream->in, stream->in_len, server->protocol, FRAME_GET, stream->received, &reply);
+            if (status == 0) {
+                return 0;
+            }
+            if (status < 0 || reply.length != piece.length
+                || ((reply.flags & FRAME_FLAG_CRC32C) && piece.length > CHECKSUM_MAX_BLOCKS * CHECKSUM_BLOCK)) {
+                fprintf(stderr, "Bad GET response for offset %" PRIu64 " from %s:%d\n", piece.offset, server->ip, server->port);
+                return -1;
+            }
+            used = status;
+            stream->checked = reply.flags & FRAME_FLAG_CRC32C;
+            stream->phase = stream->checked ? STREAM_CHECKSUMS : STREAM_BODY;
+            stream->body_done = 0;
+            stream->crc = 0;
+            stream->corrupt = 0;
+        } else if (stream->phase == STREAM_CHECKSUMS) {
+            size_t count = (piece.length + CHECKSUM_BLOCK - 1) / CHECKSUM_BLOCK;
+            if (stream->in_len < 4 * count) {
+                return 0;
+            }
+            for (size_t i = 0; i < count; i++) {
+                uint32_t crc;
+                memcpy(&crc, stream->in + 4 * i, 4);
+                stream->crcs[i] = be32toh(crc);
+            }
+            used = 4 * count;
+            stream->phase = STREAM_BODY;
+        } else {
+            if (stream->in_len == 0) {
+                return 0;
+            }
+            used = (stream->in_len < piece.length - stream->body_done) ? stream->in_len : piece.length - stream->body_done;
+            if (stream_land(loop, stream, stream->in, used) == -1) {
+                return -1;
+            }
+        }
+        stream->in_len -= used;
+        memmove(stream->in, stream->in + used, stream->in_len);
+    }
+}
+
+// The socket is readable: receive until it runs dry, or for EVENT_BURST recv()s so that one fast connection does
+// not hold up the rest. Data goes straight to the output; headers and checksums are collected in stream->in, exactly
+// (a binary frame, the checksums) or up to HEADER_SIZE bytes (a text status line, which has no length).
+// Returns -1 if the connection broke or sent a bad response.
+int stream_read(EventLoop *loop, Stream *stream)
+{
+    Worker *worker = stream->worker;
+    for (int burst = 0; burst < EVENT_BURST; burst++) {
+        FrameRange piece = worker->in_flight[worker->head];
+        char *target = stream->in + stream->in_len;
+        size_t want;
+        if (stream->phase == STREAM_BODY && stream->in_len == 0) {
+            want = (piece.length - stream->body_done > buffer_size) ? buffer_size : piece.length - stream->body_done;
+            target = (output.mode == OUTPUT_STREAM) ? loop->buffer : output.data + piece.offset + stream->body_done;
+        } else if (stream->phase == STREAM_CHECKSUMS) {
+            want = 4 * ((piece.length + CHECKSUM_BLOCK - 1) / CHECKSUM_BLOCK) - stream->in_len;
+        } else {
+            want = ((worker->server->protocol == WIRE_TEXT) ? HEADER_SIZE : FRAME_HEADER_SIZE) - stream->in_len;
+        }
+
+        ssize_t bytes_received = recv(worker->sock, target, want, 0);
+        counter_add(&worker->counters.recvs, 1);
+        if (bytes_received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (bytes_received == 0 && stream->phase == STREAM_REPLY && stream->in_len == 0
+            && (worker->count == 0 || stream->received > 0)) {
+            stream_idle(stream);
+            return 0;
+        }
+        if (bytes_received <= 0) {
+            if (bytes_received == 0) {
+                fprintf(stderr, "Server %s:%d closed the connection\n", worker->server->ip, worker->server->port);
+            } else {
+                perror("Error reading from socket");
+            }
+            return -1;
+        }
+        stream->last_activity = loop->now;
+        worker->served = 1;
+        stream->moved = 0;
+        LOG_DEBUG("Received %zd bytes from %s:%d\n", bytes_received, worker->server->ip, worker->server->port);
+
+        if (target == stream->in + stream->in_len) {
+            stream->in_len += bytes_received;
+            if (stream_parse(loop, stream) == -1) {
+                return -1;
+            }
+        } else if (stream_land(loop, stream, target, bytes_received) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Once per EVENT_TICK: idle streams look for requeued work, reconnecting if their mirror closed them, and streams
+// that have waited STALL_TIMEOUT for more data are dropped. One that has had no reply yet moves to the next mirror
+// once instead. Returns 1 while the loop has work, 0 once it has none and no
+// other connection could hand any back.
+int loop_tick(EventLoop *loop)
+{
+    int live = 0, busy = 0;
+    for (int i = 0; i < loop->count; i++) {
+        Stream *stream = &loop->streams[i];
+        Worker *worker = stream->worker;
+        if (stream->phase == STREAM_DEAD) {
+            continue;
+        }
+        if (stream->phase == STREAM_IDLE) {
+            pthread_mutex_lock(&queue.lock);
+            int claimed = worker->unit_next < worker->unit_end || claim_unit(worker);
+            pthread_mutex_unlock(&queue.lock);
+            if (claimed && stream_connect(loop, stream) == -1) {
+                abandon_work(worker);
+            }
+        } else if (stream->phase != STREAM_CONNECTING && worker->count == 0 && stream_fill(loop, stream) == -1) {
+            stream_fail(loop, stream);
+        } else if (stream->phase != STREAM_CONNECTING && worker->count > 0
+                   && loop->now - stream->last_activity > STALL_TIMEOUT) {
+            if (worker->served) {
+                fprintf(stderr, "No data for %d s from %s:%d\n", STALL_TIMEOUT, worker->server->ip, worker->server->port);
+                counter_add(&worker->counters.stalls, 1);
+                stream_fail(loop, stream);
+            } else if (!stream->moved && queue.server_count > 1) {
+                // Nothing yet: queued behind other clients of a blocking mirror rather than stalled. Try another
+                // mirror once, then wait there for as long as it takes.
+                LOG_INFO("No reply yet from %s:%d, moving to the next mirror\n", worker->server->ip, worker->server->port);
+                abandon_work(worker);
+                disconnect_worker(worker);
+                stream->moved = 1;
+                stream->server_index = (stream->server_index + 1) % queue.server_count;
+                if (stream_connect(loop, stream) == -1) {
+                    abandon_work(worker);
+                }
+            }
+        }
+        if (stream->phase != STREAM_DEAD) {
+            live++;
+            busy |= stream->phase == STREAM_CONNECTING || worker->count > 0 || worker->unit_next < worker->unit_end;
+        }
+    }
+    if (busy) {
+        return 1;
+    }
+    pthread_mutex_lock(&queue.lock);
+    int outstanding = live > 0 && work_outstanding(NULL);
+    pthread_mutex_unlock(&queue.lock);
+    return outstanding;
+}
+
+// An event loop's thread. Returns once no work is left.
+void *run_event_loop(void *arg)
+{
+    EventLoop *loop = (EventLoop *)arg;
+    loop->now = now_seconds();
+    for (int i = 0; i < loop->count; i++) {
+        stream_connect(loop, &loop->streams[i]);
+    }
+
+    struct epoll_event events[EVENT_BATCH];
+    double last_tick = loop->now;
+    while (1) {
+        int ready = epoll_wait(loop->epoll_fd, events, EVENT_BATCH, EVENT_TICK);
+        if (ready == -1 && errno != EINTR) {
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
+        loop->now = now_seconds();
+        for (int i = 0; i < ready; i++) {
+            Stream *stream = events[i].data.ptr;
+            int status = 0;
+            if (stream->phase == STREAM_CONNECTING) {
+                status = stream_connected(loop, stream);
+            } else {
+                if (events[i].events & EPOLLOUT) {
+                    status = stream_flush(loop, stream);
+                }
+                if (status == 0 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                    status = stream_read(loop, stream);
+                }
+            }
+            if (status == -1 && stream->phase != STREAM_DEAD) {
+                stream_fail(loop, stream);
+            }
+        }
+        if (loop->now - last_tick >= EVENT_TICK / 1000.0) {
+            last_tick = loop->now;
+            if (!loop_tick(loop)) {
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < loop->count; i++) {
+        if (loop->streams[i].phase != STREAM_DEAD) {
+            disconnect_worker(loop->streams[i].worker);
+        }
+    }
+    return NULL;
+}
+
+// Download with workers[0..count) spread over loops event loop threads. Returns the number of connections that
+// failed for good, whose work went back to the queue.
+int run_event_loops(Worker *workers, int count, int loops)
+{
+    // Every connection is a descriptor in this one process
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)count + 64) {
+        limit.rlim_cur = (limit.rlim_max < (rlim_t)count + 64) ? limit.rlim_max : (rlim_t)count + 64;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    Stream *streams = calloc(count, sizeof(Stream));
+    EventLoop *loop = calloc(loops, sizeof(EventLoop));
+    pthread_t *threads = calloc(loops, sizeof(pthread_t));
+    if (!streams || !loop || !threads) {
+        perror("Failed to allocate event loops");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        streams[i].worker = &workers[i];
+        streams[i].server_index = workers[i].server - queue.servers;
+    }
+
+    int failed = 0;
+    for (int i = 0, first = 0; i < loops; i++) {
+        loop[i].streams = &streams[first];
+        loop[i].count = count / loops + (i < count % loops);
+        first += loop[i].count;
+        loop[i].epoll_fd = epoll_create1(0);
+        if (loop[i].epoll_fd == -1) {
+            perror("epoll_create1 failed");
+            exit(EXIT_FAILURE);
+        }
+        if (output.mode == OUTPUT_STREAM) {
+            loop[i].buffer = output_borrow();
+        }
+        if (pthread_create(&threads[i], NULL, run_event_loop, &loop[i]) != 0) {
+            perror("Error creating thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < loops; i++) {
+        pthread_join(threads[i], NULL);
+        close(loop[i].epoll_fd);
+        if (loop[i].buffer) {
+            output_return(loop[i].buffer);
+        }
+        failed += loop[i].failed;
+    }
+    free(threads);
+    free(loop);
+    free(streams);
+    return failed;
+}
+
+// CHECK every file of the batch, CHECK_BATCH requests per write(), recording the sizes in server->sizes, their
+// total in server->file_size and the newest mtime in server->mtime. The round trip of the first batch is the
+// mirror's rtt. Returns 0, -1 if the mirror has none of the files, or -2 if it does not understand the requests.
+int check_files(int sock, Server *server, double start)
+{
+    char requests[CHECK_BATCH * REQUEST_MAX];
+    int found = 0;
+    server->file_size = 0;
+    server->mtime = 0;
+    for (int first = 0; first < batch.count; first += CHECK_BATCH) {
+        int last = (batch.count - first > CHECK_BATCH) ? first + CHECK_BATCH : batch.count;
+        size_t requests_len = 0;
+        for (int i = first; i < last; i++) {
+            int request_len = format_request(server->protocol, FRAME_CHECK, i, batch.files[i].name, 0, 0, requests + requests_len);
+            if (request_len == -1) {
+                return -1;
+            }
+            requests_len += request_len;
+        }
+        if (write(sock, requests, requests_len) != (ssize_t)requests_len) {
+            perror("Write failed.");
+            return -1;
+        }
+
+        for (int i = first; i < last; i++) {
+            FrameHeader reply;
+            int status = read_reply(sock, server->protocol, FRAME_CHECK, i, &reply);
+            if (status == -2) {
+                return -2;
+            }
+            server->sizes[i] = (status == 0) ? reply.length : FILE_MISSING;
+            if (status == 0) {
+                found++;
+                server->file_size += reply.length;
+                if (reply.offset > server->mtime) {
+                    server->mtime = reply.offset;
+                }
+            }
+        }
+        if (first == 0) {
+            server->rtt = now_seconds() - start;
+        }
+    }
+    return found ? 0 : -1;
+}
+
+// Probe one mirror: time connect + CHECK, then a PROBE_SAMPLE GET from the start of the file.
+// Binary frames are tried first; a server that does not answer them is probed again in text. Every recv waits at
+// most STALL_TIMEOUT, so a mirror that accepts but never answers is dropped instead of holding up the others.
+void *probe_server(void *arg)
+{
+    Server *server = (Server *)arg;
+    server->protocol = wire_protocol;
+    server->failure = PROBE_UNREACHABLE;
+    server->sizes = malloc(batch.count * sizeof(size_t));
+    if (!server->sizes) {
+        perror("Failed to allocate file sizes");
+        return NULL;
+    }
+
+    while (1) {
+        double start = now_seconds();
+        int sock = connect_to_server(server->ip, server->port);
+        if (sock == -1) {
+            return NULL;
+        }
+        struct timeval timeout = { STALL_TIMEOUT, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        int status = check_files(sock, server, start);
+        if (status == -2 && now_seconds() - start >= STALL_TIMEOUT) {
+            fprintf(stderr, "No answer from %s:%d for %d s\n", server->ip, server->port, STALL_TIMEOUT);
+            server->failure = PROBE_TIMED_OUT;
+            close(sock);
+            return NULL;
+        }
+        if (status == -2 && server->protocol == WIRE_BINARY) {
+            fprintf(stderr, "%s:%d does not speak binary frames, retrying in text\n", server->ip, server->port);
+            server->protocol = WIRE_TEXT;
+            close(sock);
+            continue;
+        }
+        if (status != 0 || (!batch.manifest && server->file_size == 0)) {
+            fprintf(stderr, "CHECK %s failed on %s:%d\n", batch.manifest ? batch.manifest : batch.files[0].name, server->ip, server->port);
+            server->failure = (status == -1) ? PROBE_NO_FILE : PROBE_CHECK_FAILED;
+            close(sock);
+            return NULL;
+        }
+
+        // Throughput sample from the largest file, on the same connection; a mirror that fails it stays usable,
+        // just ranked last
+        int largest = 0;
+        for (int i = 1; i < batch.count; i++) {
+            if (server->sizes[i] != FILE_MISSING && (server->sizes[largest] == FILE_MISSING || server->sizes[i] > server->sizes[largest])) {
+                largest = i;
+            }
+        }
+        size_t sample = (server->sizes[largest] > PROBE_SAMPLE) ? PROBE_SAMPLE : server->sizes[largest];
+        char *buffer = pool_get(sample);
+        uint32_t crcs[CHECKSUM_MAX_BLOCKS];
+        FrameHeader sample_reply;
+        uint32_t request_id = batch.count; // After the CHECKs
+        start = now_seconds();
+        if (buffer && sample > 0 && send_request(sock, server->protocol, FRAME_GET, request_id, batch.files[largest].name, 0, sample) == 0
+            && read_reply(sock, server->protocol, FRAME_GET, request_id, &sample_reply) == 0 && sample_reply.length == sample
+            && (!(sample_reply.flags & FRAME_FLAG_CRC32C) || read_checksums(sock, sample, crcs) == 0)
+            && recv_body(sock, buffer, sample) == 0) {
+            server->throughput = sample / (now_seconds() - start);
+        }
+        pool_put(buffer, sample);
+        close(sock);
+        server->reachable = 1;
+        return NULL;
+    }
+}
+
+// Fastest first; RTT breaks ties (e.g. mirrors whose sample failed)
+int compare_servers(const void *a, const void *b)
+{
+    const Server *left = a, *right = b;
+    if (left->throughput != right->throughput) {
+        return (left->throughput > right->throughput) ? -1 : 1;
+    }
+    return (left->rtt > right->rtt) - (left->rtt < right->rtt);
+}
+
+// Whether two mirrors report the same size for every file
+int same_sizes(const Server *a, const Server *b)
+{
+    return memcmp(a->sizes, b->sizes, batch.count * sizeof(size_t)) == 0;
+}
+
+// Probe every mirror at once, keep the reachable ones that agree on the file sizes (the most common sizes win),
+// and sort them fastest first. Returns how many are left at the front of servers.
+int probe_servers(Server *servers, int server_count)
+{
+    pthread_t threads[server_count];
+    for (int i = 0; i < server_count; i++) {
+        if (pthread_create(&threads[i], NULL, probe_server, &servers[i]) != 0) {
+            perror("Error creating probe thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < server_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    Server *reference = NULL;
+    int votes = 0;
+    for (int i = 0; i < server_count; i++) {
+        int agreeing = 0;
+        for (int j = 0; j < server_count; j++) {
+            agreeing += servers[j].reachable && same_sizes(&servers[j], &servers[i]);
+        }
+        if (servers[i].reachable && agreeing > votes) {
+            reference = &servers[i];
+            votes = agreeing;
+        }
+    }
+
+    // The reference may move down as mirrors are dropped, so keep its sizes aside
+    size_t file_size = reference ? reference->file_size : 0;
+    size_t *sizes = reference ? reference->sizes : NULL;
+    int mirror_count = 0;
+    for (int i = 0; i < server_count; i++) {
+        if (!servers[i].reachable && servers[i].failure == PROBE_NO_FILE) {
+            fprintf(stderr, "Dropping %s:%d: does not have %s\n", servers[i].ip, servers[i].port,
+                    batch.manifest ? "any file of the manifest" : batch.files[0].name);
+        } else if (!servers[i].reachable) {
+            fprintf(stderr, "Dropping %s:%d: %s\n", servers[i].ip, servers[i].port,
+                    (servers[i].failure == PROBE_TIMED_OUT) ? "no answer" : (servers[i].failure == PROBE_CHECK_FAILED) ? "CHECK failed" : "unreachable");
+        } else if (servers[i].sizes != sizes && memcmp(servers[i].sizes, sizes, batch.count * sizeof(size_t)) != 0) {
+            fprintf(stderr, "Dropping %s:%d: reports %zu bytes, other mirrors %zu\n", servers[i].ip, servers[i].port, servers[i].file_size, file_size);
+        } else {
+            servers[mirror_count++] = servers[i];
+            continue;
+        }
+        free(servers[i].sizes);
+    }
+    qsort(servers, mirror_count, sizeof(Server), compare_servers);
+
+    for (int i = 0; i < mirror_count; i++) {
+        LOG_INFO("Mirror %d: %s:%d, rtt %.2f ms, %.1f MB/s, %s\n", i, servers[i].ip, servers[i].port, servers[i].rtt * 1000,
+                 servers[i].throughput / 1048576, (servers[i].protocol == WIRE_BINARY) ? "binary" : "text");
+    }
+    return mirror_count;
+}
+
+int compare_ranges(const void *a, const void *b)
+{
+    const FrameRange *left = a, *right = b;
+    return (left->offset > right->offset) - (left->offset < right->offset);
+}
+
+// Re-fetch the ranges no worker could finish, trying each mirror in rank order. Ranges are cut at file boundaries
+// and to the longest a checked GET_RANGES may ask for, then sent FRAME_MAX_RANGES of one file per request.
+// Returns -1 if some range could not be fetched from any mirror.
+int repair_ranges(Server *servers, int server_count, const FrameRange *missing, int missing_count)
+{
+    const uint64_t max_range = (uint64_t)CHECKSUM_MAX_BLOCKS * CHECKSUM_BLOCK;
+    FrameRange *ranges = NULL;
+    int range_count = 0;
+    for (int pass = 0; pass < 2; pass++) { // Count the ranges, then fill them in
+        range_count = 0;
+        for (int i = 0; i < missing_count; i++) {
+            for (uint64_t offset = missing[i].offset, end = offset + missing[i].length; offset < end; ) {
+                const BatchFile *file = batch_file(offset);
+                uint64_t length = (file->start + file->size < end) ? file->start + file->size - offset : end - offset;
+                if (length > max_range) {
+                    length = max_range;
+                }
+                if (ranges) {
+                    ranges[range_count] = (FrameRange){ offset, length };
+                }
+                range_count++;
+                offset += length;
+            }
+        }
+        if (pass == 0 && !(ranges = malloc((range_count + 1) * sizeof(FrameRange)))) {
+            perror("Failed to allocate repair ranges");
+            return -1;
+        }
+    }
+    qsort(ranges, range_count, sizeof(FrameRange), compare_ranges);
+
+    int fetched = 0;
+    for (int i = 0; i < server_count && fetched < range_count; i++) {
+        int sock = connect_to_server(servers[i].ip, servers[i].port);
+        if (sock == -1) {
+            continue;
+        }
+        struct timeval timeout = { STALL_TIMEOUT, 0 }; // A mirror that stops answering is left for the next one
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        while (fetched < range_count) {
+            const BatchFile *file = batch_file(ranges[fetched].offset);
+            int count = 1;
+            while (count < FRAME_MAX_RANGES && fetched + count < range_count && batch_file(ranges[fetched + count].offset) == file) {
+                count++;
+            }
+            int received = fetch_ranges(sock, servers[i].protocol, file, ranges + fetched, count);
+            fetched += received;
+            if (received < count) {
+                break; // Connection is no longer usable: move on to the next server
+            }
+        }
+        close(sock);
+    }
+    free(ranges);
+    return (fetched == range_count) ? 0 : -1;
+}
+
+// Progress reporter: a thread that wakes every report_interval seconds (-i) and prints totals from the counters,
+// as a line on stderr or, with -j, as one JSON object per line on stdout. The download threads never format text.
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+    int done;
+    size_t resumed; // Bytes already in the output before this run
+    double start;
+    uint64_t last_bytes; // Totals at the previous report, for the current rate
+    double last_time;
+} Reporter;
+
+Reporter reporter = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0 };
+
+// Print one report. The final one gives the average rate over the whole download instead of the current rate.
+void report_progress(int final)
+{
+    Counters total = { 0 };
+    const Counters *sources[queue.worker_count + 1];
+    for (int i = 0; i < queue.worker_count; i++) {
+        sources[i] = &queue.workers[i].counters;
+    }
+    sources[queue.worker_count] = &repair_counters;
+    for (int i = 0; i <= queue.worker_count; i++) {
+        total.bytes += counter_read(&sources[i]->bytes);
+        total.recvs += counter_read(&sources[i]->recvs);
+        total.retries += counter_read(&sources[i]->retries);
+        total.stalls += counter_read(&sources[i]->stalls);
+    }
+
+    double now = now_seconds();
+    double since = final ? now - reporter.start : now - reporter.last_time;
+    uint64_t bytes = final ? total.bytes : total.bytes - reporter.last_bytes;
+    double rate = (since > 0) ? bytes / since / 1048576 : 0;
+    reporter.last_bytes = total.bytes;
+    reporter.last_time = now;
+
+    // Pieces re-fetched after a checksum mismatch count twice
+    size_t done = reporter.resumed + total.bytes;
+    if (done > queue.file_size) {
+        done = queue.file_size;
+    }
+    if (report_json) {
+        printf("{\"elapsed\": %.3f, \"bytes\": %zu, \"file_size\": %zu, \"MBps\": %.1f, \"recvs\": %" PRIu64 ", "
+               "\"retries\": %" PRIu64 ", \"stalls\": %" PRIu64 ", \"final\": %s}\n", now - reporter.start, done, queue.file_size, rate,
+               total.recvs, total.retries, total.stalls, final ? "true" : "false");
+        fflush(stdout);
+    } else {
+        LOG_INFO("Progress: %.1f of %.1f MB (%.1f%%), %.1f MB/s%s, %" PRIu64 " recv calls, %" PRIu64 " retries, %" PRIu64 " stalls\n",
+                 done / 1048576.0, queue.file_size / 1048576.0, queue.file_size ? 100.0 * done / queue.file_size : 100.0,
+                 rate, final ? " average" : "", total.recvs, total.retries, total.stalls);
+    }
+}
+
+void *run_reporter(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&reporter.lock);
+    while (!reporter.done) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        double at = wake.tv_sec + wake.tv_nsec / 1e9 + report_interval;
+        wake.tv_sec = (time_t)at;
+        wake.tv_nsec = (long)((at - (time_t)at) * 1e9);
+        if (pthread_cond_timedwait(&reporter.stop, &reporter.lock, &wake) == ETIMEDOUT) {
+            report_progress(0);
+        }
+    }
+    pthread_mutex_unlock(&reporter.lock);
+    return NULL;
+}
+
+// Parse a byte count with an optional K/M/G suffix (powers of 1024)
+double parse_size(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    switch (*end) {
+    case 'k': case 'K': value *= 1024; break;
+    case 'm': case 'M': value *= 1024 * 1024; break;
+    case 'g': case 'G': value *= 1024 * 1024 * 1024; break;
+    }
+    return value;
+}
+
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-p binary|text] [-o stream|mmap|memory] [-c crc32c|none] [-e threads|epoll] [-l loops] [-s size] [-v level] [-i seconds] [-j] [-T tracker [-P peer-connections] [-L seconds]] [-E] [-D] <server-info.txt> <num-connections> <filename>\n", program);
+    fprintf(stderr, "       %s [options] -M <manifest> <server-info.txt> <num-connections>\n", program);
+    fprintf(stderr, "  -M  download every file listed in the manifest, one \"<filename> [<destination>]\" per line\n");
+    fprintf(stderr, "  -o  stream: write %s in place as data arrives (default);\n", OUTPUT_FILE);
+    fprintf(stderr, "      mmap: receive into %s mapped in memory (not with -M); memory: hold the whole file in RAM first\n", OUTPUT_FILE);
+    fprintf(stderr, "  -c  crc32c: verify every %d KB block against the server's checksum and fetch bad ones again (default)\n", CHECKSUM_BLOCK / 1024);
+    fprintf(stderr, "  -e  threads: one thread per connection, which can hedge late pieces (default);\n");
+    fprintf(stderr, "      epoll: non-blocking connections driven by -l event loop threads (default 1, 0 for one per CPU)\n");
+    fprintf(stderr, "  -s  bytes per recv() and per stream buffer (K/M/G suffixes, default %d KB)\n", BUFFER_SIZE / 1024);
+    fprintf(stderr, "  -v  0: errors only; 1: connections, progress and summary (default); 2: every recv() too\n");
+    fprintf(stderr, "  -i  seconds between progress reports (default 1, 0 disables); -j: report as JSON lines on stdout\n");
+    fprintf(stderr, "  -T  swarm mode: serve completed blocks to other clients and fetch from them too, meeting them through the\n");
+    fprintf(stderr, "      server at <ip>:<port> (not with -M, -o memory or -e epoll); -P: peer connections (default num-connections);\n");
+    fprintf(stderr, "      -L: seconds to keep serving once the download is done (default 0)\n");
+    fprintf(stderr, "  -E  erasure-coded: each mirror serves one shard of <filename>%s (see ./shard), and each stripe is\n", RS_SUFFIX);
+    fprintf(stderr, "      rebuilt from the first k shards to arrive; at least one connection per mirror (not with -M, -T or -e epoll)\n");
+    fprintf(stderr, "  -D  delta sync: %s is an old copy of the file; blocks it still has are moved into place and only the\n", OUTPUT_FILE);
+    fprintf(stderr, "      rest is fetched (binary mirrors only; not with -M, -T, -E or -o memory)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    // A mirror that goes away mid-request must fail the write, not kill the client
+    signal(SIGPIPE, SIG_IGN);
+
+    int opt, peer_connections = -1;
+    while ((opt = getopt(argc, argv, "p:o:c:e:l:s:v:i:jM:T:P:L:ED")) != -1) {
+        switch (opt) {
+        case 'p':
+            if (strcmp(optarg, "binary") == 0) {
+                wire_protocol = WIRE_BINARY;
+            } else if (strcmp(optarg, "text") == 0) {
+                wire_protocol = WIRE_TEXT;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'o':
+            if (strcmp(optarg, "stream") == 0) {
+                output.mode = OUTPUT_STREAM;
+            } else if (strcmp(optarg, "mmap") == 0) {
+                output.mode = OUTPUT_MMAP;
+            } else if (strcmp(optarg, "memory") == 0) {
+                output.mode = OUTPUT_MEMORY;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            if (strcmp(optarg, "crc32c") == 0) {
+                checksums = 1;
+            } else if (strcmp(optarg, "none") == 0) {
+                checksums = 0;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "threads") == 0) {
+                engine = ENGINE_THREADS;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                engine = ENGINE_EPOLL;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'l':
+            event_loops = atoi(optarg);
+            if (event_loops < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 's': {
+            double size = parse_size(optarg);
+            if (size < 1 || size > POOL_MAX_BUFFER) { // Buffers of this size come from the pool, which tops out there
+                fprintf(stderr, "-s must be between 1 byte and %zu MB\n", POOL_MAX_BUFFER / 1048576);
+                usage(argv[0]);
+            }
+            buffer_size = size;
+            break;
+        }
+        case 'v':
+            log_level = atoi(optarg);
+            break;
+        case 'i':
+            report_interval = atof(optarg);
+            break;
+        case 'j':
+            report_json = 1;
+            break;
+        case 'M':
+            batch.manifest = optarg;
+            break;
+        case 'T':
+            if (sscanf(optarg, "%255[^:]:%d", swarm.tracker.ip, &swarm.tracker.port) != 2) {
+                usage(argv[0]);
+            }
+            swarm.enabled = 1;
+            break;
+        case 'P':
+            peer_connections = atoi(optarg);
+            if (peer_connections < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'L':
+            swarm.linger = atof(optarg);
+            break;
+        case 'E':
+            erasure.enabled = 1;
+            break;
+        case 'D':
+            delta.enabled = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != (batch.manifest ? 2 : 3) || (batch.manifest && output.mode == OUTPUT_MMAP)
+        || (swarm.enabled && (batch.manifest || output.mode == OUTPUT_MEMORY || engine == ENGINE_EPOLL))
+        || (erasure.enabled && (batch.manifest || swarm.enabled || engine == ENGINE_EPOLL))
+        || (delta.enabled && (batch.manifest || swarm.enabled || erasure.enabled || output.mode == OUTPUT_MEMORY))) {
+        usage(argv[0]);
+    }
+
+    char *server_info_file = argv[optind];
+    int num_connections = atoi(argv[optind + 1]);
+    char shard_name[FRAME_MAX_NAME + 1];
+    if (batch.manifest) {
+        batch_load(batch.manifest);
+    } else if (erasure.enabled) {
+        // Mirrors are probed and fetched from for their shard; the output is the rebuilt file
+        snprintf(shard_name, sizeof(shard_name), "%s%s", argv[optind + 2], RS_SUFFIX);
+        batch_add(shard_name, OUTPUT_FILE);
+    } else {
+        batch_add(argv[optind + 2], OUTPUT_FILE);
+    }
+    const char *filename = batch.manifest ? batch.manifest : batch.files[0].name; // For messages
+
+    FILE *file = fopen(server_info_file, "r");
+    if (!file) {
+        perror("Server info file open failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // One "<ip> <port>" line per mirror, as many as listed
+    Server *servers = NULL;
+    int server_count = 0, server_capacity = 0;
+    char ip[256];
+    int port;
+    while (fscanf(file, "%255s %d", ip, &port) == 2) {
+        if (server_count == server_capacity) {
+            server_capacity = server_capacity ? server_capacity * 2 : 8;
+            servers = realloc(servers, server_capacity * sizeof(Server));
+            if (!servers) {
+                perror("Failed to allocate server list");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memset(&servers[server_count], 0, sizeof(Server));
+        snprintf(servers[server_count].ip, sizeof(servers[server_count].ip), "%s", ip);
+        servers[server_count].port = port;
+        server_count++;
+    }
+    fclose(file);
+    if (num_connections < 1 || server_count == 0) {
+        usage(argv[0]);
+    }
+    if (!swarm.enabled) {
+        peer_connections = 0;
+    } else if (peer_connections == -1) {
+        peer_connections = num_connections;
+    }
+    swarm.peer_workers = peer_connections;
+    if (event_loops == 0) {
+        event_loops = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (event_loops > num_connections) {
+        event_loops = num_connections;
+    }
+
+    server_count = probe_servers(servers, server_count);
+    if (server_count == 0) {
+        fprintf(stderr, "No mirror can serve %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    // Lay the files out end to end, in manifest order
+    size_t file_size = 0;
+    int missing_files = 0;
+    for (int i = 0; i < batch.count; i++) {
+        BatchFile *file = &batch.files[i];
+        file->start = file_size;
+        file->size = servers[0].sizes[i];
+        if (file->size == FILE_MISSING) {
+            fprintf(stderr, "No mirror has %s, skipping it\n", file->name);
+            file->size = 0;
+            file->missing = 1;
+            missing_files++;
+        }
+        file_size += file->size;
+    }
+    if (erasure.enabled) {
+        file_size = batch.files[0].size = erasure_open(&servers[0]);
+        if (server_count < erasure.layout.k) {
+            fprintf(stderr, "%d mirrors cannot serve the %d shards %s needs\n", server_count, erasure.layout.k, filename);
+            exit(EXIT_FAILURE);
+        }
+        if (num_connections < server_count) {
+            num_connections = server_count;
+        }
+    }
+
+    // Each mirror has its own copy of the file, so their mtimes differ: the newest stands for the file
+    uint64_t mtime = 0;
+    for (int i = 0; i < server_count; i++) {
+        if (servers[i].mtime > mtime) {
+            mtime = servers[i].mtime;
+        }
+    }
+
+    // Blocks an interrupted run already wrote stay in place; an in-memory download has nothing on disk to resume,
+    // and a manifest's files are fetched whole. A delta sync needs no journal: run again, it starts from whatever
+    // the interrupted one left.
+    size_t resumed = 0;
+    if (delta.enabled) {
+        resumed = delta_sync(servers, server_count, filename, file_size);
+    } else if (output.mode != OUTPUT_MEMORY && !batch.manifest && !erasure.enabled) {
+        resumed = journal_open(filename, file_size, mtime);
+    }
+    output_open(file_size, (engine == ENGINE_EPOLL) ? event_loops : num_connections + peer_connections, resumed > 0);
+
+    // One worker per connection, all pulling from the same queue; peer connections come after the mirror ones
+    int worker_count = num_connections + peer_connections;
+    Worker workers[worker_count];
+    memset(workers, 0, sizeof(workers));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.landed, NULL);
+    queue.servers = servers;
+    queue.server_count = server_count;
+    queue.file_size = file_size;
+    queue.workers = workers;
+    queue.worker_count = worker_count;
+    queue.mirror_workers = num_connections;
+    LOG_INFO("file_size: %zu, num_connections: %d\n", file_size, num_connections);
+    if (batch.manifest) {
+        LOG_INFO("Manifest %s: %d files\n", batch.manifest, batch.count);
+    }
+    if (resumed > 0 && !delta.enabled) {
+        LOG_INFO("Resuming: %zu of %zu bytes already in %s\n", resumed, file_size, OUTPUT_FILE);
+        journal_queue_gaps();
+    } else if (swarm.enabled) {
+        swarm_queue_file();
+    }
+    if (swarm.enabled) {
+        swarm_start();
+    }
+
+    double start = now_seconds();
+    reporter.resumed = resumed;
+    reporter.start = reporter.last_time = start;
+    pthread_t reporter_thread;
+    int reporting = report_interval > 0 && pthread_create(&reporter_thread, NULL, run_reporter, NULL) == 0;
+
+    // Connections are weighted by probed throughput: each goes to the mirror with the most throughput per
+    // connection it already has (D'Hondt), so a fast mirror gets several and a slow one may get none
+    int assigned[server_count];
+    memset(assigned, 0, sizeof(assigned));
+    for (int i = 0; i < num_connections && !erasure.enabled; i++) {
+        int best = 0;
+        for (int j = 1; j < server_count; j++) {
+            double weight = (servers[j].throughput > 0) ? servers[j].throughput : 1;
+            double best_weight = (servers[best].throughput > 0) ? servers[best].throughput : 1;
+            if (weight / (assigned[j] + 1) > best_weight / (assigned[best] + 1)) {
+                best = j;
+            }
+        }
+        assigned[best]++;
+        workers[i].server = &servers[best];
+        workers[i].sock = -1;
+        workers[i].throughput = servers[best].throughput; // Sizes the first unit until real pieces land
+    }
+    for (int i = num_connections; i < worker_count; i++) {
+        workers[i].sock = -1;
+    }
+
+    // Every mirror holds a different shard, so each gets a connection and the rest go round
+    for (int i = 0; i < num_connections && erasure.enabled; i++) {
+        workers[i].server = &servers[i % server_count];
+        workers[i].sock = -1;
+        workers[i].shard = -1;
+    }
+    erasure.pending = erasure.enabled ? num_connections : 0;
+
+    if (engine == ENGINE_EPOLL) {
+        LOG_INFO("Driving %d connections from %d event loops\n", num_connections, event_loops);
+        int failed = run_event_loops(workers, num_connections, event_loops);
+        if (failed > 0) {
+            fprintf(stderr, "%d connections failed, their work went back to the queue\n", failed);
+        }
+    } else {
+        pthread_t threads[worker_count];
+        for (int i = 0; i < worker_count; i++) {
+            // Create the thread
+            void *(*run)(void *) = (i < num_connections) ? (erasure.enabled ? download_shards : download_chunk) : download_from_peers;
+            if (pthread_create(&threads[i], NULL, run, (void *)&workers[i]) != 0) {
+                perror("Error creating thread");
+                output_discard(file_size);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        void *thread_status;
+        for (int i = 0; i < worker_count; i++) {
+            pthread_join(threads[i], &thread_status);
+            if (thread_status != 0 && erasure.enabled) {
+                fprintf(stderr, "Thread %d gave up on %s:%d\n", i, workers[i].server->ip, workers[i].server->port);
+            } else if (thread_status != 0) {
+                fprintf(stderr, "Thread %d failed, its work went back to the queue\n", i);
+            }
+        }
+    }
+    double elapsed = now_seconds() - start;
+    uint64_t from_peers = 0;
+    for (int i = 0; i < worker_count; i++) {
+        char where[300] = "peers"; // A peer connection moves from peer to peer
+        if (i < num_connections) {
+            snprintf(where, sizeof(where), "%s:%d", workers[i].server->ip, workers[i].server->port);
+            if (erasure.enabled) {
+                snprintf(where, sizeof(where), "%s:%d, shard %d", workers[i].server->ip, workers[i].server->port, workers[i].shard);
+            }
+        } else {
+            from_peers += counter_read(&workers[i].counters.bytes);
+        }
+        uint64_t bytes = counter_read(&workers[i].counters.bytes);
+        char rate[32] = ""; // What the worker actually received over the download, not its probe estimate
+        if (bytes > 0) {
+            snprintf(rate, sizeof(rate), ", %.1f MB/s", bytes / elapsed / 1048576);
+        }
+        LOG_INFO("Worker %d (%s): %" PRIu64 " bytes%s, stolen from %d times, %d corrupt responses, "
+                 "%d of %d hedges won, %" PRIu64 " reconnects\n", i, where, bytes, rate, workers[i].steals,
+                 workers[i].corrupt, workers[i].hedges_won, workers[i].hedges, counter_read(&workers[i].counters.retries));
+        pool_put(workers[i].scratch, PIPELINE_PIECE);
+    }
+    if (erasure.enabled) {
+        uint64_t wire_bytes = counter_read(&erasure.wire_bytes);
+        LOG_INFO("Erasure-coded: %" PRIu64 " shard bytes received (%.2fx the file), %" PRIu64 " shards landed too late\n", wire_bytes,
+                 file_size ? (double)wire_bytes / file_size : 0.0, erasure.late);
+        if (erasure.oldest < erasure.batch_count) {
+            fprintf(stderr, "Unable to rebuild %s: too few shards left\n", argv[optind + 2]);
+            output_discard(file_size);
+            exit(EXIT_FAILURE);
+        }
+        queue.next_offset = file_size; // Nothing for the repair pass, which fetches plain ranges
+        free(erasure.batches);
+    }
+    LOG_INFO("Downloaded %zu bytes in %.3f s\n", file_size - resumed, elapsed);
+    if (delta.enabled && resumed > 0) {
+        LOG_INFO("Delta sync: %" PRIu64 " bytes on the wire (signatures and data), %.2f%% of the file\n",
+                 delta.signature_bytes + (file_size - resumed), 100.0 * (delta.signature_bytes + file_size - resumed) / file_size);
+    }
+
+    // Fetch whatever no worker finished (every connection failed, or failed last), as scatter requests per server.
+    // Blocks that fail their checksum go back to the queue, so repeat while the queue refills.
+    return_range(queue.next_offset, file_size - queue.next_offset);
+    thread_counters = &repair_counters;
+    for (int round = 0; queue.returned_count > 0; round++) {
+        FrameRange *missing = queue.returned;
+        int missing_count = queue.returned_count;
+        queue.returned = NULL;
+        queue.returned_count = queue.returned_capacity = 0;
+        if (round == REPAIR_ROUNDS || repair_ranges(servers, server_count, missing, missing_count) == -1) {
+            fprintf(stderr, "Unable to fetch the missing parts of %s\n", filename);
+            if (journal.fd != -1) {
+                fprintf(stderr, "Run again to resume from %s\n", JOURNAL_FILE);
+            }
+            output_discard(file_size);
+            exit(EXIT_FAILURE);
+        }
+        free(missing);
+    }
+    if (reporting) {
+        pthread_mutex_lock(&reporter.lock);
+        reporter.done = 1;
+        pthread_cond_signal(&reporter.stop);
+        pthread_mutex_unlock(&reporter.lock);
+        pthread_join(reporter_thread, NULL);
+        report_progress(1);
+    }
+    output_close(file_size);
+    pthread_mutex_lock(&journal.lock);
+    swarm.complete = 1;
+    pthread_mutex_unlock(&journal.lock);
+    journal_remove();
+    if (swarm.enabled) {
+        swarm_finish(from_peers);
+    }
+    if (batch.manifest) {
+        LOG_INFO("%d of %d files downloaded\n", batch.count - missing_files, batch.count);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    LOG_INFO("Peak RSS: %ld KB\n", usage.ru_maxrss);
+    LOG_INFO("CPU: %.3f s user, %.3f s system\n", usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+             usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+    if (log_level >= LOG_LEVEL_INFO) {
+        pool_report();
+    }
+
+    for (int i = 0; i < server_count; i++) {
+        free(servers[i].sizes);
+    }
+    free(servers);
+    for (int i = 0; i < batch.count; i++) {
+        free(batch.files[i].path);
+    }
+    free(batch.files);
+    return missing_files ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,97 @@
+// crc32c.h
+// CRC32C (Castagnoli), used for the per-block checksums of checked GET responses. Shared by client.c and
+// server.c. The SSE4.2 crc32 instruction is used when the CPU has it, a slicing-by-8 table otherwise; the choice
+// is made once at startup.
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // Castagnoli polynomial, bit-reversed
+
+static uint32_t crc32c_table[8][256];
+
+// Portable fallback: eight table lookups per 8 bytes
+static inline uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t low = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc32c_table[7][low & 0xff] ^ crc32c_table[6][(low >> 8) & 0xff] ^ crc32c_table[5][(low >> 16) & 0xff]
+            ^ crc32c_table[4][low >> 24] ^ crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^ crc32c_table[1][p[6]]
+            ^ crc32c_table[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// SSE4.2: one crc32 instruction per 8 bytes. Compiled for SSE4.2 regardless of CFLAGS, only called if supported.
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t crc64 = ~crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    uint32_t crc32 = (uint32_t)crc64;
+    while (len--) {
+        crc32 = _mm_crc32_u8(crc32, *p++);
+    }
+    return ~crc32;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t, const void *, size_t) = crc32c_sw;
+
+// Build the tables and pick the implementation before main() runs, so worker threads never race on it
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xff];
+        }
+    }
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_hw;
+    }
+#endif
+}
+
+// CRC32C of len bytes, continuing from crc (0 to start)
+static inline uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    return crc32c_impl(crc, data, len);
+}
+
+static inline const char *crc32c_implementation(void)
+{
+    return (crc32c_impl == crc32c_sw) ? "slicing-by-8" : "sse4.2";
+}
+
+#endif
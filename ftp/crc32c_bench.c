@@ -0,0 +1,71 @@
+// crc32c_bench.c
+// Single-core throughput of the CRC32C kernels in crc32c.h, over one CHECKSUM_BLOCK (in cache, as the client
+// checks blocks right after receiving them) and over a buffer much larger than the caches.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol.h"
+#include "crc32c.h"
+#include "bench.h"
+
+#define LARGE_BUFFER 67108864 // 64MB
+#define BENCH_BYTES 2147483648.0 // Bytes checksummed per measurement (2GB)
+
+typedef struct {
+    const char *name;
+    uint32_t (*function)(uint32_t, const void *, size_t);
+} Kernel;
+
+// GB/s of repeatedly checksumming the first size bytes of data, BENCH_BYTES in total
+double measure(const Kernel *kernel, const unsigned char *data, size_t size)
+{
+    size_t rounds = BENCH_BYTES / size;
+    uint32_t sink = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < rounds; i++) {
+        sink ^= kernel->function(sink, data, size);
+    }
+    double elapsed = now_seconds() - start;
+    bench_sink(sink);
+    return rounds * (double)size / elapsed / 1e9;
+}
+
+int main(void)
+{
+    Kernel kernels[2] = { { "slicing-by-8", crc32c_sw } };
+    int kernel_count = 1;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        kernels[kernel_count++] = (Kernel){ "sse4.2", crc32c_hw };
+    }
+#endif
+
+    unsigned char *data = malloc(LARGE_BUFFER);
+    if (!data) {
+        perror("Failed to allocate benchmark buffer");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (size_t i = 0; i < LARGE_BUFFER; i++) {
+        data[i] = rand();
+    }
+
+    // Every kernel must agree with the standard check value and with each other before it is timed
+    for (int k = 0; k < kernel_count; k++) {
+        if (kernels[k].function(0, "123456789", 9) != 0xE3069283
+            || kernels[k].function(0, data, LARGE_BUFFER - 3) != crc32c_sw(0, data, LARGE_BUFFER - 3)) {
+            fprintf(stderr, "%s: wrong checksum\n", kernels[k].name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("kernel,buffer_bytes,GBps_per_core\n");
+    for (int k = 0; k < kernel_count; k++) {
+        printf("%s,%d,%.2f\n", kernels[k].name, CHECKSUM_BLOCK, measure(&kernels[k], data, CHECKSUM_BLOCK));
+        printf("%s,%d,%.2f\n", kernels[k].name, LARGE_BUFFER, measure(&kernels[k], data, LARGE_BUFFER));
+    }
+    fprintf(stderr, "crc32c() uses %s on this CPU\n", crc32c_implementation());
+    free(data);
+    return 0;
+}
@@ -0,0 +1,265 @@
+// delta.h
+// Block signatures for delta sync (client -D), shared by server.c, which signs the blocks of a file, and client.c,
+// which looks for them in its old copy at every byte offset. A signature is an rsync-style weak checksum, which
+// rolls forward one byte in a few operations, and a 64-bit XXH64 of the block to confirm a weak match. The scan
+// tests each offset against a bit filter of the wanted weak checksums; its AVX2 kernel rolls 16 offsets at once with
+// prefix sums and tests them with gathers, and the choice is made once at startup like the kernels of rs.h.
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define DELTA_FILTER_SPARSITY 7 // Filter bits per wanted checksum, as a power of two: under 1% of them are set
+#define DELTA_FILTER_MAX_BITS 28 // 32MB
+
+// Weak checksum of a block: a is the sum of its bytes, b the sum of each byte times its distance from the end,
+// both mod 2^16; the checksum is a | b << 16
+static inline uint32_t delta_weak(const uint8_t *data, size_t n)
+{
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < n; i++) {
+        a += data[i];
+        b += (uint32_t)(n - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// Checksum of the block one byte further on: out leaves it, in enters
+static inline uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, size_t n)
+{
+    uint32_t a = (weak & 0xffff) - out + in;
+    uint32_t b = (weak >> 16) - (uint32_t)n * out + a;
+    return (a & 0xffff) | (b << 16);
+}
+
+static inline uint64_t delta_rotl(uint64_t x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static inline uint64_t delta_read64(const uint8_t *p)
+{
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return le64toh(x);
+}
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    return delta_rotl(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t value)
+{
+    return (acc ^ xxh64_round(0, value)) * XXH_PRIME1 + XXH_PRIME4;
+}
+
+// Strong checksum of a block: XXH64 with seed 0
+static inline uint64_t delta_strong(const uint8_t *data, size_t len)
+{
+    const uint8_t *p = data, *end = data + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = XXH_PRIME1 + XXH_PRIME2, v2 = XXH_PRIME2, v3 = 0, v4 = -XXH_PRIME1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh64_round(v1, delta_read64(p));
+            v2 = xxh64_round(v2, delta_read64(p + 8));
+            v3 = xxh64_round(v3, delta_read64(p + 16));
+            v4 = xxh64_round(v4, delta_read64(p + 24));
+        }
+        h = delta_rotl(v1, 1) + delta_rotl(v2, 7) + delta_rotl(v3, 12) + delta_rotl(v4, 18);
+        h = xxh64_merge(xxh64_merge(xxh64_merge(xxh64_merge(h, v1), v2), v3), v4);
+    } else {
+        h = XXH_PRIME5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        h = delta_rotl(h ^ xxh64_round(0, delta_read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (p + 4 <= end) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        h = delta_rotl(h ^ (le32toh(word) * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h = delta_rotl(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    return h ^ (h >> 32);
+}
+
+// Bitmap of the weak checksums a scan looks for, hashed to bits: a clear bit rules an offset out with one load
+typedef struct {
+    uint32_t *bits;
+    int shift; // 32 minus log2 of the number of bits
+} DeltaFilter;
+
+// A filter for up to count checksums. Returns -1 if out of memory.
+static inline int delta_filter_init(DeltaFilter *filter, size_t count)
+{
+    int bits = DELTA_FILTER_SPARSITY + 5;
+    while (bits < DELTA_FILTER_MAX_BITS && ((size_t)1 << (bits - DELTA_FILTER_SPARSITY)) < count) {
+        bits++;
+    }
+    filter->shift = 32 - bits;
+    filter->bits = calloc((size_t)1 << (bits - 5), sizeof(uint32_t));
+    return filter->bits ? 0 : -1;
+}
+
+static inline uint32_t delta_filter_bit(const DeltaFilter *filter, uint32_t weak)
+{
+    return (weak * 0x9E3779B1u) >> filter->shift;
+}
+
+static inline void delta_filter_add(DeltaFilter *filter, uint32_t weak)
+{
+    uint32_t bit = delta_filter_bit(filter, weak);
+    filter->bits[bit >> 5] |= 1u << (bit & 31);
+}
+
+static inline int delta_filter_test(const DeltaFilter *filter, uint32_t weak)
+{
+    uint32_t bit = delta_filter_bit(filter, weak);
+    return (filter->bits[bit >> 5] >> (bit & 31)) & 1;
+}
+
+// Portable scan: *weak is the checksum of the n-byte block at data. Tests offsets 0..positions-1 in turn, reading
+// data up to offset positions - 1 + n. Returns the first offset in the filter with *weak its checksum, or positions
+// if there is none.
+static inline size_t delta_scan_sw(const uint8_t *data, size_t n, size_t positions, uint32_t *weak, const DeltaFilter *filter)
+{
+    uint32_t a = *weak & 0xffff, b = *weak >> 16; // Unpacked, so each step depends on the last by two additions
+    for (size_t p = 0; p < positions; p++) {
+        uint32_t w = (a & 0xffff) | (b << 16);
+        if (delta_filter_test(filter, w)) {
+            *weak = w;
+            return p;
+        }
+        if (p + 1 < positions) {
+            a += data[p + n] - data[p];
+            b += a - (uint32_t)n * data[p];
+        }
+    }
+    return positions;
+}
+
+#if defined(__x86_64__)
+// Inclusive prefix sum of 16 16-bit lanes: within each 128-bit half by shifts, then the low half's total carried
+// into the high half
+__attribute__((target("avx2")))
+static inline __m256i delta_prefix16(__m256i v)
+{
+    v = _mm256_add_epi16(v, _mm256_slli_si256(v, 2));
+    v = _mm256_add_epi16(v, _mm256_slli_si256(v, 4));
+    v = _mm256_add_epi16(v, _mm256_slli_si256(v, 8));
+    __m128i carry = _mm_shuffle_epi8(_mm256_castsi256_si128(v), _mm_set1_epi16(0x0f0e));
+    return _mm256_add_epi16(v, _mm256_inserti128_si256(_mm256_setzero_si256(), carry, 1));
+}
+
+// The last of 16 16-bit lanes in all of them
+__attribute__((target("avx2")))
+static inline __m256i delta_last16(__m256i v)
+{
+    return _mm256_shuffle_epi8(_mm256_permute4x64_epi64(v, 0xff), _mm256_set1_epi16(0x0706));
+}
+
+// Filter bits of 8 checksums, as the low 8 bits of a mask
+__attribute__((target("avx2")))
+static inline int delta_filter_mask8(__m256i weak, const DeltaFilter *filter)
+{
+    __m256i bit = _mm256_srl_epi32(_mm256_mullo_epi32(weak, _mm256_set1_epi32(0x9E3779B1u)), _mm_cvtsi32_si128(filter->shift));
+    __m256i words = _mm256_i32gather_epi32((const int *)filter->bits, _mm256_srli_epi32(bit, 5), 4);
+    __m256i set = _mm256_and_si256(_mm256_srlv_epi32(words, _mm256_and_si256(bit, _mm256_set1_epi32(31))), _mm256_set1_epi32(1));
+    return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(set, _mm256_set1_epi32(1))));
+}
+
+// AVX2: the checksums of 16 consecutive offsets at once. With d_t the byte entering minus the byte x_t leaving at
+// step t, and D its prefix sum, a_t = a_0 + D_t - d_t and b_t = b_0 + t * a_0 + the sum of D_s - n * x_s for s < t.
+// Both prefix sums depend only on the data, so a and b carry from one step to the next by a few additions, and
+// 16-bit lanes wrap mod 2^16 exactly like the checksum.
+__attribute__((target("avx2")))
+static inline size_t delta_scan_avx2(const uint8_t *data, size_t n, size_t positions, uint32_t *weak, const DeltaFilter *filter)
+{
+    size_t p = 0;
+    __m256i a = _mm256_set1_epi16(*weak & 0xffff), b = _mm256_set1_epi16(*weak >> 16);
+    __m256i scale = _mm256_set1_epi16((uint16_t)n);
+    __m256i steps = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    for (; p + 16 < positions; p += 16) {
+        __m256i leaving = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(data + p)));
+        __m256i entering = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(data + p + n)));
+        __m256i d = _mm256_sub_epi16(entering, leaving);
+        __m256i sums = delta_prefix16(d);
+        __m256i f = _mm256_sub_epi16(sums, _mm256_mullo_epi16(leaving, scale));
+        __m256i f_sums = delta_prefix16(f);
+        __m256i sum_a = _mm256_add_epi16(a, _mm256_sub_epi16(sums, d));
+        __m256i sum_b = _mm256_add_epi16(_mm256_add_epi16(b, _mm256_mullo_epi16(steps, a)), _mm256_sub_epi16(f_sums, f));
+
+        // Interleaving a and b gives the checksums of offsets 0-3 and 8-11, then 4-7 and 12-15
+        int low = delta_filter_mask8(_mm256_unpacklo_epi16(sum_a, sum_b), filter);
+        int high = delta_filter_mask8(_mm256_unpackhi_epi16(sum_a, sum_b), filter);
+        int mask = (low & 0xf) | (high & 0xf) << 4 | (low & 0xf0) << 4 | (high & 0xf0) << 8;
+        if (mask) {
+            int t = __builtin_ctz(mask);
+            uint16_t lanes_a[16], lanes_b[16];
+            _mm256_storeu_si256((__m256i *)lanes_a, sum_a);
+            _mm256_storeu_si256((__m256i *)lanes_b, sum_b);
+            *weak = lanes_a[t] | (uint32_t)lanes_b[t] << 16;
+            return p + t;
+        }
+        b = _mm256_add_epi16(b, _mm256_add_epi16(_mm256_slli_epi16(a, 4), delta_last16(f_sums)));
+        a = _mm256_add_epi16(a, delta_last16(sums));
+    }
+    uint32_t w = (uint16_t)_mm256_extract_epi16(a, 0) | (uint32_t)(uint16_t)_mm256_extract_epi16(b, 0) << 16;
+    size_t found = delta_scan_sw(data + p, n, positions - p, &w, filter);
+    *weak = w;
+    return p + found;
+}
+#endif
+
+static size_t (*delta_scan_impl)(const uint8_t *, size_t, size_t, uint32_t *, const DeltaFilter *) = delta_scan_sw;
+
+__attribute__((constructor))
+static void delta_init(void)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        delta_scan_impl = delta_scan_avx2;
+    }
+#endif
+}
+
+// The first of offsets 0..positions-1 of data whose n-byte block may be wanted (see delta_scan_sw)
+static inline size_t delta_scan(const uint8_t *data, size_t n, size_t positions, uint32_t *weak, const DeltaFilter *filter)
+{
+    return delta_scan_impl(data, n, positions, weak, filter);
+}
+
+static inline const char *delta_implementation(void)
+{
+#if defined(__x86_64__)
+    if (delta_scan_impl == delta_scan_avx2) {
+        return "avx2";
+    }
+#endif
+    return "scalar";
+}
+
+#endif
@@ -0,0 +1,133 @@
+// delta_bench.c
+// Single-core throughput of the rolling-checksum scan kernels in delta.h, which look for a new file's blocks at every
+// offset of an old copy (client -D), and of the strong checksum that servers sign blocks with. The scan looks for
+// the blocks of unrelated data, so nearly every offset is ruled out by the filter, as in the unchanged stretches
+// of a real file.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+#include "bench.h"
+
+#define BENCH_BUFFER 67108864 // 64MB
+#define BENCH_BLOCK 8192 // Block size the client uses for a 64MB file
+#define BENCH_ROUNDS 8
+#define CHECK_BYTES 1048576 // Scanned with a dense filter to compare the kernels
+
+typedef struct {
+    const char *name;
+    size_t (*function)(const uint8_t *, size_t, size_t, uint32_t *, const DeltaFilter *);
+} Kernel;
+
+// Scan every offset of data[0, size) for n-byte blocks, going on past each candidate. Adds up the candidates'
+// offsets and checksums, which identify the sequence; returns the number of candidates.
+size_t scan_all(const Kernel *kernel, const uint8_t *data, size_t size, size_t n, const DeltaFilter *filter, uint64_t *digest)
+{
+    size_t positions = size - n + 1, candidates = 0;
+    uint32_t weak = delta_weak(data, n);
+    for (size_t p = 0; p < positions; ) {
+        p += kernel->function(data + p, n, positions - p, &weak, filter);
+        if (p == positions) {
+            break;
+        }
+        candidates++;
+        *digest += p * 31 + weak;
+        if (p + 1 < positions) {
+            weak = delta_roll(weak, data[p], data[p + n], n);
+        }
+        p++;
+    }
+    return candidates;
+}
+
+int main(void)
+{
+    Kernel kernels[2] = { { "scalar", delta_scan_sw } };
+    int kernel_count = 1;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[kernel_count++] = (Kernel){ "avx2", delta_scan_avx2 };
+    }
+#endif
+
+    uint8_t *data = malloc(BENCH_BUFFER);
+    if (!data) {
+        perror("Failed to allocate benchmark buffer");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (size_t i = 0; i < BENCH_BUFFER; i++) {
+        data[i] = rand();
+    }
+
+    // Every kernel must report the same candidates as checksumming each offset from scratch, with a filter dense
+    // enough to stop the scan every few offsets, at several block sizes
+    size_t sizes[] = { 64, 1000, BENCH_BLOCK };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t n = sizes[s];
+        DeltaFilter dense = { .shift = 32 - 10 };
+        dense.bits = calloc(1024 / 32, sizeof(uint32_t));
+        for (int i = 0; dense.bits && i < 100; i++) {
+            delta_filter_add(&dense, rand());
+        }
+        uint64_t expected = 0;
+        size_t expected_count = 0;
+        for (size_t p = 0; dense.bits && p + n <= CHECK_BYTES; p++) {
+            uint32_t weak = delta_weak(data + p, n);
+            if (delta_filter_test(&dense, weak)) {
+                expected += p * 31 + weak;
+                expected_count++;
+            }
+        }
+        for (int k = 0; dense.bits && k < kernel_count; k++) {
+            uint64_t digest = 0;
+            if (scan_all(&kernels[k], data, CHECK_BYTES, n, &dense, &digest) != expected_count || digest != expected) {
+                fprintf(stderr, "%s: wrong candidates for %zu-byte blocks\n", kernels[k].name, n);
+                exit(EXIT_FAILURE);
+            }
+        }
+        free(dense.bits);
+    }
+
+    // The blocks of other data, as a client would look for them
+    DeltaFilter filter;
+    size_t blocks = BENCH_BUFFER / BENCH_BLOCK;
+    if (delta_filter_init(&filter, blocks) == -1) {
+        perror("Failed to allocate the filter");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < blocks; i++) {
+        delta_filter_add(&filter, (uint32_t)rand() ^ (uint32_t)rand() << 16);
+    }
+
+    printf("kernel,buffer_bytes,GBps_per_core\n");
+    for (int k = 0; k < kernel_count; k++) {
+        uint64_t digest = 0;
+        size_t candidates = 0;
+        double start = now_seconds();
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            candidates = scan_all(&kernels[k], data, BENCH_BUFFER, BENCH_BLOCK, &filter, &digest);
+        }
+        double elapsed = now_seconds() - start;
+        bench_sink(digest);
+        printf("%s,%d,%.2f\n", kernels[k].name, BENCH_BUFFER, (double)BENCH_ROUNDS * BENCH_BUFFER / elapsed / 1e9);
+        fprintf(stderr, "%s: %zu candidates per scan (%.2f%% of offsets)\n", kernels[k].name, candidates,
+                100.0 * candidates / BENCH_BUFFER);
+    }
+
+    uint64_t sum = 0;
+    double start = now_seconds();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t i = 0; i < blocks; i++) {
+            sum += delta_strong(data + i * BENCH_BLOCK, BENCH_BLOCK);
+        }
+    }
+    double elapsed = now_seconds() - start;
+    printf("xxh64,%d,%.2f\n", BENCH_BUFFER, (double)BENCH_ROUNDS * BENCH_BUFFER / elapsed / 1e9);
+    bench_sink(sum);
+    fprintf(stderr, "delta_scan() uses %s on this CPU\n", delta_implementation());
+    free(filter.bits);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,80 @@
+// gf_bench.c
+// Single-core throughput of the GF(2^8) multiply-accumulate kernels in rs.h, which encode and rebuild erasure-coded
+// shards, over one 64KB shard unit (in cache) and over a buffer much larger than the caches.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rs.h"
+#include "bench.h"
+
+#define SMALL_BUFFER RS_UNIT
+#define LARGE_BUFFER 67108864 // 64MB
+#define BENCH_BYTES 2147483648.0 // Source bytes multiplied per measurement (2GB)
+
+typedef struct {
+    const char *name;
+    void (*function)(uint8_t *, const uint8_t *, uint8_t, size_t);
+} Kernel;
+
+// GB/s of repeatedly accumulating the first size bytes of source into destination, BENCH_BYTES in total
+double measure(const Kernel *kernel, uint8_t *destination, const uint8_t *source, size_t size)
+{
+    size_t rounds = BENCH_BYTES / size;
+    double start = now_seconds();
+    for (size_t i = 0; i < rounds; i++) {
+        kernel->function(destination, source, 2 + i % 253, size);
+    }
+    double elapsed = now_seconds() - start;
+    bench_sink(destination[0]);
+    return rounds * (double)size / elapsed / 1e9;
+}
+
+int main(void)
+{
+    Kernel kernels[3] = { { "table", gf_mul_add_sw } };
+    int kernel_count = 1;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("ssse3")) {
+        kernels[kernel_count++] = (Kernel){ "ssse3", gf_mul_add_ssse3 };
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[kernel_count++] = (Kernel){ "avx2", gf_mul_add_avx2 };
+    }
+#endif
+
+    uint8_t *source = malloc(LARGE_BUFFER), *destination = malloc(LARGE_BUFFER), *expected = malloc(LARGE_BUFFER);
+    if (!source || !destination || !expected) {
+        perror("Failed to allocate benchmark buffers");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (size_t i = 0; i < LARGE_BUFFER; i++) {
+        source[i] = rand();
+    }
+
+    // Every kernel must agree with the product table for every coefficient, at an odd length, before it is timed
+    for (int k = 0; k < kernel_count; k++) {
+        for (int c = 0; c < 256; c++) {
+            memset(expected, c, 4099);
+            memset(destination, c, 4099);
+            gf_mul_add_sw(expected, source, c, 4099);
+            kernels[k].function(destination, source, c, 4099);
+            if (memcmp(expected, destination, 4099) != 0) {
+                fprintf(stderr, "%s: wrong product for coefficient %d\n", kernels[k].name, c);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    printf("kernel,buffer_bytes,GBps_per_core\n");
+    for (int k = 0; k < kernel_count; k++) {
+        printf("%s,%d,%.2f\n", kernels[k].name, SMALL_BUFFER, measure(&kernels[k], destination, source, SMALL_BUFFER));
+        printf("%s,%d,%.2f\n", kernels[k].name, LARGE_BUFFER, measure(&kernels[k], destination, source, LARGE_BUFFER));
+    }
+    fprintf(stderr, "gf_mul_add() uses %s on this CPU\n", gf_implementation());
+    free(source);
+    free(destination);
+    free(expected);
+    return 0;
+}
@@ -0,0 +1,212 @@
+// pool.h
+// Page-aligned buffer pool and per-request arenas, shared by client.c and server.c. Buffers come in power-of-two
+// size classes from one page up. Each thread keeps up to POOL_CACHE free buffers per class, so a steady-state
+// pool_get()/pool_put() pair takes no lock and calls neither malloc() nor memset(); overflow goes to a shared list,
+// and an exiting thread hands its cache back. Buffers are returned as they were left: callers must not expect zeros.
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+#define POOL_PAGE 4096
+#define POOL_CLASSES 20 // 4KB .. 2GB
+#define POOL_MAX_BUFFER ((size_t)POOL_PAGE << (POOL_CLASSES - 1)) // Largest pooled buffer (2GB)
+#define POOL_CACHE 8 // Free buffers a thread keeps per class before sharing them
+
+typedef struct PoolBuffer {
+    struct PoolBuffer *next; // Free buffers are linked through their first bytes
+} PoolBuffer;
+
+typedef struct {
+    PoolBuffer *head[POOL_CLASSES];
+    int count[POOL_CLASSES];
+    int registered; // Thread-exit hook installed
+} PoolCache;
+
+typedef struct {
+    pthread_mutex_t lock;
+    PoolBuffer *shared[POOL_CLASSES];
+    pthread_once_t once;
+    pthread_key_t key; // Only for its destructor, which flushes an exiting thread's cache
+    uint64_t allocations; // Buffers obtained from the allocator
+    uint64_t allocated_bytes;
+    uint64_t gets; // pool_get() calls; those that did not allocate reused a free buffer
+} BufferPool;
+
+static BufferPool pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT };
+static __thread PoolCache pool_cache;
+
+static inline int pool_class(size_t size)
+{
+    int class = 0;
+    while (class < POOL_CLASSES - 1 && ((size_t)POOL_PAGE << class) < size) {
+        class++;
+    }
+    return class;
+}
+
+static inline void pool_flush(void *arg)
+{
+    PoolCache *cache = arg;
+    pthread_mutex_lock(&pool.lock);
+    for (int class = 0; class < POOL_CLASSES; class++) {
+        while (cache->head[class]) {
+            PoolBuffer *buffer = cache->head[class];
+            cache->head[class] = buffer->next;
+            buffer->next = pool.shared[class];
+            pool.shared[class] = buffer;
+        }
+        cache->count[class] = 0;
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static inline void pool_create_key(void)
+{
+    pthread_key_create(&pool.key, pool_flush);
+}
+
+// A buffer of at least size bytes, page-aligned. Returns NULL if out of memory. Sizes above POOL_MAX_BUFFER are
+// allocated and freed each time rather than pooled.
+static inline void *pool_get(size_t size)
+{
+    counter_add(&pool.gets, 1);
+    if (size > POOL_MAX_BUFFER) {
+        size_t bytes = (size + POOL_PAGE - 1) / POOL_PAGE * POOL_PAGE;
+        void *data = (bytes >= size) ? aligned_alloc(POOL_PAGE, bytes) : NULL;
+        if (data) {
+            counter_add(&pool.allocations, 1);
+            counter_add(&pool.allocated_bytes, bytes);
+        }
+        return data;
+    }
+    int class = pool_class(size);
+    PoolBuffer *buffer = pool_cache.head[class];
+    if (buffer) {
+        pool_cache.head[class] = buffer->next;
+        pool_cache.count[class]--;
+        return buffer;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    buffer = pool.shared[class];
+    if (buffer) {
+        pool.shared[class] = buffer->next;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if (buffer) {
+        return buffer;
+    }
+
+    size_t bytes = (size_t)POOL_PAGE << class;
+    buffer = aligned_alloc(POOL_PAGE, bytes);
+    if (buffer) {
+        counter_add(&pool.allocations, 1);
+        counter_add(&pool.allocated_bytes, bytes);
+    }
+    return buffer;
+}
+
+// Give back a buffer from pool_get(size), with the same size
+static inline void pool_put(void *data, size_t size)
+{
+    if (!data) {
+        return;
+    }
+    if (size > POOL_MAX_BUFFER) {
+        free(data);
+        return;
+    }
+    if (!pool_cache.registered) {
+        pthread_once(&pool.once, pool_create_key);
+        pthread_setspecific(pool.key, &pool_cache);
+        pool_cache.registered = 1;
+    }
+    int class = pool_class(size);
+    PoolBuffer *buffer = data;
+    buffer->next = pool_cache.head[class];
+    pool_cache.head[class] = buffer;
+    if (++pool_cache.count[class] <= POOL_CACHE) {
+        return;
+    }
+
+    // Keep half the cache, share the rest with other threads
+    PoolBuffer *keep = buffer;
+    for (int i = 1; i < POOL_CACHE / 2; i++) {
+        keep = keep->next;
+    }
+    PoolBuffer *spill = keep->next, *last = spill;
+    while (last->next) {
+        last = last->next;
+    }
+    keep->next = NULL;
+    pool_cache.count[class] = POOL_CACHE / 2;
+    pthread_mutex_lock(&pool.lock);
+    last->next = pool.shared[class];
+    pool.shared[class] = spill;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Resident set size of the process in bytes, 0 if unknown
+static inline size_t resident_bytes(void)
+{
+    unsigned long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%*s %lu", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+static inline void pool_report(void)
+{
+    uint64_t gets = counter_read(&pool.gets), allocations = counter_read(&pool.allocations);
+    fprintf(stderr, "buffer pool: %" PRIu64 " gets, %" PRIu64 " reused, %" PRIu64 " allocations (%.1f MB); RSS %.1f MB\n", gets,
+            gets - allocations, allocations, counter_read(&pool.allocated_bytes) / 1048576.0, resident_bytes() / 1048576.0);
+}
+
+// Bump allocator over one pool buffer, for memory that lives exactly as long as one request: every allocation
+// is released at once by arena_release()
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+} Arena;
+
+// Returns -1 if out of memory
+static inline int arena_init(Arena *arena, size_t size)
+{
+    arena->base = pool_get(size);
+    arena->size = size;
+    arena->used = 0;
+    return arena->base ? 0 : -1;
+}
+
+// 16-byte aligned, uninitialized. Returns NULL once the arena is full.
+static inline void *arena_alloc(Arena *arena, size_t bytes)
+{
+    bytes = (bytes + 15) & ~(size_t)15;
+    if (bytes > arena->size - arena->used) {
+        return NULL;
+    }
+    void *data = arena->base + arena->used;
+    arena->used += bytes;
+    return data;
+}
+
+static inline void arena_release(Arena *arena)
+{
+    pool_put(arena->base, arena->size);
+    arena->base = NULL;
+}
+
+#endif
@@ -0,0 +1,249 @@
+// protocol.h
+// Binary framing for the CHECK/GET protocol, shared by client.c and server.c.
+//
+// Every request and response starts with a fixed 32-byte header in network byte order:
+//
+//   0  magic       u16  FRAME_MAGIC; its first byte is never printable, so it cannot start a text request
+//   2  version     u8   FRAME_VERSION
+//   3  opcode      u8   FRAME_CHECK, FRAME_GET, FRAME_GET_RANGES, FRAME_LIST, FRAME_STAT, FRAME_ANNOUNCE,
+//                       FRAME_SIGNATURES
+//   4  status      u16  STATUS_* (0 in requests)
+//   6  name_len    u16  request: length of the filename (LIST, STAT: directory) that follows the header; response: 0
+//   8  request_id  u32  chosen by the client, echoed in the response
+//  12  flags       u32  FRAME_FLAG_* (0 if none)
+//  16  offset      u64  GET, SIGNATURES request: first byte of the range; CHECK response: modification time (seconds
+//                       since the epoch); LIST/STAT response: number of entries; ANNOUNCE response: number of peers;
+//                       SIGNATURES response: number of signatures
+//  24  length      u64  GET, SIGNATURES request: bytes wanted; GET response: bytes of data that follow; CHECK response:
+//                       file size; GET_RANGES: number of ranges; STAT/ANNOUNCE request, LIST/STAT/ANNOUNCE/SIGNATURES
+//                       response: bytes that follow the name/header
+//
+// A GET_RANGES request carries its ranges after the filename, each FRAME_RANGE_SIZE bytes (offset u64, length u64).
+// Its response repeats every range header, each followed by that range's data.
+//
+// A GET or GET_RANGES request flagged FRAME_FLAG_CRC32C asks for checksums. If the response carries the flag too,
+// each range's data is preceded by the CRC32C of every CHECKSUM_BLOCK of it (u32 each, the last block may be short).
+// A checked range is at most CHECKSUM_MAX_BLOCKS blocks. Servers that predate checksums leave the flag clear.
+//
+// LIST asks for every entry of a directory, STAT for the paths that follow its name, newline-separated and
+// relative to that directory. Both replies carry one entry per path: FRAME_ENTRY_SIZE bytes (size u64, mtime u64,
+// token u64, name_len u16), then the name. The token changes whenever the file is rewritten, replaced or has its
+// metadata changed, so comparing tokens tells a client which files to fetch again. A LIST names subdirectories
+// with a trailing '/', size and mtime 0, and a token that identifies the directory rather than its contents.
+// A STAT path that is missing or not a regular file gets size, mtime and token 0; real tokens are never 0.
+//
+// ANNOUNCE is sent to a swarm tracker by a client that serves the named file to other clients: after the name
+// comes "<ip>:<port> <have> [<fetching>]", the address of its GET responder, then the hex bytes of a bitmap of the
+// SWARM_BLOCK blocks it has (block i is bit i % 8 of byte i / 8) and optionally of one of the blocks it is
+// downloading. The reply lists the file's other peers in the same form, one per newline-terminated line.
+//
+// SIGNATURES asks for the signatures of the blocks of a range of a file, for delta sync: blocks are
+// signature_block_size(file size) bytes, the range starts on a block boundary and spans at most SIGNATURE_MAX_SPAN
+// bytes. The reply carries FRAME_SIGNATURE_SIZE bytes per block (weak checksum u32, strong checksum u64, see
+// delta.h); the last block of the file may be short. SIGNATURES is binary only.
+//
+// A connection whose first byte is the high byte of FRAME_MAGIC speaks binary frames for its lifetime;
+// anything else is parsed as the text protocol.
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <netinet/in.h>
+
+#define FRAME_MAGIC 0xF7A9
+#define REQUEST_SIZE 2048 // Longest request a server accepts: a text line, or a frame with its name and body
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 32
+#define FRAME_MAX_NAME 255
+#define FRAME_RANGE_SIZE 16
+#define FRAME_ENTRY_SIZE 26
+#define FRAME_MAX_RANGES 64 // Ranges in one GET_RANGES request
+#define FRAME_FLAG_CRC32C 0x1 // Request: send per-block checksums; response: they precede each range's data
+#define CHECKSUM_BLOCK 65536 // Bytes covered by one checksum (64KB)
+#define CHECKSUM_MAX_BLOCKS 64 // Longest checked range: 4MB
+#define SWARM_BLOCK 1048576 // Bytes per bit of an ANNOUNCE bitmap (1MB)
+// Longest ANNOUNCE bitmap in bytes: two of them, hex-encoded, fit a request after the longest name and address
+// ("<ip>:<port> " and the space between the bitmaps). 434 bytes, so files up to 3472MB.
+#define SWARM_MAX_BITMAP ((REQUEST_SIZE - 1 - FRAME_HEADER_SIZE - FRAME_MAX_NAME - INET_ADDRSTRLEN - 8) / 4)
+#define FRAME_SIGNATURE_SIZE 12
+#define SIGNATURE_MIN_BLOCK 2048
+#define SIGNATURE_MAX_BLOCK 131072 // 128KB
+#define SIGNATURE_MAX_SPAN 33554432 // Bytes signed by one SIGNATURES request (32MB), which bounds the server's work
+
+enum {
+    FRAME_CHECK = 1,
+    FRAME_GET = 2,
+    FRAME_GET_RANGES = 3,
+    FRAME_LIST = 4,
+    FRAME_STAT = 5,
+    FRAME_ANNOUNCE = 6,
+    FRAME_SIGNATURES = 7
+};
+
+enum {
+    STATUS_OK = 0,
+    STATUS_NOT_FOUND = 1,
+    STATUS_INVALID_RANGE = 2,
+    STATUS_INVALID_REQUEST = 3,
+    STATUS_UNSUPPORTED_VERSION = 4
+};
+
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t status;
+    uint16_t name_len;
+    uint32_t request_id;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t length;
+} FrameHeader;
+
+static inline void frame_encode(const FrameHeader *header, unsigned char *out)
+{
+    uint16_t magic = htobe16(FRAME_MAGIC), status = htobe16(header->status), name_len = htobe16(header->name_len);
+    uint32_t request_id = htobe32(header->request_id), flags = htobe32(header->flags);
+    uint64_t offset = htobe64(header->offset), length = htobe64(header->length);
+
+    memcpy(out, &magic, 2);
+    out[2] = header->version;
+    out[3] = header->opcode;
+    memcpy(out + 4, &status, 2);
+    memcpy(out + 6, &name_len, 2);
+    memcpy(out + 8, &request_id, 4);
+    memcpy(out + 12, &flags, 4);
+    memcpy(out + 16, &offset, 8);
+    memcpy(out + 24, &length, 8);
+}
+
+// Returns -1 if the bytes do not start with FRAME_MAGIC; the version is left for the caller to check
+static inline int frame_decode(const unsigned char *in, FrameHeader *header)
+{
+    uint16_t magic, status, name_len;
+    uint32_t request_id, flags;
+    uint64_t offset, length;
+
+    memcpy(&magic, in, 2);
+    if (be16toh(magic) != FRAME_MAGIC) {
+        return -1;
+    }
+    memcpy(&status, in + 4, 2);
+    memcpy(&name_len, in + 6, 2);
+    memcpy(&request_id, in + 8, 4);
+    memcpy(&flags, in + 12, 4);
+    memcpy(&offset, in + 16, 8);
+    memcpy(&length, in + 24, 8);
+
+    header->version = in[2];
+    header->opcode = in[3];
+    header->status = be16toh(status);
+    header->name_len = be16toh(name_len);
+    header->request_id = be32toh(request_id);
+    header->flags = be32toh(flags);
+    header->offset = be64toh(offset);
+    header->length = be64toh(length);
+    return 0;
+}
+
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} FrameRange;
+
+static inline void range_encode(const FrameRange *range, unsigned char *out)
+{
+    uint64_t offset = htobe64(range->offset), length = htobe64(range->length);
+    memcpy(out, &offset, 8);
+    memcpy(out + 8, &length, 8);
+}
+
+static inline void range_decode(const unsigned char *in, FrameRange *range)
+{
+    uint64_t offset, length;
+    memcpy(&offset, in, 8);
+    memcpy(&length, in + 8, 8);
+    range->offset = be64toh(offset);
+    range->length = be64toh(length);
+}
+
+typedef struct {
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t token;
+    uint16_t name_len;
+} FrameEntry;
+
+static inline void entry_encode(const FrameEntry *entry, unsigned char *out)
+{
+    uint64_t size = htobe64(entry->size), mtime = htobe64(entry->mtime), token = htobe64(entry->token);
+    uint16_t name_len = htobe16(entry->name_len);
+    memcpy(out, &size, 8);
+    memcpy(out + 8, &mtime, 8);
+    memcpy(out + 16, &token, 8);
+    memcpy(out + 24, &name_len, 2);
+}
+
+static inline void entry_decode(const unsigned char *in, FrameEntry *entry)
+{
+    uint64_t size, mtime, token;
+    uint16_t name_len;
+    memcpy(&size, in, 8);
+    memcpy(&mtime, in + 8, 8);
+    memcpy(&token, in + 16, 8);
+    memcpy(&name_len, in + 24, 2);
+    entry->size = be64toh(size);
+    entry->mtime = be64toh(mtime);
+    entry->token = be64toh(token);
+    entry->name_len = be16toh(name_len);
+}
+
+typedef struct {
+    uint32_t weak;
+    uint64_t strong;
+} FrameSignature;
+
+static inline void signature_encode(const FrameSignature *signature, unsigned char *out)
+{
+    uint32_t weak = htobe32(signature->weak);
+    uint64_t strong = htobe64(signature->strong);
+    memcpy(out, &weak, 4);
+    memcpy(out + 4, &strong, 8);
+}
+
+static inline void signature_decode(const unsigned char *in, FrameSignature *signature)
+{
+    uint32_t weak;
+    uint64_t strong;
+    memcpy(&weak, in, 4);
+    memcpy(&strong, in + 4, 8);
+    signature->weak = be32toh(weak);
+    signature->strong = be64toh(strong);
+}
+
+// Delta sync block size for a file: the power of two nearest above its square root, which balances the bytes of
+// signatures against those resent around each change, within [SIGNATURE_MIN_BLOCK, SIGNATURE_MAX_BLOCK]
+static inline uint64_t signature_block_size(uint64_t file_size)
+{
+    uint64_t block = SIGNATURE_MIN_BLOCK;
+    while (block < SIGNATURE_MAX_BLOCK && block * block < file_size) {
+        block <<= 1;
+    }
+    return block;
+}
+
+// Text for a status code, as used in "ERROR <message>" replies of the text protocol
+static inline const char *status_message(int status)
+{
+    switch (status) {
+    case STATUS_OK: return "OK";
+    case STATUS_NOT_FOUND: return "File not found";
+    case STATUS_INVALID_RANGE: return "Invalid range";
+    case STATUS_INVALID_REQUEST: return "Invalid request";
+    case STATUS_UNSUPPORTED_VERSION: return "Unsupported version";
+    default: return "Unknown error";
+    }
+}
+
+#endif
@@ -0,0 +1,247 @@
+// rs.h
+// Reed-Solomon erasure coding over GF(2^8), shared by shard.c, which splits a file into k data and m parity shards,
+// and client.c, which rebuilds the file from any k of them (-E). The code is systematic: data shards hold the file
+// itself, parity shards combinations of them through a Cauchy matrix, so every k shards are independent. The
+// multiply-accumulate kernel looks up the products of both nibbles of 32 (AVX2) or 16 (SSSE3) bytes at once with a
+// byte shuffle when the CPU has it, and uses a 64KB product table otherwise; the choice is made once at startup.
+#ifndef RS_H
+#define RS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define GF_POLY 0x11d // x^8 + x^4 + x^3 + x^2 + 1
+#define RS_MAX_SHARDS 32 // Data plus parity shards
+#define RS_SUFFIX ".rs" // Each mirror serves its shard of <file> as <file>.rs
+#define RS_HEADER_SIZE 4096 // Layout line at the start of a shard, zero-padded so that the stripes stay page-aligned
+#define RS_MAGIC "FTPRS1"
+#define RS_UNIT 65536 // Default bytes of each shard per stripe (64KB)
+
+// Layout of an erasure-coded file, from the header line of one of its shards:
+// "FTPRS1 <k> <m> <index> <unit> <file size>\n". Stripe s holds file bytes [s * k * unit, (s + 1) * k * unit),
+// the last one zero-padded: data shard j has their j-th unit at RS_HEADER_SIZE + s * unit, parity shards the
+// matching combination.
+typedef struct {
+    int k; // Data shards
+    int m; // Parity shards
+    int index; // This shard: data shards are 0..k-1, parity shards k..k+m-1
+    size_t unit;
+    size_t file_size;
+} RsLayout;
+
+static uint8_t gf_exp[510], gf_log[256];
+static uint8_t gf_mul_table[256][256];
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    return gf_mul_table[a][b];
+}
+
+// a must not be 0
+static inline uint8_t gf_inv(uint8_t a)
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+// Portable fallback: dst ^= c * src, one table lookup per byte
+static inline void gf_mul_add_sw(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    const uint8_t *row = gf_mul_table[c];
+    for (size_t i = 0; i < len; i++) {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+#if defined(__x86_64__)
+// SSSE3: c * x is c * (x & 0xf) ^ c * (x & 0xf0), so two 16-entry tables and two pshufb per 16 bytes. Compiled for
+// SSSE3 regardless of CFLAGS, only called if supported.
+__attribute__((target("ssse3")))
+static inline void gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    uint8_t low[16], high[16];
+    for (int i = 0; i < 16; i++) {
+        low[i] = gf_mul_table[c][i];
+        high[i] = gf_mul_table[c][i << 4];
+    }
+    __m128i low_table = _mm_loadu_si128((const __m128i *)low);
+    __m128i high_table = _mm_loadu_si128((const __m128i *)high);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i data = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low_table, _mm_and_si128(data, mask)),
+                                        _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi64(data, 4), mask)));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)), product));
+    }
+    gf_mul_add_sw(dst + i, src + i, c, len - i);
+}
+
+// AVX2: the same with both tables in each 128-bit lane, 32 bytes per step
+__attribute__((target("avx2")))
+static inline void gf_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    uint8_t low[16], high[16];
+    for (int i = 0; i < 16; i++) {
+        low[i] = gf_mul_table[c][i];
+        high[i] = gf_mul_table[c][i << 4];
+    }
+    __m256i low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)low));
+    __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)high));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low_table, _mm256_and_si256(data, mask)),
+                                           _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi64(data, 4), mask)));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(dst + i)), product));
+    }
+    gf_mul_add_sw(dst + i, src + i, c, len - i);
+}
+#endif
+
+static void (*gf_mul_add_impl)(uint8_t *, const uint8_t *, uint8_t, size_t) = gf_mul_add_sw;
+
+// Build the tables and pick the kernel before main() runs, so threads never race on them
+__attribute__((constructor))
+static void gf_init(void)
+{
+    unsigned int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= GF_POLY;
+        }
+    }
+    for (int a = 1; a < 256; a++) {
+        for (int b = 1; b < 256; b++) {
+            gf_mul_table[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+        }
+    }
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        gf_mul_add_impl = gf_mul_add_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        gf_mul_add_impl = gf_mul_add_ssse3;
+    }
+#endif
+}
+
+// dst ^= c * src over len bytes
+static inline void gf_mul_add(void *dst, const void *src, uint8_t c, size_t len)
+{
+    if (c != 0) {
+        gf_mul_add_impl(dst, src, c, len);
+    }
+}
+
+static inline const char *gf_implementation(void)
+{
+#if defined(__x86_64__)
+    if (gf_mul_add_impl == gf_mul_add_avx2) {
+        return "avx2";
+    }
+    if (gf_mul_add_impl == gf_mul_add_ssse3) {
+        return "ssse3";
+    }
+#endif
+    return "table";
+}
+
+// Entry of the k-column encoding matrix for shard row: the identity for data shards, 1 / (row + column) for parity
+// shards. Rows k.. and columns 0..k-1 are disjoint sets of field elements, so the parity rows form a Cauchy matrix
+// and any k rows of the whole matrix are invertible.
+static inline uint8_t rs_coefficient(int k, int row, int column)
+{
+    if (row < k) {
+        return row == column;
+    }
+    return gf_inv(row ^ column);
+}
+
+// Decoding matrix for the k distinct shards rows[0..k-1]: row j of inverse rebuilds data shard j as a combination
+// of those shards, in that order. Gauss-Jordan elimination. Returns -1 if the rows are not independent.
+static inline int rs_invert(int k, const int *rows, uint8_t inverse[][RS_MAX_SHARDS])
+{
+    uint8_t matrix[RS_MAX_SHARDS][RS_MAX_SHARDS];
+    for (int i = 0; i < k; i++) {
+        for (int j = 0; j < k; j++) {
+            matrix[i][j] = rs_coefficient(k, rows[i], j);
+            inverse[i][j] = (i == j);
+        }
+    }
+    for (int column = 0; column < k; column++) {
+        int pivot = column;
+        while (pivot < k && matrix[pivot][column] == 0) {
+            pivot++;
+        }
+        if (pivot == k) {
+            return -1;
+        }
+        for (int j = 0; j < k; j++) {
+            uint8_t swap = matrix[column][j];
+            matrix[column][j] = matrix[pivot][j];
+            matrix[pivot][j] = swap;
+            swap = inverse[column][j];
+            inverse[column][j] = inverse[pivot][j];
+            inverse[pivot][j] = swap;
+        }
+        uint8_t scale = gf_inv(matrix[column][column]);
+        for (int j = 0; j < k; j++) {
+            matrix[column][j] = gf_mul(matrix[column][j], scale);
+            inverse[column][j] = gf_mul(inverse[column][j], scale);
+        }
+        for (int i = 0; i < k; i++) {
+            uint8_t factor = matrix[i][column];
+            if (i == column || factor == 0) {
+                continue;
+            }
+            for (int j = 0; j < k; j++) {
+                matrix[i][j] ^= gf_mul(factor, matrix[column][j]);
+                inverse[i][j] ^= gf_mul(factor, inverse[column][j]);
+            }
+        }
+    }
+    return 0;
+}
+
+static inline size_t rs_stripes(const RsLayout *layout)
+{
+    size_t stripe = layout->k * layout->unit;
+    return (layout->file_size + stripe - 1) / stripe;
+}
+
+// Fill header (RS_HEADER_SIZE bytes) for one shard of the layout
+static inline void rs_format_header(const RsLayout *layout, char *header)
+{
+    memset(header, 0, RS_HEADER_SIZE);
+    snprintf(header, RS_HEADER_SIZE, RS_MAGIC " %d %d %d %zu %zu\n", layout->k, layout->m, layout->index,
+             layout->unit, layout->file_size);
+}
+
+// Parse a shard header. Returns -1 if it is not one or describes an impossible layout.
+static inline int rs_parse_header(const char *header, size_t len, RsLayout *layout)
+{
+    char line[128];
+    size_t line_len = (len < sizeof(line) - 1) ? len : sizeof(line) - 1;
+    memcpy(line, header, line_len);
+    line[line_len] = '\0';
+    if (sscanf(line, RS_MAGIC " %d %d %d %zu %zu", &layout->k, &layout->m, &layout->index, &layout->unit,
+               &layout->file_size) != 5) {
+        return -1;
+    }
+    if (layout->k < 1 || layout->m < 0 || layout->k + layout->m > RS_MAX_SHARDS || layout->index < 0
+        || layout->index >= layout->k + layout->m || layout->unit == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+#endif
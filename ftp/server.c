@@ -1,152 +1,3230 @@
 // server.c
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 
-#define BUFFER_SIZE 1048576 // 1MB
+#include "protocol.h"
+#include "crc32c.h"
+#include "stats.h"
+#include "pool.h"
+#include "delta.h"
 
-void handle_client(int client_socket)
+#define BUFFER_SIZE 1048576 // Default for -s (1MB)
+#define REACTOR_CHUNK 65536 // Per-connection staging buffer in epoll mode (64KB)
+#define MAX_EVENTS 256
+#define URING_ENTRIES 512 // Submission queue depth in io_uring mode
+#define URING_CONNS 1024 // Concurrent connections in io_uring mode, each owning two fixed-file slots
+#define URING_BUFFERS 128 // Registered REACTOR_CHUNK buffers shared by in-flight GETs
+#define URING_ACCEPTS 8 // Accepts kept queued on the listening socket
+#define FILE_CACHE_SIZE 64 // Default number of open files kept in the cache
+#define LISTING_CACHE_SIZE 16 // Directory listings kept for LIST
+#define SWARM_EXPIRY 10.0 // Seconds a swarm peer stays listed after its last ANNOUNCE
+#define SHAPING_QUANTUM 16384 // Smallest send worth waking up for when throttled (16KB)
+#define RELAY_CHUNK 1048576 // Relay mode: unit fetched from upstream, cached and evicted (1MB)
+#define RELAY_BUDGET (1ULL << 30) // Default for -C (1GB)
+#define RELAY_FETCHERS 8 // Threads fetching from upstream, each with its own connection
+#define RELAY_TTL 5.0 // Seconds a CHECK answer from upstream is reused
+#define RELAY_RETRY 1.0 // Seconds requests needing an unreachable upstream fail fast
+#define RELAY_TIMEOUT 5 // Seconds an upstream may stall before its connection is dropped
+#define YIELD_GRACE 10 // Blocking mode: milliseconds an idle connection may keep a waiting client out
+#define YIELD_LINGER 200 // Blocking mode: most milliseconds spent draining a connection that gave way
+
+typedef enum {
+    MODE_BLOCKING,
+    MODE_EPOLL,
+    MODE_URING
+} ServerMode;
+
+// How GET bytes travel from the file to the socket
+typedef enum {
+    DATA_SENDFILE, // sendfile() straight from the page cache
+    DATA_SPLICE, // splice() file -> pipe -> socket, used when sendfile() is unsupported
+    DATA_COPY // fread()/pread() into a user-space buffer, then write()
+} DataPath;
+
+DataPath data_path = DATA_SENDFILE;
+size_t buffer_size = BUFFER_SIZE; // Most bytes per zero-copy send call, blocking mode's copy buffer, splice pipe size (-s)
+
+// Token bucket pacing: rate is bytes/sec (0 = unlimited), burst caps how many unused tokens may accumulate
+typedef struct {
+    double rate;
+    double burst;
+    double tokens;
+    double last_refill;
+} TokenBucket;
+
+TokenBucket global_bucket; // Shared by every connection (-R/-B)
+double conn_rate = 0, conn_burst = 0; // Template for each connection's own bucket (-r/-b)
+
+// Every mode serves from one thread, which bumps these; the reporter thread (-i) and SIGUSR1 read them
+typedef struct {
+    uint64_t requests;
+    uint64_t bytes; // File data sent
+    uint64_t sends; // Calls that sent file data: sendfile(), splice(), write()/send() or io_uring writes
+    uint64_t throttled; // Times a connection had to wait for bandwidth tokens
+} ServerCounters;
+
+ServerCounters counters;
+double report_interval = 0; // Seconds between reports, 0 for none
+double report_start; // When the server started, for the rate in the first report
+int report_json = 0;
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bucket_init(TokenBucket *bucket, double rate, double burst)
+{
+    bucket->rate = rate;
+    bucket->burst = (burst > 0) ? burst : rate; // Default burst: one second of traffic
+    bucket->tokens = bucket->burst;
+    bucket->last_refill = now_seconds();
+}
+
+void bucket_refill(TokenBucket *bucket, double now)
+{
+    bucket->tokens += (now - bucket->last_refill) * bucket->rate;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->last_refill = now;
+}
+
+// Bytes (at most want) the connection may send now under both its own and the global bucket.
+// Returns 0 and sets *wait to the seconds until a worthwhile send is possible when throttled.
+size_t shaped_allowance(TokenBucket *conn_bucket, size_t want, double *wait)
+{
+    TokenBucket *buckets[2] = { conn_bucket, &global_bucket };
+    double now = now_seconds();
+    size_t allowance = want;
+    *wait = 0;
+
+    for (int i = 0; i < 2; i++) {
+        TokenBucket *bucket = buckets[i];
+        if (bucket->rate <= 0) {
+            continue;
+        }
+        bucket_refill(bucket, now);
+
+        double need = (want < SHAPING_QUANTUM) ? want : SHAPING_QUANTUM;
+        if (need > bucket->burst) {
+            need = bucket->burst;
+        }
+        if (bucket->tokens < need) {
+            if (allowance != 0) {
+                counter_add(&counters.throttled, 1);
+            }
+            double bucket_wait = (need - bucket->tokens) / bucket->rate;
+            if (bucket_wait > *wait) {
+                *wait = bucket_wait;
+            }
+            allowance = 0;
+        } else if (bucket->tokens < allowance) {
+            allowance = bucket->tokens;
+        }
+    }
+    return allowance;
+}
+
+// Account for file data just sent: take it from the token buckets and add it to the counters
+void shaped_consume(TokenBucket *conn_bucket, size_t bytes)
+{
+    counter_add(&counters.bytes, bytes);
+    counter_add(&counters.sends, 1);
+    if (conn_bucket->rate > 0) {
+        conn_bucket->tokens -= bytes;
+    }
+    if (global_bucket.rate > 0) {
+        global_bucket.tokens -= bytes;
+    }
+}
+
+// Blocking variant of shaped_allowance(): sleep until some bytes may be sent, then return how many
+size_t shaped_acquire(TokenBucket *conn_bucket, size_t want)
+{
+    double wait;
+    size_t allowance;
+    while ((allowance = shaped_allowance(conn_bucket, want, &wait)) == 0) {
+        struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+        nanosleep(&ts, NULL);
+    }
+    return allowance;
+}
+
+// Parse a byte count with an optional K/M/G suffix (powers of 1024)
+double parse_size(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    switch (*end) {
+    case 'k': case 'K': value *= 1024; break;
+    case 'm': case 'M': value *= 1024 * 1024; break;
+    case 'g': case 'G': value *= 1024 * 1024 * 1024; break;
+    }
+    return value;
+}
+
+// Open-file cache: descriptors and sizes of recently served files, most recently used first.
+// Entries are invalidated by inotify when available, otherwise by comparing stat() results on lookup.
+typedef struct CachedFile {
+    char path[256];
+    int fd;
+    size_t size;
+    struct timespec mtime;
+    dev_t dev;
+    ino_t ino;
+    int watch; // inotify watch descriptor, -1 when validated by stat()
+    int refs; // Transfers currently reading from fd
+    int detached; // No longer in the LRU list: closed once refs drops to 0
+    struct CachedFile *prev, *next;
+} CachedFile;
+
+typedef struct {
+    CachedFile *head, *tail;
+    int count;
+    int capacity; // 0 disables caching: every lookup opens a fresh, detached entry
+    int inotify_fd;
+    unsigned long hits, misses, invalidations, evictions;
+} FileCache;
+
+FileCache file_cache = { .capacity = FILE_CACHE_SIZE, .inotify_fd = -1 };
+volatile sig_atomic_t report_requested = 0;
+
+void file_cache_init(int capacity)
+{
+    file_cache.capacity = capacity;
+    if (capacity > 0) {
+        file_cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (file_cache.inotify_fd == -1) {
+            perror("inotify unavailable, validating cached files with stat()");
+        }
+    }
+}
+
+void file_cache_unlink(CachedFile *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        file_cache.head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        file_cache.tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+    file_cache.count--;
+}
+
+void file_cache_push_front(CachedFile *entry)
+{
+    entry->prev = NULL;
+    entry->next = file_cache.head;
+    if (file_cache.head) {
+        file_cache.head->prev = entry;
+    } else {
+        file_cache.tail = entry;
+    }
+    file_cache.head = entry;
+    file_cache.count++;
+}
+
+void file_cache_free(CachedFile *entry)
+{
+    close(entry->fd);
+    free(entry);
+}
+
+// Take an entry out of the cache; it is closed now or when its last transfer releases it
+void file_cache_drop(CachedFile *entry)
+{
+    file_cache_unlink(entry);
+    if (entry->watch != -1) {
+        int shared = 0; // Hard links or equivalent paths share one watch
+        for (CachedFile *other = file_cache.head; other; other = other->next) {
+            shared |= other->watch == entry->watch;
+        }
+        if (!shared) {
+            inotify_rm_watch(file_cache.inotify_fd, entry->watch);
+        }
+    }
+    entry->detached = 1;
+    if (entry->refs == 0) {
+        file_cache_free(entry);
+    }
+}
+
+void listing_cache_invalidate(int watch);
+
+// Apply pending inotify events: any change to a watched file invalidates its entries, any change in a watched
+// directory its listings
+void file_cache_drain_events(void)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while (file_cache.inotify_fd != -1 && (len = read(file_cache.inotify_fd, events, sizeof(events))) > 0) {
+        for (char *ptr = events; ptr < events + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+            int watch = ((struct inotify_event *)ptr)->wd;
+            listing_cache_invalidate(watch);
+            CachedFile *entry = file_cache.head;
+            while (entry) {
+                CachedFile *next = entry->next;
+                if (entry->watch == watch) {
+                    file_cache.invalidations++;
+                    file_cache_drop(entry);
+                }
+                entry = next;
+            }
+        }
+    }
+}
+
+// Fallback validation: the path must still name the same, unmodified file
+int file_cache_fresh(CachedFile *entry)
+{
+    if (entry->watch != -1) {
+        return 1;
+    }
+    struct stat st;
+    return stat(entry->path, &st) == 0 && st.st_dev == entry->dev && st.st_ino == entry->ino && (size_t)st.st_size == entry->size
+        && st.st_mtim.tv_sec == entry->mtime.tv_sec && st.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+// Look up (or open) a file for reading. Returns NULL if it cannot be opened; release with file_cache_release().
+CachedFile *file_cache_acquire(const char *path)
+{
+    file_cache_drain_events();
+
+    for (CachedFile *entry = file_cache.head; entry; entry = entry->next) {
+        if (strcmp(entry->path, path) != 0) {
+            continue;
+        }
+        if (!file_cache_fresh(entry)) {
+            file_cache.invalidations++;
+            file_cache_drop(entry);
+            break;
+        }
+        file_cache.hits++;
+        file_cache_unlink(entry);
+        file_cache_push_front(entry);
+        entry->refs++;
+        return entry;
+    }
+    file_cache.misses++;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    CachedFile *entry = calloc(1, sizeof(CachedFile));
+    if (!entry || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        free(entry);
+        close(fd);
+        return NULL;
+    }
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    entry->fd = fd;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtim;
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->refs = 1;
+    entry->watch = -1;
+
+    if (file_cache.capacity == 0) {
+        entry->detached = 1;
+        return entry;
+    }
+
+    if (file_cache.inotify_fd != -1) {
+        entry->watch = inotify_add_watch(file_cache.inotify_fd, path, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF);
+    }
+
+    // Evict least recently used idle entries; files still being sent, or installed in an io_uring connection's slot, may
+    // push the cache over capacity
+    CachedFile *victim = file_cache.tail;
+    while (file_cache.count >= file_cache.capacity && victim) {
+        CachedFile *prev = victim->prev;
+        if (victim->refs == 0) {
+            file_cache.evictions++;
+            file_cache_drop(victim);
+        }
+        victim = prev;
+    }
+    file_cache_push_front(entry);
+    return entry;
+}
+
+void file_cache_release(CachedFile *entry)
+{
+    if (--entry->refs == 0 && entry->detached) {
+        file_cache_free(entry);
+    }
+}
+
+// Entries of a LIST or STAT reply, encoded once for each protocol. LIST replies are cached by directory and dropped
+// when inotify reports any change in it; without inotify (or with -c 0) every LIST builds a fresh listing.
+typedef struct Listing {
+    char path[256]; // Directory listed; unused for STAT replies, which are never cached
+    char *body[2]; // [0] binary entries, [1] text lines
+    size_t body_len[2], body_cap[2];
+    size_t count;
+    int watch; // inotify watch on the directory, -1 if not cached
+    int refs; // Replies currently sending the body
+    int detached; // No longer in the cache: freed once refs drops to 0
+    Arena arena; // STAT replies: the listing and both bodies live in this one pool buffer
+    struct Listing *next;
+} Listing;
+
+typedef struct {
+    Listing *head; // Most recently used first
+    int count;
+    unsigned long hits, misses, invalidations;
+} ListingCache;
+
+ListingCache listing_cache;
+
+void listing_free(Listing *listing)
+{
+    if (listing->arena.base) {
+        Arena arena = listing->arena; // Holds the listing itself
+        arena_release(&arena);
+        return;
+    }
+    free(listing->body[0]);
+    free(listing->body[1]);
+    free(listing);
+}
+
+void listing_release(Listing *listing)
+{
+    if (--listing->refs == 0 && listing->detached) {
+        listing_free(listing);
+    }
+}
+
+// Grow one of a listing's bodies to fit bytes more. Returns -1 if out of memory.
+int listing_reserve(Listing *listing, int text, size_t bytes)
+{
+    size_t need = listing->body_len[text] + bytes;
+    if (need <= listing->body_cap[text]) {
+        return 0;
+    }
+    if (listing->arena.base) {
+        return -1; // Sized for the request up front
+    }
+    size_t cap = listing->body_cap[text] ? listing->body_cap[text] : 4096;
+    while (cap < need) {
+        cap *= 2;
+    }
+    char *body = realloc(listing->body[text], cap);
+    if (!body) {
+        return -1;
+    }
+    listing->body[text] = body;
+    listing->body_cap[text] = cap;
+    return 0;
+}
+
+// Change token of a file: a hash of its identity, size, modification and change times. Never 0.
+uint64_t change_token(const struct stat *st, int identity_only)
+{
+    uint64_t fields[] = { st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+                          st->st_ctim.tv_sec, st->st_ctim.tv_nsec };
+    uint64_t hash = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < (identity_only ? 2 : 7); i++) {
+        hash = (hash ^ fields[i]) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 33;
+    }
+    return hash ? hash : 1;
+}
+
+// Append one entry to both bodies: a regular file, a subdirectory (named with a trailing '/'), or, with st NULL,
+// a STAT path that was not found. Returns -1 if out of memory.
+int listing_append(Listing *listing, const char *name, const struct stat *st)
+{
+    int directory = st && S_ISDIR(st->st_mode);
+    FrameEntry entry = {
+        .size = (st && !directory) ? (uint64_t)st->st_size : 0,
+        .mtime = (st && !directory) ? (uint64_t)st->st_mtim.tv_sec : 0,
+        .token = st ? change_token(st, directory) : 0,
+        .name_len = strlen(name) + directory
+    };
+    char line[REQUEST_SIZE + 80];
+    int line_len = snprintf(line, sizeof(line), "%" PRIu64 " %" PRIu64 " %016" PRIx64 " %s%s\n", entry.size, entry.mtime, entry.token, name, directory ? "/" : "");
+    if (listing_reserve(listing, 0, FRAME_ENTRY_SIZE + entry.name_len) == -1 || listing_reserve(listing, 1, line_len) == -1) {
+        return -1;
+    }
+
+    char *out = listing->body[0] + listing->body_len[0];
+    entry_encode(&entry, (unsigned char *)out);
+    memcpy(out + FRAME_ENTRY_SIZE, name, entry.name_len - directory);
+    if (directory) {
+        out[FRAME_ENTRY_SIZE + entry.name_len - 1] = '/';
+    }
+    listing->body_len[0] += FRAME_ENTRY_SIZE + entry.name_len;
+    memcpy(listing->body[1] + listing->body_len[1], line, line_len);
+    listing->body_len[1] += line_len;
+    listing->count++;
+    return 0;
+}
+
+int listable(const struct dirent *entry)
+{
+    return strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0;
+}
+
+// Build the listing of a directory, sorted by name: one fstatat() per entry on the directory's descriptor, so
+// no path is resolved from the root again. Returns NULL if the directory cannot be read.
+Listing *listing_build(const char *path)
+{
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        return NULL;
+    }
+    struct dirent **names;
+    int count = scandirat(dir_fd, ".", &names, listable, alphasort);
+    Listing *listing = (count >= 0) ? calloc(1, sizeof(Listing)) : NULL;
+    int failed = !listing;
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        // Entries removed since scandirat() and special files are left out
+        if (!failed && fstatat(dir_fd, names[i]->d_name, &st, 0) == 0 && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+            failed = listing_append(listing, names[i]->d_name, &st) == -1;
+        }
+        free(names[i]);
+    }
+    if (count >= 0) {
+        free(names);
+    }
+    close(dir_fd);
+    if (failed) {
+        perror("Failed to build directory listing");
+        if (listing) {
+            listing_free(listing);
+        }
+        return NULL;
+    }
+    snprintf(listing->path, sizeof(listing->path), "%s", path);
+    listing->watch = -1;
+    return listing;
+}
+
+// Take a listing out of the cache; it is freed now or when its last reply releases it
+void listing_cache_drop(Listing **link)
+{
+    Listing *listing = *link;
+    *link = listing->next;
+    listing_cache.count--;
+    int shared = 0; // Equivalent paths ("dir", "dir/") share one watch
+    for (Listing *other = listing_cache.head; other; other = other->next) {
+        shared |= other->watch == listing->watch;
+    }
+    if (!shared) {
+        inotify_rm_watch(file_cache.inotify_fd, listing->watch);
+    }
+    listing->detached = 1;
+    if (listing->refs == 0) {
+        listing_free(listing);
+    }
+}
+
+void listing_cache_invalidate(int watch)
+{
+    Listing **link = &listing_cache.head;
+    while (*link) {
+        if ((*link)->watch == watch) {
+            listing_cache.invalidations++;
+            listing_cache_drop(link);
+        } else {
+            link = &(*link)->next;
+        }
+    }
+}
+
+// Look up (or build) the listing of a directory. Returns NULL if it cannot be read; release with listing_release().
+Listing *listing_cache_acquire(const char *path)
+{
+    file_cache_drain_events();
+
+    for (Listing **link = &listing_cache.head; *link; link = &(*link)->next) {
+        Listing *listing = *link;
+        if (strcmp(listing->path, path) == 0) {
+            listing_cache.hits++;
+            *link = listing->next;
+            listing->next = listing_cache.head;
+            listing_cache.head = listing;
+            listing->refs++;
+            return listing;
+        }
+    }
+    listing_cache.misses++;
+
+    // Watch before reading the directory, so a change made while it is being listed still invalidates the listing
+    int watch = -1;
+    if (file_cache.inotify_fd != -1) {
+        watch = inotify_add_watch(file_cache.inotify_fd, path, IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+                                  | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    }
+    Listing *listing = listing_build(path);
+    if (!listing || watch == -1) {
+        int shared = 0;
+        for (Listing *other = listing_cache.head; other; other = other->next) {
+            shared |= other->watch == watch;
+        }
+        if (watch != -1 && !shared) {
+            inotify_rm_watch(file_cache.inotify_fd, watch);
+        }
+        if (listing) {
+            listing->refs = 1;
+            listing->detached = 1;
+        }
+        return listing;
+    }
+
+    // Evict the least recently used listing; one still being sent is freed once its reply is done
+    if (listing_cache.count >= LISTING_CACHE_SIZE) {
+        Listing **link = &listing_cache.head;
+        while ((*link)->next) {
+            link = &(*link)->next;
+        }
+        listing_cache_drop(link);
+    }
+    listing->watch = watch;
+    listing->refs = 1;
+    listing->next = listing_cache.head;
+    listing_cache.head = listing;
+    listing_cache.count++;
+    return listing;
+}
+
+// Answer a STAT: fstatat() each newline-separated path relative to the directory. Missing paths get a zero entry.
+// The request bounds the size of the reply, so the listing and its bodies are carved from one arena.
+// Returns NULL if the directory cannot be opened.
+Listing *stat_paths(const char *directory, const char *paths)
+{
+    int dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        return NULL;
+    }
+    size_t paths_len = strlen(paths), count = 1;
+    for (const char *c = paths; *c; c++) {
+        count += (*c == '\n');
+    }
+    size_t binary_cap = FRAME_ENTRY_SIZE * count + paths_len;
+    size_t text_cap = 62 * count + paths_len; // Three numbers, a token and separators per line
+    Arena arena;
+    Listing *listing = NULL;
+    if (arena_init(&arena, sizeof(Listing) + binary_cap + text_cap + 32) == 0) {
+        listing = arena_alloc(&arena, sizeof(Listing));
+        memset(listing, 0, sizeof(Listing));
+        listing->body[0] = arena_alloc(&arena, binary_cap);
+        listing->body[1] = arena_alloc(&arena, text_cap);
+        listing->body_cap[0] = binary_cap;
+        listing->body_cap[1] = text_cap;
+        listing->arena = arena;
+    }
+    int failed = !listing;
+    char name[REQUEST_SIZE];
+    for (const char *start = paths; !failed && *start; ) {
+        const char *end = strchr(start, '\n');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        if (len > 0) {
+            memcpy(name, start, len);
+            name[len] = '\0';
+            struct stat st;
+            int found = fstatat(dir_fd, name, &st, 0) == 0 && S_ISREG(st.st_mode);
+            failed = listing_append(listing, name, found ? &st : NULL) == -1;
+        }
+        start += len + (end != NULL);
+    }
+    close(dir_fd);
+    if (failed) {
+        perror("Failed to build STAT reply");
+        if (listing) {
+            listing_free(listing);
+        }
+        return NULL;
+    }
+    listing->watch = -1;
+    listing->refs = 1;
+    listing->detached = 1;
+    return listing;
+}
+
+// Answer a SIGNATURES request: sign each block of [offset, offset + length) of a file (see protocol.h) into the
+// first body of a detached listing, carved from one arena like a STAT reply. The span is bounded, so one request
+// holds the server up for a few milliseconds at most. Returns NULL for a range the protocol does not allow, or if
+// the file cannot be read.
+Listing *sign_blocks(CachedFile *file, size_t offset, size_t length)
+{
+    size_t block = signature_block_size(file->size);
+    if (offset % block != 0 || offset >= file->size || length > file->size - offset || length > SIGNATURE_MAX_SPAN) {
+        fprintf(stderr, "Invalid signature range: offset %zu, length %zu, file size %zu\n", offset, length, file->size);
+        return NULL;
+    }
+    size_t count = (length + block - 1) / block;
+    size_t chunk = (SIGNATURE_MAX_BLOCK > length) ? length : SIGNATURE_MAX_BLOCK; // A multiple of block unless it is the whole range
+    Arena arena;
+    if (arena_init(&arena, sizeof(Listing) + count * FRAME_SIGNATURE_SIZE + chunk + 32) == -1) {
+        perror("Failed to build SIGNATURES reply");
+        return NULL;
+    }
+    Listing *listing = arena_alloc(&arena, sizeof(Listing));
+    memset(listing, 0, sizeof(Listing));
+    listing->body[0] = arena_alloc(&arena, count * FRAME_SIGNATURE_SIZE);
+    listing->body_cap[0] = count * FRAME_SIGNATURE_SIZE;
+    listing->arena = arena;
+    uint8_t *data = arena_alloc(&arena, chunk);
+
+    for (size_t done = 0; done < length; ) {
+        size_t want = (length - done < chunk) ? length - done : chunk, got = 0;
+        while (got < want) {
+            ssize_t bytes = pread(file->fd, data + got, want - got, offset + done + got);
+            if (bytes <= 0) {
+                fprintf(stderr, "Error reading %s for signatures: %s\n", file->path, bytes ? strerror(errno) : "file truncated");
+                listing_free(listing);
+                return NULL;
+            }
+            got += bytes;
+        }
+        for (size_t start = 0; start < want; start += block) {
+            size_t n = (want - start < block) ? want - start : block;
+            FrameSignature signature = { delta_weak(data + start, n), delta_strong(data + start, n) };
+            signature_encode(&signature, (unsigned char *)listing->body[0] + listing->body_len[0]);
+            listing->body_len[0] += FRAME_SIGNATURE_SIZE;
+            listing->count++;
+        }
+        done += want;
+    }
+    listing->watch = -1;
+    listing->refs = 1;
+    listing->detached = 1;
+    return listing;
+}
+
+// Swarm tracker: clients downloading in swarm mode ANNOUNCE, a few times a second, the blocks of a file their GET
+// responder can serve, and get back the latest announcement of every other peer of that file. Any server can be
+// the tracker. Peers that stop announcing are forgotten after SWARM_EXPIRY seconds.
+typedef struct SwarmPeer {
+    char file[FRAME_MAX_NAME + 1];
+    char announce[REQUEST_SIZE]; // "<ip>:<port> <have> [<fetching>]"
+    double seen;
+    struct SwarmPeer *next;
+} SwarmPeer;
+
+SwarmPeer *swarm_peers = NULL;
+
+// Record an announcement and list the file's other peers, one announcement per line, in the first body of a
+// detached listing (the same text for every protocol). Returns NULL for a malformed announcement or when out of
+// memory.
+Listing *swarm_announce(const char *file, const char *announce)
+{
+    const char *space = strchr(announce, ' ');
+    const char *colon = strchr(announce, ':');
+    if (!space || !colon || colon > space || strchr(announce, '\n')) {
+        return NULL;
+    }
+    for (const char *bitmap = space + 1, *end; ; bitmap = end + 1) { // One or two hex bitmaps
+        end = bitmap + strspn(bitmap, "0123456789abcdefABCDEF");
+        if (end == bitmap || (*end != '\0' && (*end != ' ' || bitmap != space + 1))) {
+            return NULL;
+        }
+        if (*end == '\0') {
+            break;
+        }
+    }
+    size_t addr_len = space - announce + 1; // Including the space, so "1.2.3.4:80" never matches "1.2.3.4:8080"
+
+    double now = now_seconds();
+    SwarmPeer *self = NULL;
+    for (SwarmPeer **link = &swarm_peers; *link; ) {
+        SwarmPeer *peer = *link;
+        if (now - peer->seen > SWARM_EXPIRY) {
+            *link = peer->next;
+            free(peer);
+            continue;
+        }
+        if (strcmp(peer->file, file) == 0 && strncmp(peer->announce, announce, addr_len) == 0) {
+            self = peer;
+        }
+        link = &peer->next;
+    }
+    if (!self && (self = calloc(1, sizeof(SwarmPeer)))) {
+        snprintf(self->file, sizeof(self->file), "%s", file);
+        self->next = swarm_peers;
+        swarm_peers = self;
+    }
+    Listing *listing = self ? calloc(1, sizeof(Listing)) : NULL;
+    if (!listing) {
+        perror("Failed to record announcement");
+        return NULL;
+    }
+    snprintf(self->announce, sizeof(self->announce), "%s", announce);
+    self->seen = now;
+
+    for (SwarmPeer *peer = swarm_peers; peer; peer = peer->next) {
+        if (peer == self || strcmp(peer->file, file) != 0) {
+            continue;
+        }
+        size_t len = strlen(peer->announce);
+        if (listing_reserve(listing, 0, len + 1) == -1) {
+            perror("Failed to list peers");
+            listing_free(listing);
+            return NULL;
+        }
+        memcpy(listing->body[0] + listing->body_len[0], peer->announce, len);
+        listing->body[0][listing->body_len[0] + len] = '\n';
+        listing->body_len[0] += len + 1;
+        listing->count++;
+    }
+    LOG_DEBUG("ANNOUNCE %s from %.*s: %zu other peers\n", file, (int)addr_len - 1, announce, listing->count);
+    listing->watch = -1;
+    listing->refs = 1;
+    listing->detached = 1;
+    return listing;
+}
+
+void file_cache_report(void)
+{
+    unsigned long lookups = file_cache.hits + file_cache.misses;
+    fprintf(stderr, "file cache: %lu lookups, %lu hits (%.1f%%), %lu misses, %lu invalidations, %lu evictions, %d/%d entries\n",
+            lookups, file_cache.hits, lookups ? 100.0 * file_cache.hits / lookups : 0.0, file_cache.misses,
+            file_cache.invalidations, file_cache.evictions, file_cache.count, file_cache.capacity);
+    fprintf(stderr, "listing cache: %lu hits, %lu misses, %lu invalidations, %d/%d listings\n",
+            listing_cache.hits, listing_cache.misses, listing_cache.invalidations, listing_cache.count, LISTING_CACHE_SIZE);
+    pool_report();
+}
+
+void on_report_signal(int sig)
+{
+    (void)sig;
+    report_requested = 1;
+}
+
+// Print the counters as a line on stderr or, with -j, as a JSON object on stdout
+void counters_report(void)
+{
+    static double last_time;
+    static uint64_t last_bytes;
+    double now = now_seconds();
+    uint64_t bytes = counter_read(&counters.bytes);
+    double since = now - ((last_time > 0) ? last_time : report_start);
+    double rate = (since > 0) ? (bytes - last_bytes) / since / 1048576 : 0;
+    last_time = now;
+    last_bytes = bytes;
+    if (report_json) {
+        printf("{\"requests\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"MBps\": %.1f, \"sends\": %" PRIu64 ", \"throttled\": %" PRIu64 "}\n",
+               counter_read(&counters.requests), bytes, rate, counter_read(&counters.sends), counter_read(&counters.throttled));
+        fflush(stdout);
+    } else {
+        fprintf(stderr, "served: %" PRIu64 " requests, %.1f MB, %.1f MB/s since last report, %" PRIu64 " send calls, %" PRIu64 " throttled\n",
+                counter_read(&counters.requests), bytes / 1048576.0, rate, counter_read(&counters.sends),
+                counter_read(&counters.throttled));
+    }
+}
+
+void relay_report(void);
+
+void report_if_requested(void)
+{
+    if (report_requested) {
+        report_requested = 0;
+        file_cache_report();
+        relay_report();
+        if (report_interval == 0) {
+            counters_report();
+        }
+    }
+}
+
+void *run_reporter(void *arg)
+{
+    (void)arg;
+    struct timespec interval = { (time_t)report_interval, (long)((report_interval - (time_t)report_interval) * 1e9) };
+    while (1) {
+        nanosleep(&interval, NULL);
+        counters_report();
+    }
+    return NULL;
+}
+
+// Pipe used as the in-kernel staging area for the splice() path
+typedef struct {
+    int fds[2];
+    size_t pending; // Bytes already spliced into the pipe but not yet out to the socket
+} SplicePipe;
+
+void splice_pipe_init(SplicePipe *pipe_state)
+{
+    pipe_state->fds[0] = pipe_state->fds[1] = -1;
+    pipe_state->pending = 0;
+}
+
+void splice_pipe_close(SplicePipe *pipe_state)
+{
+    if (pipe_state->fds[0] != -1) {
+        close(pipe_state->fds[0]);
+        close(pipe_state->fds[1]);
+    }
+    splice_pipe_init(pipe_state);
+}
+
+// Send up to count bytes of file_fd starting at *offset to sock without copying through user space.
+// Returns bytes written to the socket, 0 at end of file, or -1 with errno set (EAGAIN on a full non-blocking socket).
+// *offset advances past every byte taken from the file, which for splice() may run ahead of the socket by pipe_state->pending.
+ssize_t zero_copy_send(int sock, int file_fd, off_t *offset, size_t count, SplicePipe *pipe_state, int nonblocking)
+{
+    if (data_path == DATA_SENDFILE) {
+        ssize_t bytes_sent = sendfile(sock, file_fd, offset, count);
+        if (bytes_sent != -1 || (errno != EINVAL && errno != ENOSYS)) {
+            return bytes_sent;
+        }
+        fprintf(stderr, "sendfile() unsupported (%s), falling back to splice()\n", strerror(errno));
+        data_path = DATA_SPLICE;
+    }
+
+    if (pipe_state->fds[0] == -1) {
+        if (pipe2(pipe_state->fds, O_CLOEXEC) == -1) {
+            return -1;
+        }
+        fcntl(pipe_state->fds[1], F_SETPIPE_SZ, buffer_size); // Best effort: fewer round trips through a larger pipe
+    }
+
+    if (pipe_state->pending == 0) {
+        ssize_t bytes_in = splice(file_fd, offset, pipe_state->fds[1], NULL, count, SPLICE_F_MOVE);
+        if (bytes_in <= 0) {
+            return bytes_in;
+        }
+        pipe_state->pending = bytes_in;
+    }
+
+    unsigned int flags = SPLICE_F_MOVE | SPLICE_F_MORE | (nonblocking ? SPLICE_F_NONBLOCK : 0);
+    size_t bytes_to_send = (pipe_state->pending < count) ? pipe_state->pending : count;
+    ssize_t bytes_out = splice(pipe_state->fds[0], NULL, sock, NULL, bytes_to_send, flags);
+    if (bytes_out > 0) {
+        pipe_state->pending -= bytes_out;
+    }
+    return bytes_out;
+}
+
+// Which wire protocol a connection speaks, decided by the first bytes it sends
+typedef enum {
+    PROTO_NONE, // Nothing received yet
+    PROTO_LEGACY, // One unterminated text request, unframed reply, then close
+    PROTO_TEXT, // Newline-terminated text requests, "OK <n>\n" / "ERROR <message>\n" replies
+    PROTO_BINARY // Fixed-size frames, see protocol.h
+} Protocol;
+
+// File ranges owed to the client by a GET: one for a plain GET, up to FRAME_MAX_RANGES for GET_RANGES
+typedef struct {
+    FrameRange ranges[FRAME_MAX_RANGES];
+    int count;
+    int next; // Index of the next range to start sending
+    int headers; // GET_RANGES: every range is preceded by its FRAME_RANGE_SIZE header
+    int checksums; // FRAME_FLAG_CRC32C: every range is preceded by the checksums of its CHECKSUM_BLOCKs
+} RangeList;
+
+// One decoded request, whichever protocol it arrived in
+typedef struct {
+    int opcode; // FRAME_CHECK, FRAME_GET, FRAME_GET_RANGES, FRAME_LIST, FRAME_STAT, FRAME_ANNOUNCE or FRAME_SIGNATURES
+    int status; // STATUS_OK, or why the request is rejected before the file is looked up
+    uint32_t request_id; // Binary only: echoed in the reply
+    char filename[FRAME_MAX_NAME + 1]; // LIST and STAT: the directory
+    size_t offset; // GET and SIGNATURES: first byte
+    size_t length; // GET and SIGNATURES: bytes; GET_RANGES: number of ranges; STAT and ANNOUNCE: bytes of paths
+    RangeList body; // GET and GET_RANGES
+    char paths[REQUEST_SIZE]; // STAT: newline-separated paths relative to filename; ANNOUNCE: the announcement
+    int waited; // Relay mode: already parked once waiting for upstream, so not counted again
+} Request;
+
+// Parse a text request (format: CHECK <filename>, GET <filename> <offset> <chunk_size>, LIST <directory>,
+// STAT <directory> <path>... or ANNOUNCE <filename> <ip>:<port> <have> [<fetching>])
+void parse_request(const char *line, Request *request)
+{
+    char command[10];
+    command[0] = '\0';
+    memset(request, 0, sizeof(*request));
+    int params = sscanf(line, "%9s %255s %zu %zu", command, request->filename, &request->offset, &request->length);
+
+    if (strcmp(command, "CHECK") == 0 && params >= 2) {
+        request->opcode = FRAME_CHECK;
+    } else if (strcmp(command, "LIST") == 0 && params >= 2) {
+        request->opcode = FRAME_LIST;
+    } else if (strcmp(command, "STAT") == 0 && params >= 2) {
+        // Paths are separated by spaces on the line, by newlines everywhere else
+        int start = 0;
+        sscanf(line, "%*9s %*255s %n", &start);
+        request->opcode = FRAME_STAT;
+        for (size_t i = 0; line[start + i]; i++) {
+            request->paths[i] = (line[start + i] == ' ') ? '\n' : line[start + i];
+        }
+    } else if (strcmp(command, "ANNOUNCE") == 0 && params >= 2) {
+        int start = 0;
+        sscanf(line, "%*9s %*255s %n", &start);
+        request->opcode = FRAME_ANNOUNCE;
+        snprintf(request->paths, sizeof(request->paths), "%s", line + start);
+    } else if (strcmp(command, "GET") == 0 && params >= 4 && request->length > 0) {
+        request->opcode = FRAME_GET;
+        request->body.ranges[0] = (FrameRange){ request->offset, request->length };
+        request->body.count = 1;
+    } else {
+        fprintf(stderr, "Invalid request: %s\n", line);
+        request->status = STATUS_INVALID_REQUEST;
+    }
+}
+
+// Decode a binary request whose header, filename and ranges are all buffered
+void parse_frame(const FrameHeader *header, const char *name, Request *request)
+{
+    memset(request, 0, sizeof(*request));
+    request->opcode = header->opcode;
+    request->request_id = header->request_id;
+    request->offset = header->offset;
+    request->length = header->length;
+    memcpy(request->filename, name, header->name_len);
+    request->filename[header->name_len] = '\0';
+
+    if (header->opcode == FRAME_GET) {
+        request->body.ranges[0] = (FrameRange){ header->offset, header->length };
+        request->body.count = 1;
+    } else if (header->opcode == FRAME_GET_RANGES) {
+        const unsigned char *range = (const unsigned char *)name + header->name_len;
+        for (size_t i = 0; i < header->length; i++, range += FRAME_RANGE_SIZE) {
+            range_decode(range, &request->body.ranges[i]);
+        }
+        request->body.count = header->length;
+        request->body.headers = 1;
+    } else if (header->opcode == FRAME_STAT || header->opcode == FRAME_ANNOUNCE) {
+        memcpy(request->paths, name + header->name_len, header->length);
+        request->paths[header->length] = '\0';
+    }
+    int get = (header->opcode == FRAME_GET || header->opcode == FRAME_GET_RANGES);
+    int payload = (header->opcode == FRAME_STAT || header->opcode == FRAME_ANNOUNCE); // Text after the name
+    request->body.checksums = get && (header->flags & FRAME_FLAG_CRC32C);
+
+    if (header->version != FRAME_VERSION) {
+        fprintf(stderr, "Unsupported frame version: %d\n", header->version);
+        request->status = STATUS_UNSUPPORTED_VERSION;
+    } else if ((!get && !payload && header->opcode != FRAME_CHECK && header->opcode != FRAME_LIST
+                && header->opcode != FRAME_SIGNATURES)
+               || header->name_len == 0 || strlen(request->filename) != header->name_len
+               || ((get || payload || header->opcode == FRAME_SIGNATURES) && header->length == 0)
+               || (payload && strlen(request->paths) != header->length)) {
+        fprintf(stderr, "Invalid frame: opcode=%d, name_len=%d, length=%zu\n", header->opcode, header->name_len, request->length);
+        request->status = STATUS_INVALID_REQUEST;
+    }
+}
+
+// Take the next complete request off the front of a connection's receive buffer (REQUEST_SIZE bytes).
+// The first byte picks the protocol: the high byte of FRAME_MAGIC means binary frames, anything else text,
+// where a first read without a newline is a legacy one-shot request.
+// Returns 1 with *request filled, 0 if more bytes are needed, or -1 if the connection must be closed.
+int take_request(char *buffer, size_t *buffer_len, Protocol *protocol, Request *request)
+{
+    if (*buffer_len == 0) {
+        return 0;
+    }
+    if (*protocol == PROTO_NONE && (unsigned char)buffer[0] == (FRAME_MAGIC >> 8)) {
+        *protocol = PROTO_BINARY;
+    }
+
+    size_t consumed;
+    if (*protocol == PROTO_BINARY) {
+        FrameHeader header;
+        if (*buffer_len < FRAME_HEADER_SIZE) {
+            return 0;
+        }
+        if (frame_decode((unsigned char *)buffer, &header) == -1 || header.name_len > FRAME_MAX_NAME
+            || (header.opcode == FRAME_GET_RANGES && header.length > FRAME_MAX_RANGES)
+            || ((header.opcode == FRAME_STAT || header.opcode == FRAME_ANNOUNCE)
+                && header.length > (uint64_t)(REQUEST_SIZE - 1 - FRAME_HEADER_SIZE - header.name_len))) {
+            fprintf(stderr, "Invalid frame header\n");
+            return -1; // Cannot find the next frame boundary
+        }
+        consumed = FRAME_HEADER_SIZE + header.name_len;
+        if (header.opcode == FRAME_GET_RANGES) {
+            consumed += header.length * FRAME_RANGE_SIZE;
+        } else if (header.opcode == FRAME_STAT || header.opcode == FRAME_ANNOUNCE) {
+            consumed += header.length;
+        }
+        if (*buffer_len < consumed) {
+            return 0;
+        }
+        parse_frame(&header, buffer + FRAME_HEADER_SIZE, request);
+    } else {
+        char *newline = memchr(buffer, '\n', *buffer_len);
+        if (newline) {
+            *protocol = PROTO_TEXT;
+            *newline = '\0';
+            consumed = newline + 1 - buffer;
+        } else if (*protocol == PROTO_NONE) {
+            // Legacy request: the client sends it in a single write with no terminator
+            *protocol = PROTO_LEGACY;
+            buffer[*buffer_len] = '\0';
+            consumed = *buffer_len;
+        } else {
+            if (*buffer_len >= REQUEST_SIZE - 1) {
+                fprintf(stderr, "Request too long\n");
+                return -1;
+            }
+            return 0; // Wait for the rest of the line
+        }
+        parse_request(buffer, request);
+    }
+
+    *buffer_len -= consumed;
+    memmove(buffer, buffer + consumed, *buffer_len);
+    return 1;
+}
+
+// Write all of data to a blocking socket, returns -1 on failure. flags can add MSG_MORE when a body follows.
+int send_all(int sock, const char *data, size_t len, int flags)
+{
+    while (len > 0) {
+        ssize_t bytes_sent = send(sock, data, len, MSG_NOSIGNAL | flags);
+        if (bytes_sent <= 0) {
+            return -1;
+        }
+        data += bytes_sent;
+        len -= bytes_sent;
+    }
+    return 0;
+}
+
+// Read exactly len bytes from a blocking socket, returns -1 on failure or end of stream
+int recv_all(int sock, void *data, size_t len)
+{
+    char *ptr = data;
+    while (len > 0) {
+        ssize_t bytes_read = recv(sock, ptr, len, 0);
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        ptr += bytes_read;
+        len -= bytes_read;
+    }
+    return 0;
+}
+
+// Relay mode (-u): files are served from a sparse local copy in the cache directory, filled RELAY_CHUNK at a time
+// from upstream servers by fetcher threads. The event loop owns all relay state; fetchers only run jobs and hand
+// them back through an eventfd. A request waits (CONN_WAIT_RELAY) until every chunk it covers is present, and
+// requests for a chunk already being fetched wait on that fetch instead of starting their own. Present chunks
+// form one LRU list; when they exceed the budget (-C), the least recently used chunks of files no transfer is
+// reading are punched out of their cache files.
+typedef enum {
+    CHUNK_ABSENT,
+    CHUNK_FETCHING,
+    CHUNK_PRESENT
+} ChunkState;
+
+typedef struct RelayChunk {
+    ChunkState state;
+    double failed_at; // Last fetch found no upstream: requests for the chunk are dropped for RELAY_RETRY seconds
+    struct RelayFile *file;
+    size_t index;
+    struct RelayChunk *prev, *next; // LRU list of present chunks, most recently used first
+} RelayChunk;
+
+typedef struct RelayFile {
+    char name[FRAME_MAX_NAME + 1];
+    int known; // An upstream has answered a CHECK for it
+    int missing; // ... with STATUS_NOT_FOUND
+    int checking; // CHECK job in flight
+    double checked_at;
+    double failed_at; // Last CHECK found no upstream
+    CachedFile *data; // Local copy of the current size and mtime, NULL unless known and present upstream
+    RelayChunk *chunks;
+    size_t chunk_count;
+    int fetching; // GET jobs in flight for data, each holding a reference to it
+    struct RelayFile *next;
+} RelayFile;
+
+// One upstream exchange, queued by the event loop and run by a fetcher thread
+typedef struct RelayJob {
+    int opcode; // FRAME_CHECK or FRAME_GET
+    RelayFile *file;
+    CachedFile *data; // GET: copy the chunk is written to, held until the job is applied
+    size_t chunk;
+    uint64_t offset, length;
+    int status; // STATUS_OK, the upstream's error status, or -1 if no upstream could answer
+    uint64_t size, mtime; // CHECK result
+    struct RelayJob *next;
+} RelayJob;
+
+typedef struct {
+    char ip[64];
+    int port;
+} Upstream;
+
+typedef struct {
+    int enabled;
+    Upstream *upstreams;
+    int upstream_count;
+    const char *dir;
+    uint64_t budget; // Bytes of present chunks kept on disk
+    uint64_t cached;
+    unsigned long next_id; // Names the cache files
+    RelayFile *files;
+    RelayChunk *lru_head, *lru_tail;
+    pthread_mutex_t lock; // Guards the two job lists
+    pthread_cond_t cond;
+    RelayJob *jobs, *jobs_tail; // Waiting for a fetcher
+    RelayJob *done; // Finished, waiting to be applied by the event loop
+    int event_fd;
+    unsigned long hits, misses, coalesced, fetches, checks, evictions, failures;
+    uint64_t fetched_bytes;
+} Relay;
+
+Relay relay = { .dir = "relay-cache", .budget = RELAY_BUDGET, .lock = PTHREAD_MUTEX_INITIALIZER,
+                .cond = PTHREAD_COND_INITIALIZER, .event_fd = -1 };
+
+enum {
+    RELAY_READY, // *file is set (NULL if the file does not exist upstream)
+    RELAY_WAIT, // Upstream work is queued: retry the request once relay_apply_jobs() has run
+    RELAY_FAILED // No upstream could answer: drop the request
+};
+
+size_t relay_chunk_length(const RelayFile *file, size_t index)
+{
+    size_t start = index * RELAY_CHUNK;
+    return (file->data->size - start > RELAY_CHUNK) ? RELAY_CHUNK : file->data->size - start;
+}
+
+void relay_lru_unlink(RelayChunk *chunk)
+{
+    if (chunk->prev) {
+        chunk->prev->next = chunk->next;
+    } else {
+        relay.lru_head = chunk->next;
+    }
+    if (chunk->next) {
+        chunk->next->prev = chunk->prev;
+    } else {
+        relay.lru_tail = chunk->prev;
+    }
+    chunk->prev = chunk->next = NULL;
+}
+
+void relay_lru_push_front(RelayChunk *chunk)
+{
+    chunk->prev = NULL;
+    chunk->next = relay.lru_head;
+    if (relay.lru_head) {
+        relay.lru_head->prev = chunk;
+    } else {
+        relay.lru_tail = chunk;
+    }
+    relay.lru_head = chunk;
+}
+
+// Forget a file's local copy: its cache file is removed now and closed once no transfer reads it
+void relay_drop_data(RelayFile *file)
+{
+    if (!file->data) {
+        return;
+    }
+    for (size_t i = 0; i < file->chunk_count; i++) {
+        if (file->chunks[i].state == CHUNK_PRESENT) {
+            relay_lru_unlink(&file->chunks[i]);
+            relay.cached -= relay_chunk_length(file, i);
+        }
+    }
+    free(file->chunks);
+    file->chunks = NULL;
+    file->chunk_count = 0;
+    file->fetching = 0; // Jobs for the old copy no longer count
+    unlink(file->data->path);
+    file->data->detached = 1;
+    file_cache_release(file->data);
+    file->data = NULL;
+}
+
+// Start an empty local copy for a new size and mtime. The old copy is dropped only once the new one exists.
+// Returns -1 if the cache file cannot be created.
+int relay_new_data(RelayFile *file, uint64_t size, uint64_t mtime)
+{
+    CachedFile *data = calloc(1, sizeof(CachedFile));
+    size_t count = (size + RELAY_CHUNK - 1) / RELAY_CHUNK;
+    RelayChunk *chunks = calloc(count ? count : 1, sizeof(RelayChunk));
+    if (!data || !chunks) {
+        perror("Failed to allocate relay file");
+        free(data);
+        free(chunks);
+        return -1;
+    }
+    snprintf(data->path, sizeof(data->path), "%s/%lu.cache", relay.dir, relay.next_id++);
+    data->fd = open(data->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (data->fd == -1 || ftruncate(data->fd, size) == -1) {
+        perror("Failed to create relay cache file");
+        if (data->fd != -1) {
+            close(data->fd);
+            unlink(data->path);
+        }
+        free(data);
+        free(chunks);
+        return -1;
+    }
+    data->size = size;
+    data->mtime.tv_sec = mtime;
+    data->watch = -1;
+    data->refs = 1; // The relay's own reference, dropped by relay_drop_data()
+    for (size_t i = 0; i < count; i++) {
+        chunks[i].file = file;
+        chunks[i].index = i;
+    }
+    relay_drop_data(file);
+    file->data = data;
+    file->chunks = chunks;
+    file->chunk_count = count;
+    return 0;
+}
+
+// Punch out least recently used chunks until bytes more fit in the budget. Chunks of files that transfers are
+// reading (references beyond the relay's own and its fetches') stay, so the cache may run over budget while
+// they finish.
+void relay_make_room(uint64_t bytes)
+{
+    RelayChunk *victim = relay.lru_tail;
+    while (relay.cached + bytes > relay.budget && victim) {
+        RelayChunk *prev = victim->prev;
+        RelayFile *file = victim->file;
+        if (file->data->refs == 1 + file->fetching) {
+            size_t length = relay_chunk_length(file, victim->index);
+            if (fallocate(file->data->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, victim->index * RELAY_CHUNK, length) == -1) {
+                perror("Failed to evict relay chunk");
+            }
+            relay_lru_unlink(victim);
+            victim->state = CHUNK_ABSENT;
+            relay.cached -= length;
+            relay.evictions++;
+        }
+        victim = prev;
+    }
+}
+
+void relay_queue(RelayJob *job)
+{
+    pthread_mutex_lock(&relay.lock);
+    if (relay.jobs_tail) {
+        relay.jobs_tail->next = job;
+    } else {
+        relay.jobs = job;
+    }
+    relay.jobs_tail = job;
+    pthread_cond_signal(&relay.cond);
+    pthread_mutex_unlock(&relay.lock);
+}
+
+// Returns -1 if out of memory
+int relay_queue_check(RelayFile *file)
+{
+    RelayJob *job = calloc(1, sizeof(RelayJob));
+    if (!job) {
+        perror("Failed to allocate relay job");
+        return -1;
+    }
+    job->opcode = FRAME_CHECK;
+    job->file = file;
+    file->checking = 1;
+    relay.checks++;
+    relay_queue(job);
+    return 0;
+}
+
+// Returns -1 if out of memory
+int relay_queue_fetch(RelayFile *file, size_t index)
+{
+    RelayJob *job = calloc(1, sizeof(RelayJob));
+    if (!job) {
+        perror("Failed to allocate relay job");
+        return -1;
+    }
+    job->opcode = FRAME_GET;
+    job->file = file;
+    job->data = file->data;
+    job->data->refs++;
+    job->chunk = index;
+    job->offset = index * RELAY_CHUNK;
+    job->length = relay_chunk_length(file, index);
+    file->chunks[index].state = CHUNK_FETCHING;
+    file->fetching++;
+    relay.fetches++;
+    relay_queue(job);
+    return 0;
+}
+
+RelayFile *relay_lookup(const char *name)
+{
+    for (RelayFile *file = relay.files; file; file = file->next) {
+        if (strcmp(file->name, name) == 0) {
+            return file;
+        }
+    }
+    RelayFile *file = calloc(1, sizeof(RelayFile));
+    if (!file) {
+        perror("Failed to allocate relay file");
+        return NULL;
+    }
+    snprintf(file->name, sizeof(file->name), "%s", name);
+    file->next = relay.files;
+    relay.files = file;
+    return file;
+}
+
+// Relay-mode replacement for file_cache_acquire(): make sure the request can be answered from the local copy,
+// queueing whatever upstream work it still needs. CHECKs revalidate metadata older than RELAY_TTL; GETs use the
+// last known metadata and need every chunk they cover. On RELAY_READY, *out is held like a file_cache_acquire()
+// result. first is 0 when the request is retried after waiting, so it is counted only once.
+int relay_acquire(const Request *request, int first, CachedFile **out)
+{
+    double now = now_seconds();
+    if (relay.cached > relay.budget) {
+        relay_make_room(0); // Chunks pinned when they arrived may be free to go now
+    }
+    RelayFile *file = relay_lookup(request->filename);
+    if (!file) {
+        return RELAY_FAILED;
+    }
+    if (!file->known || (request->opcode == FRAME_CHECK && now - file->checked_at > RELAY_TTL)) {
+        if (file->checking) {
+            return RELAY_WAIT;
+        }
+        if (file->failed_at > 0 && now - file->failed_at < RELAY_RETRY) {
+            return RELAY_FAILED;
+        }
+        return (relay_queue_check(file) == 0) ? RELAY_WAIT : RELAY_FAILED;
+    }
+    if (file->missing) {
+        *out = NULL;
+        return RELAY_READY;
+    }
+
+    if (request->opcode != FRAME_CHECK) {
+        int wait = 0, queued = 0;
+        for (int i = 0; i < request->body.count; i++) {
+            const FrameRange *range = &request->body.ranges[i];
+            if (range->length == 0 || range->offset >= file->data->size) {
+                continue; // Rejected by prepare_response()
+            }
+            uint64_t end = (range->length > file->data->size - range->offset) ? file->data->size : range->offset + range->length;
+            for (size_t index = range->offset / RELAY_CHUNK; index * RELAY_CHUNK < end; index++) {
+                RelayChunk *chunk = &file->chunks[index];
+                if (chunk->state == CHUNK_PRESENT) {
+                    continue;
+                }
+                if (chunk->state == CHUNK_ABSENT) {
+                    if (chunk->failed_at > 0 && now - chunk->failed_at < RELAY_RETRY) {
+                        return RELAY_FAILED;
+                    }
+                    if (relay_queue_fetch(file, index) == -1) {
+                        return RELAY_FAILED;
+                    }
+                    queued = 1;
+                } else if (first) {
+                    relay.coalesced++; // Someone else's fetch will bring it
+                }
+                wait = 1;
+            }
+        }
+        if (first) {
+            if (wait || queued) {
+                relay.misses++;
+            } else {
+                relay.hits++;
+            }
+        }
+        if (wait) {
+            return RELAY_WAIT;
+        }
+        for (int i = 0; i < request->body.count; i++) {
+            const FrameRange *range = &request->body.ranges[i];
+            if (range->length == 0 || range->offset >= file->data->size) {
+                continue;
+            }
+            uint64_t end = (range->length > file->data->size - range->offset) ? file->data->size : range->offset + range->length;
+            for (size_t index = range->offset / RELAY_CHUNK; index * RELAY_CHUNK < end; index++) {
+                relay_lru_unlink(&file->chunks[index]);
+                relay_lru_push_front(&file->chunks[index]);
+            }
+        }
+    }
+    file->data->refs++;
+    *out = file->data;
+    return RELAY_READY;
+}
+
+// Apply the results of finished jobs. Called by the event loop when the eventfd fires.
+void relay_apply_jobs(void)
+{
+    uint64_t count;
+    if (read(relay.event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("Failed to read relay eventfd");
+    }
+    pthread_mutex_lock(&relay.lock);
+    RelayJob *job = relay.done;
+    relay.done = NULL;
+    pthread_mutex_unlock(&relay.lock);
+
+    double now = now_seconds();
+    while (job) {
+        RelayJob *next = job->next;
+        RelayFile *file = job->file;
+        if (job->opcode == FRAME_CHECK) {
+            file->checking = 0;
+            if (job->status == STATUS_OK) {
+                // A new size or mtime means the upstream file changed: start over with an empty copy
+                if (file->missing || !file->data || file->data->size != job->size || (uint64_t)file->data->mtime.tv_sec != job->mtime) {
+                    if (relay_new_data(file, job->size, job->mtime) == -1) {
+                        // The last copy is stale and there is no new one: fail requests until the retry delay
+                        relay_drop_data(file);
+                        file->known = 0;
+                        job->status = -1;
+                    }
+                }
+            } else if (job->status == STATUS_NOT_FOUND) {
+                relay_drop_data(file);
+            }
+            if (job->status == STATUS_OK || job->status == STATUS_NOT_FOUND) {
+                file->known = 1;
+                file->missing = (job->status == STATUS_NOT_FOUND);
+                file->checked_at = now;
+            } else if (file->known) {
+                file->checked_at = now; // Keep serving the last known copy until the next TTL
+            } else {
+                file->failed_at = now;
+                relay.failures++;
+            }
+        } else {
+            // A result for an older copy of the file is dropped
+            RelayChunk *chunk = (job->data == file->data) ? &file->chunks[job->chunk] : NULL;
+            if (chunk) {
+                file->fetching--;
+            }
+            if (chunk && job->status == STATUS_OK) {
+                relay_make_room(job->length);
+                chunk->state = CHUNK_PRESENT;
+                relay_lru_push_front(chunk);
+                relay.cached += job->length;
+                relay.fetched_bytes += job->length;
+            } else if (chunk) {
+                chunk->state = CHUNK_ABSENT;
+                chunk->failed_at = now;
+                relay.failures++;
+                if (job->status == STATUS_INVALID_RANGE || job->status == STATUS_NOT_FOUND) {
+                    file->checked_at = 0; // The upstream file changed under us: the next CHECK revalidates
+                }
+            }
+            file_cache_release(job->data);
+        }
+        free(job);
+        job = next;
+    }
+}
+
+// Send one request frame and read the reply header. Returns -1 if the connection failed.
+int upstream_request(int sock, int opcode, const char *name, uint64_t offset, uint64_t length, FrameHeader *reply)
+{
+    unsigned char frame[FRAME_HEADER_SIZE + FRAME_MAX_NAME];
+    FrameHeader header = {
+        .version = FRAME_VERSION, .opcode = opcode, .name_len = strlen(name), .offset = offset, .length = length,
+        .flags = (opcode == FRAME_GET) ? FRAME_FLAG_CRC32C : 0
+    };
+    frame_encode(&header, frame);
+    memcpy(frame + FRAME_HEADER_SIZE, name, header.name_len);
+    unsigned char raw[FRAME_HEADER_SIZE];
+    if (send_all(sock, (char *)frame, FRAME_HEADER_SIZE + header.name_len, 0) == -1 || recv_all(sock, raw, FRAME_HEADER_SIZE) == -1
+        || frame_decode(raw, reply) == -1 || reply->opcode != opcode) {
+        return -1;
+    }
+    return 0;
+}
+
+// Run one job on an upstream connection. Returns -1 if the connection failed or sent corrupt data, so the
+// job should be retried on another upstream.
+int relay_run_job(int sock, RelayJob *job, char *buffer)
+{
+    FrameHeader reply;
+    if (upstream_request(sock, job->opcode, job->file->name, job->offset, job->length, &reply) == -1) {
+        return -1;
+    }
+    job->status = reply.status;
+    if (reply.status != STATUS_OK) {
+        return 0;
+    }
+    if (job->opcode == FRAME_CHECK) {
+        job->size = reply.length;
+        job->mtime = reply.offset;
+        return 0;
+    }
+
+    static __thread uint32_t crcs[CHECKSUM_MAX_BLOCKS];
+    size_t blocks = (job->length + CHECKSUM_BLOCK - 1) / CHECKSUM_BLOCK;
+    int checked = (reply.flags & FRAME_FLAG_CRC32C) != 0;
+    if (reply.length != job->length || (checked && recv_all(sock, crcs, 4 * blocks) == -1) || recv_all(sock, buffer, job->length) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; checked && i < blocks; i++) {
+        size_t bytes = (job->length - i * CHECKSUM_BLOCK > CHECKSUM_BLOCK) ? CHECKSUM_BLOCK : job->length - i * CHECKSUM_BLOCK;
+        if (crc32c(0, buffer + i * CHECKSUM_BLOCK, bytes) != be32toh(crcs[i])) {
+            fprintf(stderr, "Relay: checksum mismatch in %s at offset %" PRIu64 "\n", job->file->name, job->offset + i * CHECKSUM_BLOCK);
+            return -1;
+        }
+    }
+    for (size_t written = 0; written < job->length;) {
+        ssize_t bytes = pwrite(job->data->fd, buffer + written, job->length - written, job->offset + written);
+        if (bytes <= 0) {
+            perror("Failed to write relay cache file");
+            job->status = -1;
+            return 0;
+        }
+        written += bytes;
+    }
+    return 0;
+}
+
+int connect_upstream(const Upstream *upstream)
+{
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    struct timeval timeout = { RELAY_TIMEOUT, 0 }; // A stalled upstream fails the job instead of a fetcher
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(upstream->port) };
+    inet_pton(AF_INET, upstream->ip, &addr.sin_addr);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "Relay: unable to connect to %s:%d\n", upstream->ip, upstream->port);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Fetcher thread: keeps one connection to an upstream and runs jobs on it, failing over to the next upstream
+// when it breaks. Fetchers start on different upstreams to spread the load.
+void *run_fetcher(void *arg)
+{
+    int upstream = (intptr_t)arg % relay.upstream_count;
+    int sock = -1;
+    char *buffer = pool_get(RELAY_CHUNK);
+    if (!buffer) {
+        perror("Failed to allocate fetch buffer");
+        exit(EXIT_FAILURE);
+    }
+    while (1) {
+        pthread_mutex_lock(&relay.lock);
+        while (!relay.jobs) {
+            pthread_cond_wait(&relay.cond, &relay.lock);
+        }
+        RelayJob *job = relay.jobs;
+        relay.jobs = job->next;
+        if (!relay.jobs) {
+            relay.jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&relay.lock);
+
+        job->status = -1;
+        for (int attempt = 0; attempt < relay.upstream_count; attempt++) {
+            int reused = (sock != -1);
+            if (sock == -1) {
+                sock = connect_upstream(&relay.upstreams[upstream]);
+            }
+            if (sock != -1 && relay_run_job(sock, job, buffer) == 0) {
+                break;
+            }
+            if (sock != -1) {
+                close(sock);
+                sock = -1;
+            }
+            if (reused) {
+                attempt--; // An idle connection may have been closed by a restarted upstream: reconnect before giving up on it
+            } else {
+                upstream = (upstream + 1) % relay.upstream_count;
+            }
+        }
+        LOG_DEBUG("Relay %s: %s offset %" PRIu64 ", status %d\n", (job->opcode == FRAME_CHECK) ? "CHECK" : "GET", job->file->name, job->offset, job->status);
+
+        pthread_mutex_lock(&relay.lock);
+        job->next = relay.done;
+        relay.done = job;
+        pthread_mutex_unlock(&relay.lock);
+        uint64_t one = 1;
+        if (write(relay.event_fd, &one, sizeof(one)) == -1) {
+            perror("Failed to signal relay eventfd");
+        }
+    }
+    return NULL;
+}
+
+// Load the upstream list (same "<ip> <port>" lines as a client's server-info.txt), empty the cache directory of
+// an earlier run's files and start the fetchers
+void relay_init(const char *upstream_file)
+{
+    FILE *file = fopen(upstream_file, "r");
+    if (!file) {
+        perror("Upstream info file open failed");
+        exit(EXIT_FAILURE);
+    }
+    Upstream upstream;
+    int capacity = 0;
+    while (fscanf(file, "%63s %d", upstream.ip, &upstream.port) == 2) {
+        if (relay.upstream_count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            relay.upstreams = realloc(relay.upstreams, capacity * sizeof(Upstream));
+            if (!relay.upstreams) {
+                perror("Failed to allocate upstream list");
+                exit(EXIT_FAILURE);
+            }
+        }
+        relay.upstreams[relay.upstream_count++] = upstream;
+    }
+    fclose(file);
+    if (relay.upstream_count == 0) {
+        fprintf(stderr, "No upstream servers in %s\n", upstream_file);
+        exit(EXIT_FAILURE);
+    }
+
+    if (mkdir(relay.dir, 0700) == -1 && errno != EEXIST) {
+        perror("Failed to create relay cache directory");
+        exit(EXIT_FAILURE);
+    }
+    DIR *dir = opendir(relay.dir);
+    if (!dir) {
+        perror("Failed to open relay cache directory");
+        exit(EXIT_FAILURE);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        size_t len = strlen(entry->d_name);
+        if (len > 6 && strcmp(entry->d_name + len - 6, ".cache") == 0) {
+            unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+
+    relay.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (relay.event_fd == -1) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
+    }
+    for (intptr_t i = 0; i < RELAY_FETCHERS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, run_fetcher, (void *)i) != 0) {
+            perror("Failed to start a fetcher thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    relay.enabled = 1;
+}
+
+void relay_report(void)
+{
+    if (!relay.enabled) {
+        return;
+    }
+    fprintf(stderr, "relay: %lu hits, %lu misses, %lu coalesced, %lu checks, %lu fetches (%.1f MB), %lu failures, %lu evictions, %.1f/%.1f MB cached\n",
+            relay.hits, relay.misses, relay.coalesced, relay.checks, relay.fetches, relay.fetched_bytes / 1048576.0,
+            relay.failures, relay.evictions, relay.cached / 1048576.0, relay.budget / 1048576.0);
+}
+
+// Outcome of validating one request, shared by all server modes
+typedef struct {
+    int hang_up; // Malformed legacy request, or relay mode with no upstream to answer: close without a reply
+    int wait; // Relay mode: upstream data is on its way, prepare the request again once it has arrived
+    char header[64]; // Reply header: a frame or a status line, empty for a legacy GET
+    size_t header_len;
+    CachedFile *file; // GET only: body source, released by the caller once sent
+    RangeList body; // GET only: ranges of file to send after the header
+    Listing *listing; // LIST and STAT only: holds the entries, released by the caller once sent
+    const char *entries; // Entries to send after the header, encoded for the connection's protocol
+    size_t entries_len;
+} Response;
+
+// Write the CRC32C of each CHECKSUM_BLOCK of a range to out, big-endian; returns the bytes written.
+// A block that cannot be read gets 0, so the client sees a mismatch and fetches it again.
+size_t checksum_range(const CachedFile *file, const FrameRange *range, char *out)
+{
+    static char block[CHECKSUM_BLOCK];
+    size_t count = 0;
+    for (uint64_t done = 0; done < range->length; done += CHECKSUM_BLOCK) {
+        size_t bytes = (range->length - done > CHECKSUM_BLOCK) ? CHECKSUM_BLOCK : range->length - done;
+        uint32_t crc = (pread(file->fd, block, bytes, range->offset + done) == (ssize_t)bytes) ? crc32c(0, block, bytes) : 0;
+        crc = htobe32(crc);
+        memcpy(out + 4 * count++, &crc, 4);
+    }
+    return 4 * count;
+}
+
+// Start sending the next range of a GET: append its range header (GET_RANGES only) and checksums (if asked for)
+// to header + *header_len and return where its data starts and how long it is. Returns 0 once every range has
+// been started.
+int start_next_range(RangeList *body, const CachedFile *file, char *header, size_t *header_len, off_t *offset, size_t *length)
+{
+    if (body->next == body->count) {
+        return 0;
+    }
+    FrameRange *range = &body->ranges[body->next++];
+    if (body->headers) {
+        range_encode(range, (unsigned char *)header + *header_len);
+        *header_len += FRAME_RANGE_SIZE;
+    }
+    if (body->checksums) {
+        *header_len += checksum_range(file, range, header + *header_len);
+    }
+    *offset = range->offset;
+    *length = range->length;
+    return 1;
+}
+
+// Encode a reply header: a binary frame, or a status line ("OK <n>" or "ERROR <message>") that is
+// newline-terminated on persistent text connections. <value> is the file size for CHECK, the body length for GET.
+size_t format_reply(Protocol protocol, const Request *request, int status, size_t value, char *out, size_t size)
+{
+    if (protocol == PROTO_BINARY) {
+        FrameHeader header = {
+            .version = FRAME_VERSION, .opcode = request->opcode, .status = status,
+            .request_id = request->request_id, .offset = request->offset, .length = value,
+            .flags = (status == STATUS_OK && request->body.checksums) ? FRAME_FLAG_CRC32C : 0
+        };
+        frame_encode(&header, (unsigned char *)out);
+        return FRAME_HEADER_SIZE;
+    }
+
+    const char *terminator = (protocol == PROTO_TEXT) ? "\n" : "";
+    if (status == STATUS_OK) {
+        return snprintf(out, size, "OK %zu%s", value, terminator);
+    }
+    return snprintf(out, size, "ERROR %s%s", status_message(status), terminator);
+}
+
+// CHECK replies also carry the file's modification time, so a client resuming a download can tell whether its
+// partial copy is still current: in the offset field of a frame, or after the size on a text status line.
+// Legacy replies stay "OK <size>".
+size_t format_check_reply(Protocol protocol, const Request *request, const CachedFile *file, char *out, size_t size)
+{
+    if (protocol == PROTO_BINARY) {
+        FrameHeader header = {
+            .version = FRAME_VERSION, .opcode = FRAME_CHECK, .status = STATUS_OK,
+            .request_id = request->request_id, .offset = file->mtime.tv_sec, .length = file->size
+        };
+        frame_encode(&header, (unsigned char *)out);
+        return FRAME_HEADER_SIZE;
+    }
+    if (protocol == PROTO_TEXT) {
+        return snprintf(out, size, "OK %zu %lld\n", file->size, (long long)file->mtime.tv_sec);
+    }
+    return format_reply(protocol, request, STATUS_OK, file->size, out, size);
+}
+
+// LIST and STAT replies give the number of entries and the bytes of entries that follow: in the offset and length
+// fields of a frame, or as "OK <bytes> <count>" on a text status line
+size_t format_listing_reply(Protocol protocol, const Request *request, const Listing *listing, size_t len, char *out, size_t size)
+{
+    if (protocol == PROTO_BINARY) {
+        FrameHeader header = {
+            .version = FRAME_VERSION, .opcode = request->opcode, .status = STATUS_OK,
+            .request_id = request->request_id, .offset = listing->count, .length = len
+        };
+        frame_encode(&header, (unsigned char *)out);
+        return FRAME_HEADER_SIZE;
+    }
+    return snprintf(out, size, "OK %zu %zu%s", len, listing->count, (protocol == PROTO_TEXT) ? "\n" : "");
+}
+
+// Check a request against the file cache, or the local copies in relay mode, and encode its reply header. Legacy GETs send the raw bytes only.
+void prepare_response(const Request *request, Protocol protocol, Response *response)
+{
+    memset(response, 0, sizeof(*response));
+    if (!request->waited) {
+        counter_add(&counters.requests, 1);
+    }
+    if (request->status != STATUS_OK) {
+        response->hang_up = (protocol == PROTO_LEGACY);
+        response->header_len = format_reply(protocol, request, request->status, 0, response->header, sizeof(response->header));
+        return;
+    }
+
+    if ((request->opcode == FRAME_LIST || request->opcode == FRAME_STAT || request->opcode == FRAME_SIGNATURES) && relay.enabled) {
+        response->header_len = format_reply(protocol, request, STATUS_INVALID_REQUEST, 0, response->header, sizeof(response->header));
+        return;
+    }
+    if (request->opcode == FRAME_ANNOUNCE) {
+        Listing *listing = swarm_announce(request->filename, request->paths);
+        if (!listing) {
+            response->header_len = format_reply(protocol, request, STATUS_INVALID_REQUEST, 0, response->header, sizeof(response->header));
+            return;
+        }
+        response->listing = listing;
+        response->entries = listing->body[0];
+        response->entries_len = listing->body_len[0];
+        response->header_len = format_listing_reply(protocol, request, listing, response->entries_len, response->header, sizeof(response->header));
+        return;
+    }
+    if (request->opcode == FRAME_LIST || request->opcode == FRAME_STAT) {
+        Listing *listing = (request->opcode == FRAME_LIST) ? listing_cache_acquire(request->filename)
+                                                           : stat_paths(request->filename, request->paths);
+        if (!listing) {
+            response->header_len = format_reply(protocol, request, STATUS_NOT_FOUND, 0, response->header, sizeof(response->header));
+            return;
+        }
+        int text = (protocol != PROTO_BINARY);
+        LOG_DEBUG("%s request: %s (%zu entries)\n", (request->opcode == FRAME_LIST) ? "LIST" : "STAT", request->filename, listing->count);
+        response->listing = listing;
+        response->entries = listing->body[text];
+        response->entries_len = listing->body_len[text];
+        response->header_len = format_listing_reply(protocol, request, listing, response->entries_len, response->header, sizeof(response->header));
+        return;
+    }
+
+    CachedFile *file = NULL;
+    if (relay.enabled) {
+        int state = relay_acquire(request, !request->waited, &file);
+        if (state != RELAY_READY) {
+            response->wait = (state == RELAY_WAIT);
+            response->hang_up = (state == RELAY_FAILED);
+            return;
+        }
+    } else {
+        file = file_cache_acquire(request->filename);
+    }
+    if (!file) {
+        response->header_len = format_reply(protocol, request, STATUS_NOT_FOUND, 0, response->header, sizeof(response->header));
+        return;
+    }
+
+    if (request->opcode == FRAME_CHECK) {
+        LOG_DEBUG("CHECK request: OK %zu\n", file->size);
+        response->header_len = format_check_reply(protocol, request, file, response->header, sizeof(response->header));
+        file_cache_release(file);
+        return;
+    }
+    if (request->opcode == FRAME_SIGNATURES) {
+        Listing *listing = sign_blocks(file, request->offset, request->length);
+        file_cache_release(file);
+        if (!listing) {
+            response->header_len = format_reply(protocol, request, STATUS_INVALID_RANGE, 0, response->header, sizeof(response->header));
+            return;
+        }
+        LOG_DEBUG("SIGNATURES request: %s (offset: %zu, length: %zu, %zu blocks)\n", request->filename, request->offset, request->length, listing->count);
+        response->listing = listing;
+        response->entries = listing->body[0];
+        response->entries_len = listing->body_len[0];
+        response->header_len = format_listing_reply(protocol, request, listing, response->entries_len, response->header, sizeof(response->header));
+        return;
+    }
+
+    // Every range must lie inside the file before any data is sent, and fit its checksums in the reply header
+    for (int i = 0; i < request->body.count; i++) {
+        const FrameRange *range = &request->body.ranges[i];
+        if (range->length == 0 || range->offset >= file->size || range->length > file->size - range->offset
+            || (request->body.checksums && range->length > (uint64_t)CHECKSUM_MAX_BLOCKS * CHECKSUM_BLOCK)) {
+            fprintf(stderr, "Invalid chunk_size: %" PRIu64 ", offset: %" PRIu64 ", file size: %zu\n", range->length, range->offset, file->size);
+            file_cache_release(file);
+            response->header_len = format_reply(protocol, request, STATUS_INVALID_RANGE, 0, response->header, sizeof(response->header));
+            return;
+        }
+    }
+
+    // The length header lets the client find the end of the data without the server closing the connection
+    if (protocol != PROTO_LEGACY) {
+        response->header_len = format_reply(protocol, request, STATUS_OK, request->length, response->header, sizeof(response->header));
+    }
+    response->file = file;
+    response->body = request->body;
+    LOG_DEBUG("GET request: %s (offset: %zu, chunk_size: %zu, ranges: %d)\n", request->filename, request->body.ranges[0].offset, request->body.ranges[0].length, request->body.count);
+}
+
+// Send [offset, offset + chunk_size) of a file on a blocking socket. Returns -1 on failure.
+int send_range(int client_socket, CachedFile *file, size_t offset, size_t chunk_size, char *buffer, TokenBucket *conn_bucket)
+{
+    size_t bytes_remaining = chunk_size;
+
+    // Zero-copy path: hand [offset, offset + chunk_size) to the kernel buffer_size bytes at a time
+    off_t file_offset = offset;
+    SplicePipe pipe_state;
+    splice_pipe_init(&pipe_state);
+    while (data_path != DATA_COPY && bytes_remaining > 0) {
+        size_t bytes_to_send = shaped_acquire(conn_bucket, (bytes_remaining > buffer_size) ? buffer_size : bytes_remaining);
+        ssize_t bytes_sent = zero_copy_send(client_socket, file->fd, &file_offset, bytes_to_send, &pipe_state, 0);
+        if (bytes_sent <= 0) {
+            perror("Error sending data to client");
+            splice_pipe_close(&pipe_state);
+            return -1;
+        }
+        shaped_consume(conn_bucket, bytes_sent);
+
+        bytes_remaining -= bytes_sent;
+        LOG_DEBUG("Sent chunk (offset: %zu, chunk_size: %zu) - progress: %zu / %zu\n", offset, chunk_size, chunk_size - bytes_remaining, chunk_size);
+    }
+    splice_pipe_close(&pipe_state);
+
+    // Buffered path: pread() at the running offset, since the cached descriptor is shared. Only the bytes read
+    // are sent, so the buffer is never cleared.
+    while (bytes_remaining > 0) {
+        size_t bytes_to_read = (bytes_remaining > buffer_size) ? buffer_size : bytes_remaining;
+        ssize_t bytes_read = pread(file->fd, buffer, bytes_to_read, file_offset);
+
+        if (bytes_read <= 0) {
+            if (bytes_read == 0) {
+                fprintf(stderr, "End of file reached (offset: %ld, remaining: %zu bytes)\n", file_offset, bytes_remaining);
+            } else {
+                perror("Error reading from file");
+            }
+            return -1; // A short body would desynchronize a persistent stream
+        }
+        file_offset += bytes_read;
+
+        size_t bytes_to_send = bytes_read;
+        size_t bytes_sent_total = 0;
+        while (bytes_to_send > 0) {
+            size_t allowance = shaped_acquire(conn_bucket, bytes_to_send);
+            ssize_t bytes_sent = write(client_socket, buffer + bytes_sent_total, allowance);
+            if (bytes_sent <= 0) {
+                perror("Error sending data to client");
+                return -1;
+            } else {
+                bytes_to_send -= bytes_sent;
+                bytes_sent_total += bytes_sent;
+                shaped_consume(conn_bucket, bytes_sent);
+            }
+        }
+
+        bytes_remaining -= bytes_read;
+        LOG_DEBUG("Sent chunk (offset: %zu, chunk_size: %zu) - progress: %zu / %zu\n", offset, chunk_size, chunk_size - bytes_remaining, chunk_size);
+    }
+    return 0;
+}
+
+
+// Reply to one request on a blocking socket. Returns -1 if the connection must be closed.
+int serve_request(int client_socket, const Request *request, Protocol protocol, char *buffer, TokenBucket *conn_bucket)
+{
+    Response response;
+    prepare_response(request, protocol, &response);
+    if (response.hang_up) {
+        return -1;
+    }
+    if (response.listing) {
+        // Corked, so a small listing leaves in one segment instead of waiting for the header's delayed ACK
+        int status = (send_all(client_socket, response.header, response.header_len, response.entries_len ? MSG_MORE : 0) == -1
+                      || send_all(client_socket, response.entries, response.entries_len, 0) == -1) ? -1 : 0;
+        listing_release(response.listing);
+        return status;
+    }
+    if (send_all(client_socket, response.header, response.header_len, 0) == -1) {
+        if (response.file) {
+            file_cache_release(response.file);
+        }
+        return -1;
+    }
+    if (!response.file) {
+        return 0;
+    }
+
+    // One sendfile()/splice() stream per range; GET_RANGES puts a range header in front of each, checked GETs
+    // the range's checksums
+    char range_header[FRAME_RANGE_SIZE + 4 * CHECKSUM_MAX_BLOCKS];
+    size_t range_header_len = 0;
+    off_t offset;
+    size_t length;
+    int status = 0;
+    while (status == 0 && start_next_range(&response.body, response.file, range_header, &range_header_len, &offset, &length)) {
+        if (send_all(client_socket, range_header, range_header_len, 0) == -1) {
+            status = -1;
+        } else {
+            status = send_range(client_socket, response.file, offset, length, buffer, conn_bucket);
+        }
+        range_header_len = 0;
+    }
+    file_cache_release(response.file);
+    return status;
+}
+
+// Blocking mode serves one connection at a time, so a keep-alive connection with no request pending gives way once
+// another client has been waiting in the listen backlog for YIELD_GRACE. Returns 1 if it should give way, 0 once it
+// has a request to read.
+int should_yield(int client_socket, int server_socket)
+{
+    struct pollfd fds[2] = { { .fd = client_socket, .events = POLLIN }, { .fd = server_socket, .events = POLLIN } };
+    int timeout = -1;
+    while (1) {
+        int ready = poll(fds, timeout == -1 ? 2 : 1, timeout);
+        if (ready == -1 && errno == EINTR) {
+            report_if_requested();
+            continue;
+        }
+        if (ready == -1 || fds[0].revents) {
+            return 0; // recv() reports errors and hang-ups
+        }
+        if (timeout != -1) {
+            return 1; // Still nothing from the client after the grace period
+        }
+        timeout = YIELD_GRACE; // Someone is waiting: give the client a moment to send its next request
+    }
+}
+
+// Close a connection that gave way without losing the replies it was sent: stop sending, then discard the requests
+// that were already on their way until the client hangs up, so that closing does not reset the connection. The
+// client reads its replies, finds the end of the stream instead of the next one and reconnects.
+void linger_close(int client_socket)
+{
+    char discard[REQUEST_SIZE];
+    shutdown(client_socket, SHUT_WR);
+    double deadline = now_seconds() + YIELD_LINGER / 1000.0;
+    struct pollfd fd = { .fd = client_socket, .events = POLLIN };
+    double left;
+    while ((left = deadline - now_seconds()) > 0 && poll(&fd, 1, (int)(left * 1000) + 1) > 0
+           && recv(client_socket, discard, sizeof(discard), 0) > 0) {
+    }
+    close(client_socket);
+}
+
+// Serve requests back to back until the client hangs up or gives way to a waiting client; a legacy connection gets
+// one reply and is closed
+void handle_client(int client_socket, int server_socket)
+{
+    char *buffer = pool_get(buffer_size);
+    if (!buffer) {
+        perror("Failed to allocate send buffer");
+        close(client_socket);
+        return;
+    }
+    char request_buffer[REQUEST_SIZE];
+    size_t request_len = 0;
+    Protocol protocol = PROTO_NONE;
+    Request request;
+    TokenBucket conn_bucket;
+    bucket_init(&conn_bucket, conn_rate, conn_burst);
+
+    while (1) {
+        int taken = take_request(request_buffer, &request_len, &protocol, &request);
+        if (taken == -1) {
+            break;
+        }
+        if (taken == 0) {
+            if (request_len == 0 && should_yield(client_socket, server_socket)) {
+                LOG_DEBUG("Another client is waiting, closing an idle connection\n");
+                linger_close(client_socket);
+                pool_put(buffer, buffer_size);
+                return;
+            }
+
+            // Receive the request
+            ssize_t bytes_read = recv(client_socket, request_buffer + request_len, sizeof(request_buffer) - 1 - request_len, 0);
+            if (bytes_read <= 0) {
+                if (bytes_read < 0) {
+                    perror("recv failed");
+                }
+                break;
+            }
+            request_len += bytes_read;
+            continue;
+        }
+
+        if (serve_request(client_socket, &request, protocol, buffer, &conn_bucket) == -1 || protocol == PROTO_LEGACY) {
+            break;
+        }
+    }
+
+    pool_put(buffer, buffer_size);
+    close(client_socket);
+}
+
+// Per-connection state machine for epoll mode: read a request, drain its response, repeat unless legacy
+typedef enum {
+    CONN_READ_REQUEST,
+    CONN_SEND_HEADER,
+    CONN_SEND_FILE,
+    CONN_SEND_ENTRIES,
+    CONN_WAIT_RELAY // Relay mode: parked off every event until upstream data for its request arrives
+} ConnState;
+
+typedef struct Connection {
+    int sock;
+    ConnState state;
+    Protocol protocol; // Set by the first request; every protocol but PROTO_LEGACY keeps the connection open
+    char request[REQUEST_SIZE]; // Received bytes, possibly several pipelined requests
+    size_t request_len;
+    char header[REQUEST_SIZE]; // Reply header (status line or frame) sent before any file data
+    size_t header_len;
+    size_t header_sent;
+    CachedFile *file; // Held only while a GET body is pending
+    RangeList body; // Ranges of the pending GET
+    Listing *listing; // Held only while LIST or STAT entries are pending
+    const char *entries;
+    size_t entries_len;
+    size_t entries_sent;
+    off_t file_offset; // Next byte of the file to stage
+    size_t bytes_remaining; // Bytes of the current range not yet staged (DATA_COPY) or not yet sent (zero-copy)
+    char *buffer; // DATA_COPY only: staged file bytes not yet written to the socket
+    size_t buffer_len;
+    size_t buffer_sent;
+    SplicePipe pipe_state;
+    TokenBucket bucket;
+    int throttled; // Parked off EPOLLOUT until wake_at because a bucket ran dry
+    double wake_at;
+    struct Connection *next_throttled;
+    Request parked; // CONN_WAIT_RELAY: the request to prepare again
+    struct Connection *next_parked;
+} Connection;
+
+Connection *throttled_head = NULL;
+Connection *parked_head = NULL;
+
+void unlink_parked(Connection *conn)
+{
+    for (Connection **link = &parked_head; *link; link = &(*link)->next_parked) {
+        if (*link == conn) {
+            *link = conn->next_parked;
+            break;
+        }
+    }
+}
+
+void unlink_throttled(Connection *conn)
+{
+    for (Connection **link = &throttled_head; *link; link = &(*link)->next_throttled) {
+        if (*link == conn) {
+            *link = conn->next_throttled;
+            break;
+        }
+    }
+    conn->throttled = 0;
+}
+
+void close_connection(int epoll_fd, Connection *conn)
+{
+    if (conn->throttled) {
+        unlink_throttled(conn);
+    }
+    if (conn->state == CONN_WAIT_RELAY) {
+        unlink_parked(conn);
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+    close(conn->sock);
+    if (conn->file) {
+        file_cache_release(conn->file);
+    }
+    if (conn->listing) {
+        listing_release(conn->listing);
+    }
+    splice_pipe_close(&conn->pipe_state);
+    pool_put(conn->buffer, REACTOR_CHUNK);
+    free(conn);
+}
+
+// Switch a connection from reading to writing its response
+void want_write(int epoll_fd, Connection *conn, ConnState state)
+{
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = conn };
+    conn->state = state;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->sock, &event);
+}
+
+// Stop polling a connection for writability until its bucket has refilled
+void throttle(int epoll_fd, Connection *conn, double wait)
 {
-    char buffer[BUFFER_SIZE];
-    bzero(buffer, BUFFER_SIZE);
+    struct epoll_event event = { .events = 0, .data.ptr = conn };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->sock, &event);
+    conn->wake_at = now_seconds() + wait;
+    if (!conn->throttled) {
+        conn->throttled = 1;
+        conn->next_throttled = throttled_head;
+        throttled_head = conn;
+    }
+}
 
-    // Receive the request
-    size_t bytes_read = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes_read <= 0 || bytes_read >= BUFFER_SIZE) {
-        perror("recv failed or buffer overflow\n");
-        close(client_socket);
-        return;
+// Stop polling a connection until relay_apply_jobs() has brought in what its request waits for
+void park(int epoll_fd, Connection *conn, const Request *request)
+{
+    struct epoll_event event = { .events = 0, .data.ptr = conn };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->sock, &event);
+    if (request != &conn->parked) {
+        conn->parked = *request;
     }
-    buffer[bytes_read] = '\0';
+    conn->parked.waited = 1;
+    conn->state = CONN_WAIT_RELAY;
+    conn->next_parked = parked_head;
+    parked_head = conn;
+}
 
-    // Parse the request (format: CHECK <filename> or GET <filename> <offset> <chunk_size>)
-    char command[10], filename[256];
-    size_t offset, chunk_size;
-    int params = sscanf(buffer, "%9s %255s %zu %zu", command, filename, &offset, &chunk_size);
-    bzero(buffer, BUFFER_SIZE);
+// Validate a complete request and set up the response, mirroring serve_request()
+void start_response(int epoll_fd, Connection *conn, const Request *request)
+{
+    Response response;
+    prepare_response(request, conn->protocol, &response);
+    if (response.hang_up) {
+        close_connection(epoll_fd, conn);
+        return;
+    }
+    if (response.wait) {
+        park(epoll_fd, conn, request);
+        return;
+    }
+    memcpy(conn->header, response.header, response.header_len);
+    conn->header_len = response.header_len;
+    conn->header_sent = 0;
+    conn->listing = response.listing;
+    conn->entries = response.entries;
+    conn->entries_len = response.entries_len;
+    conn->entries_sent = 0;
+    if (!response.file) {
+        want_write(epoll_fd, conn, CONN_SEND_HEADER);
+        return;
+    }
 
-    if (strcmp(command, "CHECK") == 0) {
-        if (params < 2) {
-            fprintf(stderr, "Invalid CHECK request: params=%d\n", params);
-            write(client_socket, buffer, strlen(buffer));
-            close(client_socket);
+    if (data_path == DATA_COPY && !conn->buffer) {
+        conn->buffer = pool_get(REACTOR_CHUNK); // Recycled from closed connections
+        if (!conn->buffer) {
+            perror("Failed to allocate connection buffer");
+            file_cache_release(response.file);
+            close_connection(epoll_fd, conn);
             return;
         }
-    } else if (strcmp(command, "GET") == 0) {
-        if (params < 4 || chunk_size <= 0) {
-            fprintf(stderr, "Invalid GET request: params=%d, chunk_size=%zu\n", params, chunk_size);
-            write(client_socket, buffer, strlen(buffer));
-            close(client_socket);
+    }
+    conn->file = response.file;
+    conn->body = response.body;
+    start_next_range(&conn->body, conn->file, conn->header, &conn->header_len, &conn->file_offset, &conn->bytes_remaining);
+    conn->buffer_len = conn->buffer_sent = 0;
+    want_write(epoll_fd, conn, conn->header_len ? CONN_SEND_HEADER : CONN_SEND_FILE);
+}
+
+// Start on the next buffered request, if a complete one is available
+void next_request(int epoll_fd, Connection *conn)
+{
+    Request request;
+    int taken = take_request(conn->request, &conn->request_len, &conn->protocol, &request);
+    if (taken == -1) {
+        close_connection(epoll_fd, conn);
+    } else if (taken == 1) {
+        start_response(epoll_fd, conn, &request);
+    }
+}
+
+// The current range is fully sent: move on to the next range of a GET_RANGES, close a legacy connection,
+// or go back for the next request
+void finish_response(int epoll_fd, Connection *conn)
+{
+    if (conn->file) {
+        conn->header_len = conn->header_sent = 0;
+        if (start_next_range(&conn->body, conn->file, conn->header, &conn->header_len, &conn->file_offset, &conn->bytes_remaining)) {
+            want_write(epoll_fd, conn, CONN_SEND_HEADER);
             return;
         }
-    } else {
-        fprintf(stderr, "Unknown command: %s\n", command);
-        write(client_socket, buffer, strlen(buffer));
-        close(client_socket);
+        file_cache_release(conn->file);
+        conn->file = NULL;
+    }
+    if (conn->protocol == PROTO_LEGACY) {
+        close_connection(epoll_fd, conn);
         return;
     }
 
-    fprintf(stderr, "1) passed received request check\n");
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+    conn->state = CONN_READ_REQUEST;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->sock, &event);
+    next_request(epoll_fd, conn); // Pipelined requests may already be buffered
+}
 
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        snprintf(buffer, BUFFER_SIZE, "ERROR File not found");
-        write(client_socket, buffer, strlen(buffer));
-        close(client_socket);
+void on_readable(int epoll_fd, Connection *conn)
+{
+    ssize_t bytes_read = recv(conn->sock, conn->request + conn->request_len, sizeof(conn->request) - 1 - conn->request_len, 0);
+    if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (bytes_read <= 0) {
+        close_connection(epoll_fd, conn);
         return;
     }
+    conn->request_len += bytes_read;
+    next_request(epoll_fd, conn);
+}
 
-    fprintf(stderr, "2) passed opening file\n");
+void on_writable(int epoll_fd, Connection *conn)
+{
+    if (conn->state == CONN_SEND_HEADER) {
+        while (conn->header_sent < conn->header_len) {
+            int more = (conn->listing && conn->entries_len) ? MSG_MORE : 0; // Entries follow in the same segment
+            ssize_t bytes_sent = send(conn->sock, conn->header + conn->header_sent, conn->header_len - conn->header_sent, MSG_NOSIGNAL | more);
+            if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (bytes_sent <= 0) {
+                break;
+            }
+            conn->header_sent += bytes_sent;
+        }
+        if (conn->header_sent < conn->header_len) {
+            close_connection(epoll_fd, conn);
+        } else if (conn->file) {
+            conn->state = CONN_SEND_FILE; // GET: the chunk follows its length header
+            on_writable(epoll_fd, conn);
+        } else if (conn->listing) {
+            conn->state = CONN_SEND_ENTRIES;
+            on_writable(epoll_fd, conn);
+        } else {
+            finish_response(epoll_fd, conn);
+        }
+        return;
+    }
 
-    if (strcmp(command, "CHECK") == 0) {
-        fprintf(stderr, "CHECK request: processing...\n");
+    // CONN_SEND_ENTRIES: LIST and STAT entries come from memory, unshaped like reply headers
+    if (conn->state == CONN_SEND_ENTRIES) {
+        while (conn->entries_sent < conn->entries_len) {
+            ssize_t bytes_sent = send(conn->sock, conn->entries + conn->entries_sent, conn->entries_len - conn->entries_sent, MSG_NOSIGNAL);
+            if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (bytes_sent <= 0) {
+                close_connection(epoll_fd, conn);
+                return;
+            }
+            conn->entries_sent += bytes_sent;
+        }
+        listing_release(conn->listing);
+        conn->listing = NULL;
+        finish_response(epoll_fd, conn);
+        return;
+    }
 
-        // Check if file exists and get file size
-        FILE *file = fopen(filename, "rb");
-        if (file) {
-            fseek(file, 0, SEEK_END);
-            size_t file_size = ftell(file);
-            fclose(file);
+    // CONN_SEND_FILE, zero-copy: let the kernel move file pages to the socket until it would block
+    while (data_path != DATA_COPY) {
+        if (conn->bytes_remaining == 0) {
+            finish_response(epoll_fd, conn);
+            return;
+        }
+        double wait;
+        size_t step = (conn->bytes_remaining > buffer_size) ? buffer_size : conn->bytes_remaining;
+        size_t allowance = shaped_allowance(&conn->bucket, step, &wait);
+        if (allowance == 0) {
+            throttle(epoll_fd, conn, wait);
+            return;
+        }
+        ssize_t bytes_sent = zero_copy_send(conn->sock, conn->file->fd, &conn->file_offset, allowance, &conn->pipe_state, 1);
+        if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytes_sent <= 0) {
+            perror("Error sending data to client");
+            close_connection(epoll_fd, conn);
+            return;
+        }
+        shaped_consume(&conn->bucket, bytes_sent);
+        conn->bytes_remaining -= bytes_sent;
+    }
 
-            snprintf(buffer, BUFFER_SIZE, "OK %zu", file_size);
-            write(client_socket, buffer, strlen(buffer));
+    // CONN_SEND_FILE, DATA_COPY: stage the next slice of the chunk, then write until the socket would block
+    while (1) {
+        if (conn->buffer_sent == conn->buffer_len) {
+            if (conn->bytes_remaining == 0) {
+                finish_response(epoll_fd, conn);
+                return;
+            }
+            size_t bytes_to_read = (conn->bytes_remaining > REACTOR_CHUNK) ? REACTOR_CHUNK : conn->bytes_remaining;
+            ssize_t bytes_read = pread(conn->file->fd, conn->buffer, bytes_to_read, conn->file_offset);
+            if (bytes_read <= 0) {
+                perror("Error reading from file");
+                close_connection(epoll_fd, conn);
+                return;
+            }
+            conn->buffer_len = bytes_read;
+            conn->buffer_sent = 0;
+            conn->file_offset += bytes_read;
+            conn->bytes_remaining -= bytes_read;
+        }
 
-            fprintf(stderr, "CHECK request: OK %zu\n", file_size);
-        } else {
-            snprintf(buffer, BUFFER_SIZE, "ERROR File not found");
-            fprintf(stderr, "ERROR File not found");
-        }
-    } else if (strcmp(command, "GET") == 0) {
-        fprintf(stderr, "GET request: processing...\n");
-
-        // Check if file exists and get size
-        FILE *file = fopen(filename, "rb");
-        if (file) {
-            fseek(file, 0, SEEK_END);
-            size_t file_size = ftell(file);
-            rewind(file);
-
-            if (offset >= file_size || offset + chunk_size > file_size) {
-                fprintf(stderr, "Invalid chunk_size: %zu, offset: %zu, file size: %zu\n", chunk_size, offset, file_size);
-                fprintf(stderr, "offset + chunk_size = %zu\n", offset + chunk_size);
-                fclose(file);
-                exit(EXIT_FAILURE);
+        double wait;
+        size_t allowance = shaped_allowance(&conn->bucket, conn->buffer_len - conn->buffer_sent, &wait);
+        if (allowance == 0) {
+            throttle(epoll_fd, conn, wait);
+            return;
+        }
+        ssize_t bytes_sent = send(conn->sock, conn->buffer + conn->buffer_sent, allowance, MSG_NOSIGNAL);
+        if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytes_sent <= 0) {
+            perror("Error sending data to client");
+            close_connection(epoll_fd, conn);
+            return;
+        }
+        shaped_consume(&conn->bucket, bytes_sent);
+        conn->buffer_sent += bytes_sent;
+    }
+}
+
+// Single-threaded reactor: every client socket is non-blocking and driven by its Connection state
+void run_reactor(int server_socket)
+{
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+
+    fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL }; // NULL marks the listening socket
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event) == -1) {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (relay.enabled) {
+        struct epoll_event relay_event = { .events = EPOLLIN, .data.ptr = &relay }; // Fetchers finished some jobs
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, relay.event_fd, &relay_event) == -1) {
+            perror("epoll_ctl failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        // Sleep no longer than the earliest throttled connection's wake-up
+        int timeout = -1;
+        double now = now_seconds();
+        for (Connection *conn = throttled_head; conn; conn = conn->next_throttled) {
+            int conn_timeout = (conn->wake_at > now) ? (int)((conn->wake_at - now) * 1000) + 1 : 0;
+            if (timeout == -1 || conn_timeout < timeout) {
+                timeout = conn_timeout;
             }
+        }
 
-            // Seek to the offset
-            fseek(file, offset, SEEK_SET);
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        report_if_requested();
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
 
-            size_t bytes_remaining = chunk_size;
-            while (bytes_remaining > 0) {
-                bzero(buffer, BUFFER_SIZE);
-                size_t bytes_to_read = (bytes_remaining > BUFFER_SIZE) ? BUFFER_SIZE : bytes_remaining;
-                size_t bytes_read = fread(buffer, 1, bytes_to_read, file);
+        int relay_ready = 0;
+        for (int i = 0; i < ready; i++) {
+            Connection *conn = events[i].data.ptr;
 
-                if (bytes_read == 0) {
-                    if (feof(file)) {
-                        fprintf(stderr, "End of file reached (offset: %ld, remaining: %zu bytes)\n", offset, bytes_remaining);
-                    } else if (ferror(file)) {
-                        perror("Error reading from file");
+            if ((void *)conn == &relay) {
+                relay_ready = 1; // Handled below, once no other event can name a connection it closes
+                continue;
+            }
+            if (!conn) {
+                // Accept every pending client
+                while (1) {
+                    int client_socket = accept4(server_socket, NULL, NULL, SOCK_NONBLOCK);
+                    if (client_socket == -1) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            perror("Accept failed");
+                        }
+                        break;
                     }
-                    break;
-                }
 
-                size_t bytes_to_send = bytes_read;
-                size_t bytes_sent_total = 0;
-                while (bytes_to_send > 0) {
-                    size_t bytes_sent = write(client_socket, buffer + bytes_sent_total, bytes_to_send);
-                    if (bytes_sent <= 0) {
-                        perror("Error sending data to client");
+                    Connection *new_conn = calloc(1, sizeof(Connection));
+                    if (!new_conn) {
+                        perror("Failed to allocate connection");
                         close(client_socket);
-                        return;
-                    } else {
-                        bytes_to_send -= bytes_sent;
-                        bytes_sent_total += bytes_sent;
+                        continue;
+                    }
+                    new_conn->sock = client_socket;
+                    new_conn->state = CONN_READ_REQUEST;
+                    splice_pipe_init(&new_conn->pipe_state);
+                    bucket_init(&new_conn->bucket, conn_rate, conn_burst);
 
-                        sleep(1);
+                    struct epoll_event client_event = { .events = EPOLLIN, .data.ptr = new_conn };
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &client_event) == -1) {
+                        perror("epoll_ctl failed");
+                        close(client_socket);
+                        free(new_conn);
                     }
                 }
+                continue;
+            }
 
-                bytes_remaining -= bytes_read;
-                fprintf(stderr, "Sent chunk (offset: %zu, chunk_size: %zu) - progress: %zu / %zu\n", offset, chunk_size, chunk_size - bytes_remaining, chunk_size); // or use log_file instead of stderr
+            if (conn->throttled || conn->state == CONN_WAIT_RELAY) {
+                // Only errors and hang-ups are reported while parked
+                close_connection(epoll_fd, conn);
+            } else if (conn->state == CONN_READ_REQUEST) {
+                on_readable(epoll_fd, conn);
+            } else {
+                on_writable(epoll_fd, conn);
             }
+        }
+
+        // Retry every request waiting on the relay: each either proceeds or parks again
+        if (relay_ready) {
+            relay_apply_jobs();
+            Connection *conn = parked_head;
+            parked_head = NULL;
+            while (conn) {
+                Connection *next = conn->next_parked;
+                conn->state = CONN_READ_REQUEST;
+                start_response(epoll_fd, conn, &conn->parked);
+                conn = next;
+            }
+        }
+
+        // Resume connections whose buckets have refilled
+        now = now_seconds();
+        Connection *conn = throttled_head;
+        while (conn) {
+            Connection *next = conn->next_throttled;
+            if (conn->wake_at <= now) {
+                unlink_throttled(conn);
+                want_write(epoll_fd, conn, conn->state);
+                on_writable(epoll_fd, conn);
+            }
+            conn = next;
+        }
+    }
+}
+
+// io_uring engine: accepts, file reads and socket writes are queued as submissions and flushed with one
+// io_uring_enter() per loop. File data moves through registered buffers, sockets and files through fixed-file slots.
+// Talks to the kernel through raw syscalls, so no liburing is needed.
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned local_tail; // Prepared but not yet published submissions end here
+} Uring;
+
+typedef enum {
+    URING_OP_ACCEPT, // user_data has no connection for accepts
+    URING_OP_RECV,
+    URING_OP_SEND_HEADER,
+    URING_OP_READ,
+    URING_OP_WRITE,
+    URING_OP_TIMEOUT,
+    URING_OP_SEND_ENTRIES
+} UringOp;
+
+typedef struct UringConn {
+    int sock;
+    int slot; // Fixed-file slot of the socket; slot + 1 holds the file being sent
+    CachedFile *registered; // File installed in slot + 1, held so that its descriptor is not closed and reused
+    Protocol protocol;
+    char request[REQUEST_SIZE];
+    size_t request_len;
+    char header[REQUEST_SIZE];
+    size_t header_len;
+    size_t header_sent;
+    CachedFile *file;
+    RangeList body;
+    Listing *listing; // Held while LIST or STAT entries are being sent
+    const char *entries;
+    size_t entries_len;
+    size_t entries_sent;
+    off_t file_offset;
+    size_t bytes_remaining; // Bytes of the current range not yet read into the buffer
+    int buffer_index; // Registered buffer held while a GET is in flight, -1 otherwise
+    size_t buffer_len;
+    size_t buffer_sent;
+    TokenBucket bucket;
+    struct __kernel_timespec timeout;
+    struct UringConn *next_waiting; // Queued for a registered buffer
+} UringConn;
+
+Uring ring;
+char *uring_buffers; // URING_BUFFERS * REACTOR_CHUNK bytes, registered with the ring
+int free_buffers[URING_BUFFERS], free_buffer_count;
+int free_slots[URING_CONNS], free_slot_count;
+UringConn *buffer_waiters_head, *buffer_waiters_tail;
+int uring_listen_socket;
+
+int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_register(unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, ring.fd, opcode, arg, nr_args);
+}
+
+// Map the rings of a new io_uring instance. Returns -1 (errno set) when the kernel lacks support.
+int uring_setup(unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring.fd == -1) {
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+    }
+    char *sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    char *cq_ptr = sq_ptr;
+    if (sq_ptr != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    }
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        close(ring.fd);
+        return -1;
+    }
+
+    ring.sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+    ring.cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+    ring.sq_entries = params.sq_entries;
+    ring.local_tail = *ring.sq_tail;
+    return 0;
+}
+
+// Publish prepared submissions and optionally wait for completions
+int uring_submit(unsigned wait_nr)
+{
+    unsigned to_submit = ring.local_tail - *ring.sq_tail;
+    __atomic_store_n(ring.sq_tail, ring.local_tail, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = uring_enter(to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret == -1 && errno == EINTR && !report_requested);
+    return ret;
+}
+
+// Queue one submission; it reaches the kernel at the next uring_submit()
+struct io_uring_sqe *uring_prep(UringOp op, UringConn *conn, int opcode, int fd, const void *addr, unsigned len, __u64 offset)
+{
+    if (ring.local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries) {
+        uring_submit(0); // Submission queue full: flush it to make room
+    }
+    unsigned index = ring.local_tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (__u64)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = (__u64)(uintptr_t)conn | op; // Connections are calloc()ed, so the low bits are free for the op
+    if (conn) {
+        sqe->flags = IOSQE_FIXED_FILE;
+    }
+    ring.sq_array[index] = index;
+    ring.local_tail++;
+    return sqe;
+}
+
+void uring_queue_accept(void)
+{
+    struct io_uring_sqe *sqe = uring_prep(URING_OP_ACCEPT, NULL, IORING_OP_ACCEPT, uring_listen_socket, NULL, 0, 0);
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
 
-            fclose(file);
+void uring_next_request(UringConn *conn);
+void uring_finish_response(UringConn *conn);
+void uring_send_body(UringConn *conn);
+void uring_release_buffer(UringConn *conn);
+
+void uring_close(UringConn *conn)
+{
+    int empty[2] = { -1, -1 };
+    struct io_uring_files_update update = { .offset = conn->slot, .fds = (__u64)(uintptr_t)empty };
+    uring_register(IORING_REGISTER_FILES_UPDATE, &update, 2);
+    close(conn->sock);
+    if (conn->file) {
+        file_cache_release(conn->file);
+    }
+    if (conn->registered) {
+        file_cache_release(conn->registered);
+    }
+    if (conn->listing) {
+        listing_release(conn->listing);
+    }
+    if (conn->buffer_index != -1) {
+        uring_release_buffer(conn);
+    }
+    free_slots[free_slot_count++] = conn->slot;
+    free(conn);
+}
+
+
+void uring_send_header(UringConn *conn)
+{
+    conn->header_sent = 0;
+    struct io_uring_sqe *sqe = uring_prep(URING_OP_SEND_HEADER, conn, IORING_OP_SEND, conn->slot, conn->header, conn->header_len, 0);
+    sqe->msg_flags = MSG_NOSIGNAL | ((conn->listing && conn->entries_len) ? MSG_MORE : 0); // Entries follow in the same segment
+}
+
+// Install the GET's file in the connection's second fixed-file slot, unless it is already there. The slot is keyed
+// on the cache entry, not the descriptor number: an evicted or replaced file's number can come back for another
+// file while the slot still refers to the old one.
+int uring_register_file(UringConn *conn)
+{
+    if (conn->registered == conn->file) {
+        return 0;
+    }
+    int fd = conn->file->fd;
+    struct io_uring_files_update update = { .offset = conn->slot + 1, .fds = (__u64)(uintptr_t)&fd };
+    if (uring_register(IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+        return -1;
+    }
+    if (conn->registered) {
+        file_cache_release(conn->registered);
+    }
+    conn->registered = conn->file;
+    conn->registered->refs++;
+    return 0;
+}
+
+// Start (or resume) streaming a GET body once a registered buffer is free
+void uring_start_body(UringConn *conn)
+{
+    if (free_buffer_count == 0) {
+        conn->next_waiting = NULL;
+        if (buffer_waiters_tail) {
+            buffer_waiters_tail->next_waiting = conn;
         } else {
-            snprintf(buffer, BUFFER_SIZE, "ERROR File not found");
+            buffer_waiters_head = conn;
         }
+        buffer_waiters_tail = conn;
+        return;
+    }
+    conn->buffer_index = free_buffers[--free_buffer_count];
+    conn->buffer_len = conn->buffer_sent = 0;
+    if (uring_register_file(conn) == -1) {
+        perror("Registering file with io_uring failed");
+        uring_close(conn);
+        return;
     }
+    uring_send_body(conn);
+}
 
-    fprintf(stderr, "3) passed sending response\n");
+void uring_release_buffer(UringConn *conn)
+{
+    free_buffers[free_buffer_count++] = conn->buffer_index;
+    conn->buffer_index = -1;
+    UringConn *waiter = buffer_waiters_head;
+    if (waiter) {
+        buffer_waiters_head = waiter->next_waiting;
+        if (!buffer_waiters_head) {
+            buffer_waiters_tail = NULL;
+        }
+        uring_start_body(waiter);
+    }
+}
 
-    close(client_socket);
+void uring_start_response(UringConn *conn, const Request *request)
+{
+    Response response;
+    prepare_response(request, conn->protocol, &response);
+    if (response.hang_up) {
+        uring_close(conn);
+        return;
+    }
+    conn->file = response.file;
+    conn->listing = response.listing;
+    conn->entries = response.entries;
+    conn->entries_len = response.entries_len;
+    conn->entries_sent = 0;
+    memcpy(conn->header, response.header, response.header_len);
+    conn->header_len = response.header_len;
+    if (conn->file) {
+        conn->body = response.body;
+        start_next_range(&conn->body, conn->file, conn->header, &conn->header_len, &conn->file_offset, &conn->bytes_remaining);
+    }
+
+    if (conn->header_len) {
+        uring_send_header(conn);
+    } else {
+        uring_start_body(conn);
+    }
+}
+
+// Queue the rest of a LIST or STAT reply's entries, or finish the reply once they are all sent
+void uring_send_entries(UringConn *conn)
+{
+    if (conn->entries_sent == conn->entries_len) {
+        listing_release(conn->listing);
+        conn->listing = NULL;
+        uring_finish_response(conn);
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_prep(URING_OP_SEND_ENTRIES, conn, IORING_OP_SEND, conn->slot, conn->entries + conn->entries_sent,
+                                          conn->entries_len - conn->entries_sent, 0);
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+void uring_finish_response(UringConn *conn)
+{
+    if (conn->buffer_index != -1) {
+        uring_release_buffer(conn);
+    }
+    if (conn->file) {
+        conn->header_len = 0;
+        if (start_next_range(&conn->body, conn->file, conn->header, &conn->header_len, &conn->file_offset, &conn->bytes_remaining)) {
+            uring_send_header(conn); // Next range of a GET_RANGES
+            return;
+        }
+        file_cache_release(conn->file);
+        conn->file = NULL;
+    }
+    if (conn->protocol == PROTO_LEGACY) {
+        uring_close(conn);
+        return;
+    }
+    uring_next_request(conn);
+}
+
+// Same framing rules as next_request() in epoll mode
+void uring_next_request(UringConn *conn)
+{
+    Request request;
+    int taken = take_request(conn->request, &conn->request_len, &conn->protocol, &request);
+    if (taken == -1) {
+        uring_close(conn);
+    } else if (taken == 0) {
+        uring_prep(URING_OP_RECV, conn, IORING_OP_RECV, conn->slot, conn->request + conn->request_len, sizeof(conn->request) - 1 - conn->request_len, 0);
+    } else {
+        uring_start_response(conn, &request);
+    }
+}
+
+// Queue the next step of a GET body: a fixed-buffer read from the file, or a fixed-buffer write to the socket
+void uring_send_body(UringConn *conn)
+{
+    char *buffer = uring_buffers + (size_t)conn->buffer_index * REACTOR_CHUNK;
+    if (conn->buffer_sent == conn->buffer_len) {
+        if (conn->bytes_remaining == 0) {
+            uring_finish_response(conn);
+            return;
+        }
+        size_t bytes_to_read = (conn->bytes_remaining > REACTOR_CHUNK) ? REACTOR_CHUNK : conn->bytes_remaining;
+        struct io_uring_sqe *sqe = uring_prep(URING_OP_READ, conn, IORING_OP_READ_FIXED, conn->slot + 1, buffer, bytes_to_read, conn->file_offset);
+        sqe->buf_index = conn->buffer_index;
+        return;
+    }
+
+    double wait;
+    size_t allowance = shaped_allowance(&conn->bucket, conn->buffer_len - conn->buffer_sent, &wait);
+    if (allowance == 0) {
+        conn->timeout.tv_sec = (long long)wait;
+        conn->timeout.tv_nsec = (long long)((wait - (long long)wait) * 1e9);
+        struct io_uring_sqe *sqe = uring_prep(URING_OP_TIMEOUT, NULL, IORING_OP_TIMEOUT, -1, &conn->timeout, 1, 0);
+        sqe->user_data = (__u64)(uintptr_t)conn | URING_OP_TIMEOUT;
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_prep(URING_OP_WRITE, conn, IORING_OP_WRITE_FIXED, conn->slot, buffer + conn->buffer_sent, allowance, 0);
+    sqe->buf_index = conn->buffer_index;
+}
+
+void uring_on_accept(int client_socket)
+{
+    uring_queue_accept();
+    if (client_socket < 0) {
+        if (client_socket != -EAGAIN && client_socket != -EINTR) {
+            fprintf(stderr, "Accept failed: %s\n", strerror(-client_socket));
+        }
+        return;
+    }
+    UringConn *conn = calloc(1, sizeof(UringConn));
+    if (!conn || free_slot_count == 0) {
+        fprintf(stderr, "Too many connections, dropping client\n");
+        free(conn);
+        close(client_socket);
+        return;
+    }
+    conn->sock = client_socket;
+    conn->slot = free_slots[--free_slot_count];
+    conn->registered = NULL;
+    conn->buffer_index = -1;
+    bucket_init(&conn->bucket, conn_rate, conn_burst);
+
+    struct io_uring_files_update update = { .offset = conn->slot, .fds = (__u64)(uintptr_t)&conn->sock };
+    if (uring_register(IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+        perror("Registering socket with io_uring failed");
+        free_slots[free_slot_count++] = conn->slot;
+        close(client_socket);
+        free(conn);
+        return;
+    }
+    uring_next_request(conn);
+}
+
+void uring_on_completion(UringOp op, UringConn *conn, int res)
+{
+    switch (op) {
+    case URING_OP_ACCEPT:
+        uring_on_accept(res);
+        break;
+    case URING_OP_RECV:
+        if (res <= 0) {
+            uring_close(conn);
+            break;
+        }
+        conn->request_len += res;
+        uring_next_request(conn);
+        break;
+    case URING_OP_SEND_HEADER:
+        if (res <= 0) {
+            uring_close(conn);
+            break;
+        }
+        conn->header_sent += res;
+        if (conn->header_sent < conn->header_len) {
+            struct io_uring_sqe *sqe = uring_prep(URING_OP_SEND_HEADER, conn, IORING_OP_SEND, conn->slot, conn->header + conn->header_sent, conn->header_len - conn->header_sent, 0);
+            sqe->msg_flags = MSG_NOSIGNAL | ((conn->listing && conn->entries_len) ? MSG_MORE : 0);
+        } else if (conn->file) {
+            uring_start_body(conn);
+        } else if (conn->listing) {
+            uring_send_entries(conn);
+        } else {
+            uring_finish_response(conn);
+        }
+        break;
+    case URING_OP_SEND_ENTRIES:
+        if (res <= 0) {
+            uring_close(conn);
+            break;
+        }
+        conn->entries_sent += res;
+        uring_send_entries(conn);
+        break;
+    case URING_OP_READ:
+        if (res <= 0) {
+            fprintf(stderr, "Error reading from file: %s\n", res ? strerror(-res) : "end of file");
+            uring_close(conn);
+            break;
+        }
+        conn->buffer_len = res;
+        conn->buffer_sent = 0;
+        conn->file_offset += res;
+        conn->bytes_remaining -= res;
+        uring_send_body(conn);
+        break;
+    case URING_OP_WRITE:
+        if (res <= 0) {
+            fprintf(stderr, "Error sending data to client: %s\n", res ? strerror(-res) : "connection closed");
+            uring_close(conn);
+            break;
+        }
+        shaped_consume(&conn->bucket, res);
+        conn->buffer_sent += res;
+        uring_send_body(conn);
+        break;
+    case URING_OP_TIMEOUT:
+        uring_send_body(conn); // Bucket has refilled
+        break;
+    }
+}
+
+// Run the io_uring engine. Returns only if io_uring is unavailable, so the caller can fall back to epoll.
+void run_uring(int server_socket)
+{
+    if (uring_setup(URING_ENTRIES) == -1) {
+        perror("io_uring unavailable, falling back to epoll");
+        return;
+    }
+
+    uring_buffers = aligned_alloc(4096, (size_t)URING_BUFFERS * REACTOR_CHUNK);
+    struct iovec iovecs[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        iovecs[i].iov_base = uring_buffers + (size_t)i * REACTOR_CHUNK;
+        iovecs[i].iov_len = REACTOR_CHUNK;
+        free_buffers[free_buffer_count++] = URING_BUFFERS - 1 - i;
+    }
+    static int slots[URING_CONNS * 2];
+    for (int i = 0; i < URING_CONNS * 2; i++) {
+        slots[i] = -1; // Sparse table: slots are filled as connections arrive
+    }
+    for (int i = 0; i < URING_CONNS; i++) {
+        free_slots[free_slot_count++] = (URING_CONNS - 1 - i) * 2;
+    }
+    if (!uring_buffers || uring_register(IORING_REGISTER_BUFFERS, iovecs, URING_BUFFERS) == -1
+        || uring_register(IORING_REGISTER_FILES, slots, URING_CONNS * 2) == -1) {
+        perror("io_uring registration failed, falling back to epoll");
+        close(ring.fd);
+        free(uring_buffers);
+        free_buffer_count = free_slot_count = 0;
+        return;
+    }
+    uring_listen_socket = server_socket;
+    for (int i = 0; i < URING_ACCEPTS; i++) {
+        uring_queue_accept();
+    }
+
+    while (1) {
+        if (uring_submit(1) == -1 && errno != EINTR) {
+            perror("io_uring_enter failed");
+            exit(EXIT_FAILURE);
+        }
+        report_if_requested();
+
+        // Reap every completion; handlers queue follow-up submissions for the next io_uring_enter()
+        unsigned head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            UringOp op = cqe->user_data & 7;
+            UringConn *conn = (UringConn *)(uintptr_t)(cqe->user_data & ~(__u64)7);
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+            uring_on_completion(op, conn, res);
+        }
+    }
+}
+
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-m blocking|epoll|uring] [-z sendfile|splice|copy] [-r rate] [-b burst] [-R rate] [-B burst] [-c entries] [-s size] [-v level] [-i seconds] [-j] [-u upstream-info.txt [-d dir] [-C budget]] <port>\n", program);
+    fprintf(stderr, "  -r/-b  per-connection limit in bytes/sec and burst size (K/M/G suffixes, default unlimited)\n");
+    fprintf(stderr, "  -R/-B  same, shared by all connections\n");
+    fprintf(stderr, "  -c     open-file cache entries (default %d, 0 disables it and the LIST cache); send SIGUSR1 to print cache statistics\n", FILE_CACHE_SIZE);
+    fprintf(stderr, "  -s     bytes per sendfile()/splice() call, blocking-mode copy buffer and pipe size (K/M/G suffixes, default %d KB)\n", BUFFER_SIZE / 1024);
+    fprintf(stderr, "  -v     0: errors only; 1: warnings and reports (default); 2: every request and send\n");
+    fprintf(stderr, "  -i     seconds between traffic reports (default 0: only on SIGUSR1); -j: report as JSON lines on stdout\n");
+    fprintf(stderr, "  -u     relay mode: serve CHECK/GET from a local chunk cache, fetching misses from these \"<ip> <port>\" servers (epoll only)\n");
+    fprintf(stderr, "  -d/-C  relay cache directory (default relay-cache) and size budget (K/M/G suffixes, default %llu MB)\n", RELAY_BUDGET >> 20);
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    ServerMode mode = MODE_BLOCKING;
+
+    int opt;
+    double global_rate = 0, global_burst = 0;
+    int cache_entries = FILE_CACHE_SIZE;
+    const char *upstream_file = NULL;
+    while ((opt = getopt(argc, argv, "m:z:r:b:R:B:c:s:v:i:ju:d:C:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "blocking") == 0) {
+                mode = MODE_BLOCKING;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                mode = MODE_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                mode = MODE_URING;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'z':
+            if (strcmp(optarg, "sendfile") == 0) {
+                data_path = DATA_SENDFILE;
+            } else if (strcmp(optarg, "splice") == 0) {
+                data_path = DATA_SPLICE;
+            } else if (strcmp(optarg, "copy") == 0) {
+                data_path = DATA_COPY;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'r':
+            conn_rate = parse_size(optarg);
+            break;
+        case 'b':
+            conn_burst = parse_size(optarg);
+            break;
+        case 'R':
+            global_rate = parse_size(optarg);
+            break;
+        case 'B':
+            global_burst = parse_size(optarg);
+            break;
+        case 'c':
+            cache_entries = atoi(optarg);
+            break;
+        case 's': {
+            double size = parse_size(optarg);
+            if (size < 1 || size > POOL_MAX_BUFFER) { // Buffers of this size come from the pool, which tops out there
+                fprintf(stderr, "-s must be between 1 byte and %zu MB\n", POOL_MAX_BUFFER / 1048576);
+                usage(argv[0]);
+            }
+            buffer_size = size;
+            break;
+        }
+        case 'v':
+            log_level = atoi(optarg);
+            break;
+        case 'i':
+            report_interval = atof(optarg);
+            break;
+        case 'j':
+            report_json = 1;
+            break;
+        case 'u':
+            upstream_file = optarg;
+            break;
+        case 'd':
+            relay.dir = optarg;
+            break;
+        case 'C':
+            relay.budget = parse_size(optarg);
+            if (relay.budget == 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    bucket_init(&global_bucket, global_rate, global_burst);
+    if (optind != argc - 1 || cache_entries < 0) {
+        usage(argv[0]);
+    }
+    file_cache_init(cache_entries);
+    if (upstream_file) {
+        relay_init(upstream_file);
+        if (mode != MODE_EPOLL) {
+            LOG_INFO("Relay mode runs on the epoll engine\n");
+            mode = MODE_EPOLL;
+        }
+    }
+
+    // SIGUSR1 prints statistics at the next loop iteration (epoll_wait() wakes up at once, accept() at the next client)
+    struct sigaction report_action = { .sa_handler = on_report_signal, .sa_flags = SA_RESTART };
+    sigemptyset(&report_action.sa_mask);
+    sigaction(SIGUSR1, &report_action, NULL);
+
+    // A client that hangs up mid-response (e.g. one cancelling a hedged request) must not kill the server: write(),
+    // sendfile() and io_uring's WRITE_FIXED have no MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+
+    report_start = now_seconds();
+    pthread_t reporter_thread;
+    if (report_interval > 0 && pthread_create(&reporter_thread, NULL, run_reporter, NULL) != 0) {
+        perror("Failed to start the reporter thread");
         exit(EXIT_FAILURE);
     }
 
@@ -156,11 +3234,13 @@ int main(int argc, char *argv[]) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)); // Allow quick restarts while old connections sit in TIME_WAIT
 
     // init address
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(atoi(argv[1]));
+    server_addr.sin_port = htons(atoi(argv[optind]));
     server_addr.sin_addr.s_addr = INADDR_ANY;
 
     // bind socket
@@ -170,21 +3250,32 @@ int main(int argc, char *argv[]) {
     }
 
     // listen socket
-    if (listen(server_socket, 5) == -1) {
+    if (listen(server_socket, SOMAXCONN) == -1) {
         perror("Listen failed");
         exit(EXIT_FAILURE);
     }
 
+    if (mode == MODE_URING) {
+        run_uring(server_socket); // Returns only when io_uring is unavailable
+        mode = MODE_EPOLL;
+    }
+    if (mode == MODE_EPOLL) {
+        run_reactor(server_socket);
+    }
+
     while (1) {
 
         // accept socket
         int client_socket = accept(server_socket, NULL, NULL);
+        report_if_requested();
         if (client_socket == -1) {
-            perror("Accept failed");
+            if (errno != EINTR) {
+                perror("Accept failed");
+            }
             continue;
         }
 
-        handle_client(client_socket);
+        handle_client(client_socket, server_socket);
     }
 
     close(server_socket);
@@ -0,0 +1,186 @@
+// shard.c
+// Split a file into the k data and m parity shards of an erasure-coded layout (see rs.h). Shard i is written to
+// <prefix><i>/<file>.rs, for a server started in that directory; ./client -E rebuilds the file from any k of them.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "rs.h"
+
+#define SHARD_BATCH 1048576 // Bytes of each shard encoded at once (1MB)
+
+double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Write all of data, or exit
+void write_all(int fd, const char *data, size_t length, const char *path)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written <= 0) {
+            fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-k data-shards] [-m parity-shards] [-u unit] [-d prefix] <file>\n", program);
+    fprintf(stderr, "  -k, -m  shards of each kind (default 4 and 2, at most %d together)\n", RS_MAX_SHARDS);
+    fprintf(stderr, "  -u  bytes of each shard per stripe (default %d KB)\n", RS_UNIT / 1024);
+    fprintf(stderr, "  -d  shard i goes to <prefix><i>/<file>%s (default prefix \"shard\")\n", RS_SUFFIX);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    RsLayout layout = { .k = 4, .m = 2, .unit = RS_UNIT };
+    const char *prefix = "shard";
+    int opt;
+    while ((opt = getopt(argc, argv, "k:m:u:d:")) != -1) {
+        switch (opt) {
+        case 'k':
+            layout.k = atoi(optarg);
+            break;
+        case 'm':
+            layout.m = atoi(optarg);
+            break;
+        case 'u':
+            layout.unit = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            prefix = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || layout.k < 1 || layout.m < 0 || layout.k + layout.m > RS_MAX_SHARDS || layout.unit == 0) {
+        usage(argv[0]);
+    }
+
+    const char *path = argv[optind];
+    int input = open(path, O_RDONLY);
+    struct stat info;
+    if (input == -1 || fstat(input, &info) == -1) {
+        perror("Failed to open the input file");
+        exit(EXIT_FAILURE);
+    }
+    layout.file_size = info.st_size;
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s", path);
+    const char *base = basename(name);
+
+    int shard_count = layout.k + layout.m;
+    int fds[RS_MAX_SHARDS];
+    char paths[RS_MAX_SHARDS][PATH_MAX];
+    char header[RS_HEADER_SIZE];
+    for (int i = 0; i < shard_count; i++) {
+        char directory[PATH_MAX];
+        snprintf(directory, sizeof(directory), "%s%d", prefix, i);
+        if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "Failed to create %s: %s\n", directory, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (snprintf(paths[i], sizeof(paths[i]), "%s/%s%s", directory, base, RS_SUFFIX) >= (int)sizeof(paths[i])) {
+            fprintf(stderr, "Path too long: %s/%s%s\n", directory, base, RS_SUFFIX);
+            exit(EXIT_FAILURE);
+        }
+        fds[i] = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fds[i] == -1) {
+            fprintf(stderr, "Failed to open %s: %s\n", paths[i], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        layout.index = i;
+        rs_format_header(&layout, header);
+        write_all(fds[i], header, RS_HEADER_SIZE, paths[i]);
+    }
+
+    // A batch is the stripes that SHARD_BATCH bytes of each shard cover (at least one): read them from the file,
+    // deal their units out to the data shards, and combine those into the parity shards
+    size_t stripes = rs_stripes(&layout);
+    size_t batch_stripes = (layout.unit < SHARD_BATCH) ? SHARD_BATCH / layout.unit : 1;
+    size_t stripe_bytes = layout.k * layout.unit;
+    char *input_buffer = malloc(batch_stripes * stripe_bytes);
+    char *shards[RS_MAX_SHARDS];
+    for (int i = 0; i < shard_count; i++) {
+        shards[i] = malloc(batch_stripes * layout.unit);
+        if (!shards[i]) {
+            input_buffer = NULL;
+        }
+    }
+    if (!input_buffer) {
+        perror("Failed to allocate shard buffers");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = now_seconds(), encoding = 0;
+    for (size_t first = 0; first < stripes; first += batch_stripes) {
+        size_t count = (stripes - first < batch_stripes) ? stripes - first : batch_stripes;
+        size_t wanted = count * stripe_bytes, got = 0;
+        while (got < wanted) {
+            ssize_t bytes = pread(input, input_buffer + got, wanted - got, first * stripe_bytes + got);
+            if (bytes < 0) {
+                perror("Error reading the input file");
+                exit(EXIT_FAILURE);
+            }
+            if (bytes == 0) {
+                memset(input_buffer + got, 0, wanted - got); // Padding of the last stripe
+                break;
+            }
+            got += bytes;
+        }
+
+        double encode_start = now_seconds();
+        size_t length = count * layout.unit;
+        for (size_t s = 0; s < count; s++) {
+            for (int j = 0; j < layout.k; j++) {
+                memcpy(shards[j] + s * layout.unit, input_buffer + s * stripe_bytes + j * layout.unit, layout.unit);
+            }
+        }
+        for (int i = layout.k; i < shard_count; i++) {
+            memset(shards[i], 0, length);
+            for (int j = 0; j < layout.k; j++) {
+                gf_mul_add(shards[i], shards[j], rs_coefficient(layout.k, i, j), length);
+            }
+        }
+        encoding += now_seconds() - encode_start;
+
+        for (int i = 0; i < shard_count; i++) {
+            write_all(fds[i], shards[i], length, paths[i]);
+        }
+    }
+
+    for (int i = 0; i < shard_count; i++) {
+        if (close(fds[i]) == -1) {
+            fprintf(stderr, "Error closing %s: %s\n", paths[i], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        free(shards[i]);
+    }
+    free(input_buffer);
+    close(input);
+
+    double shard_mb = (RS_HEADER_SIZE + stripes * layout.unit) / 1048576.0;
+    printf("%s: %zu bytes as %d+%d shards of %.1f MB (%s%d..%d/%s%s), %.2fx the file\n", path, layout.file_size,
+           layout.k, layout.m, shard_mb, prefix, 0, shard_count - 1, base, RS_SUFFIX,
+           layout.file_size ? shard_count * shard_mb * 1048576.0 / layout.file_size : 0.0);
+    printf("%.3f s, of which %.3f s encoding with the %s kernel (%.2f GB/s of input)\n", now_seconds() - start,
+           encoding, gf_implementation(), encoding > 0 ? layout.file_size / encoding / 1e9 : 0.0);
+    return 0;
+}
@@ -3,14 +3,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
 #include <sys/time.h> // For struct timeval
 
 #define BUFFER_SIZE 1024
 #define MAX_RETRIES 5
 #define TIMEOUT_SEC 5 // Timeout for blocking to receive data
 #define MAX_QUEUE_SIZE 5
+#define OUTPUT_FILE "output.dat"
 
 pthread_mutex_t shared_socket_lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -77,10 +82,18 @@ void *download_chunk(void *arg) {
             perror("setsockopt failed");
             exit(EXIT_FAILURE);
         }
-        char buffer[BUFFER_SIZE];
-        bzero(buffer, BUFFER_SIZE);
-        socklen_t addr_len = sizeof(server_addr); // or &(socklen_t){sizeof(server_addr)} in the parameters of recvfrom()
-        ssize_t bytes_received = recvfrom(sock, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&server_addr, &addr_len);
+        // Scatter the packet: the seq_num header into seq_num, the payload straight into this task's slice of the output
+        size_t seq_num;
+        size_t payload_len = BUFFER_SIZE - sizeof(seq_num);
+        if ((size_t)bytes_remaining < payload_len) { // bytes_remaining > 0 inside the loop
+            payload_len = bytes_remaining;
+        }
+        struct iovec iov[2] = {
+            { &seq_num, sizeof(seq_num) },
+            { output_ptr, payload_len }
+        };
+        struct msghdr msg = { .msg_name = &server_addr, .msg_namelen = sizeof(server_addr), .msg_iov = iov, .msg_iovlen = 2 };
+        ssize_t bytes_received = recvmsg(sock, &msg, 0);
         pthread_mutex_unlock(&shared_socket_lock);
 
         if (bytes_received <= 0) {
@@ -92,10 +105,10 @@ void *download_chunk(void *arg) {
             }
             continue;
         }
-
-        // Extract seq_num
-        size_t seq_num;
-        memcpy(&seq_num, buffer, sizeof(seq_num));
+        if (msg.msg_flags & MSG_TRUNC) {
+            fprintf(stderr, "Error: Received more payload data than expected! bytes_remaining=%zd\n", bytes_remaining);
+            pthread_exit((void *)1); // Failure
+        }
 
         // Make ACK
         char ack_packet[BUFFER_SIZE];
@@ -113,22 +126,15 @@ void *download_chunk(void *arg) {
         retry_count = 0;
 
         ssize_t payload_size = bytes_received - sizeof(seq_num);
-        if (payload_size > bytes_remaining) {
-            fprintf(stderr, "Error: Received more payload data than expected! payload_size=%zd, bytes_remaining=%zd\n", payload_size, bytes_remaining);
-            pthread_exit((void *)1); // Failure
-        }
-        if (output_ptr + payload_size > task->output + task->size) {
-            fprintf(stderr, "Error: Attempting to write beyond the allocated buffer!\n");
+        if (payload_size < 0) {
+            fprintf(stderr, "Error: Received a packet without a seq_num (%zd bytes)\n", bytes_received);
             pthread_exit((void *)1); // Failure
         }
 
         fprintf(stderr, "Thread %lu) Received data pkt (seq_num=%zu, payload=%zu).\n", pthread_self(), seq_num, payload_size);
         fprintf(stderr, "Thread %lu) Sent ACK (seq_num=%zu) to %s:%d.\n", pthread_self(), seq_num, inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
 
-        // Write received data to the shared output buffer
-        // pthread_mutex_lock(task->lock);
-        memcpy(output_ptr, buffer + sizeof(seq_num), payload_size);
-        // pthread_mutex_unlock(task->lock);
+        // The payload was received in place; no lock is needed
         // since output_ptr & task->output points to distinct nonoverlapping parts of file_data for each thread, then output_ptr is unique per thread
 
         bytes_remaining -= payload_size;
@@ -139,16 +145,56 @@ void *download_chunk(void *arg) {
     pthread_exit((void *)0); // Success
 }
 
-int main(int argc, char *argv[]) {
+// Map OUTPUT_FILE, sized to file_size, as the reassembly buffer. Pages are written back by the kernel as they fill,
+// instead of the whole file being copied out with fwrite() at the end.
+char *map_output(size_t file_size, int *fd) {
+    *fd = open(OUTPUT_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (*fd == -1) {
+        perror("Failed to open " OUTPUT_FILE);
+        exit(EXIT_FAILURE);
+    }
+    int err = posix_fallocate(*fd, 0, file_size);
+    if (err == EOPNOTSUPP || err == EINVAL) {
+        err = (ftruncate(*fd, file_size) == -1) ? errno : 0;
+    }
+    if (err) {
+        fprintf(stderr, "Failed to preallocate " OUTPUT_FILE ": %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+    }
 
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <server-info.txt> <num-chunks> <filename>\n", argv[0]);
+    char *file_data = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (file_data == MAP_FAILED) {
+        perror("Failed to map " OUTPUT_FILE);
         exit(EXIT_FAILURE);
     }
+    madvise(file_data, file_size, MADV_SEQUENTIAL); // Each thread fills its chunk front to back
+    return file_data;
+}
 
-    char *server_info_file = argv[1];
-    int num_connections = atoi(argv[2]);
-    char *filename = argv[3];
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-o memory|mmap] <server-info.txt> <num-chunks> <filename>\n", program);
+    fprintf(stderr, "  -o  memory: reassemble in RAM, then write %s (default); mmap: receive into %s mapped in memory\n", OUTPUT_FILE, OUTPUT_FILE);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+
+    int use_mmap = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        if (opt == 'o' && strcmp(optarg, "mmap") == 0) {
+            use_mmap = 1;
+        } else if (opt != 'o' || strcmp(optarg, "memory") != 0) {
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3) {
+        usage(argv[0]);
+    }
+
+    char *server_info_file = argv[optind];
+    int num_connections = atoi(argv[optind + 1]);
+    char *filename = argv[optind + 2];
 
     // File exists
     FILE *file = fopen(server_info_file, "r");
@@ -222,7 +268,8 @@ int main(int argc, char *argv[]) {
     DownloadTask tasks[num_connections];
     pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
     // char *file_data = malloc(file_size);
-    char *file_data = calloc(file_size, sizeof(char));
+    int output_fd = -1;
+    char *file_data = use_mmap ? map_output(file_size, &output_fd) : calloc(file_size, sizeof(char));
     if (!file_data) {
         perror("Failed to allocate file_data");
         exit(EXIT_FAILURE);
@@ -240,7 +287,9 @@ int main(int argc, char *argv[]) {
         // Validate the chunk size & offset
         if (tasks[i].size <= 0 || tasks[i].offset + tasks[i].size > file_size) {
             fprintf(stderr, "Error: Invalid chunk calculation assigned to thread %d (Offset: %zu, Size: %zu)\n", i, tasks[i].offset, tasks[i].size);
-            free(file_data);
+            if (!use_mmap) {
+                free(file_data);
+            }
             exit(EXIT_FAILURE);
         }
 
@@ -252,7 +301,9 @@ int main(int argc, char *argv[]) {
         // Create the thread
         if (pthread_create(&threads[i], NULL, download_chunk, (void *)&tasks[i]) != 0) {
             perror("Error creating thread");
-            free(file_data);
+            if (!use_mmap) {
+                free(file_data);
+            }
             exit(EXIT_FAILURE);
         }
     }
@@ -275,7 +326,17 @@ int main(int argc, char *argv[]) {
         pthread_detach(threads[i]); // Automatically clean up thread resources
     }
 
-    FILE *output_file = fopen("output.dat", "wb");
+    if (use_mmap) {
+        if (msync(file_data, file_size, MS_SYNC) == -1) {
+            perror("Error syncing " OUTPUT_FILE);
+            exit(EXIT_FAILURE);
+        }
+        munmap(file_data, file_size);
+        close(output_fd);
+        return 0;
+    }
+
+    FILE *output_file = fopen(OUTPUT_FILE, "wb");
     fwrite(file_data, 1, file_size, output_file);
     fclose(output_file);
 
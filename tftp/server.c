@@ -11,6 +11,8 @@
 #define MAX_RETRIES 5
 #define TIMEOUT_SEC 5 // Timeout for resending packets
 #define MAX_QUEUE_SIZE 5
+#define WORKERS 16 // Threads started up front; more are added whenever a request finds them all busy
+#define MAX_REQUESTS 64 // Request slots allocated up front; more are allocated when they are all taken
 
 pthread_mutex_t shared_socket_lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -25,7 +27,7 @@ int ack_queue_size = 0;
 pthread_mutex_t ack_queue_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t ack_queue_cond = PTHREAD_COND_INITIALIZER;
 
-typedef struct {
+typedef struct ClientRequest {
     struct sockaddr_in client_addr;
     socklen_t addr_len;
     char command[10];
@@ -33,14 +35,42 @@ typedef struct {
     size_t offset;
     size_t chunk_size;
     int server_socket;
+    struct ClientRequest *next; // Free list or pending queue
 } ClientRequest;
 
-void *handle_request(void *arg)
+// Requests live in recycled slots and are served by long-lived worker threads, so a datagram costs neither a
+// malloc() nor a pthread_create() once the pools have grown to the load. A worker is held for a whole GET transfer,
+// and the client sends its request only once, so neither pool has a cap: every request gets a thread right away,
+// as it did when each one had its own.
+ClientRequest request_slots[MAX_REQUESTS];
+ClientRequest *free_requests, *pending_head, *pending_tail;
+int idle_workers, pending_count; // Workers waiting for a request, and requests waiting for a worker
+pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t request_cond = PTHREAD_COND_INITIALIZER;
+
+// Returns NULL only if a new slot cannot be allocated
+ClientRequest *take_slot(void)
+{
+    pthread_mutex_lock(&request_lock);
+    ClientRequest *request = free_requests;
+    if (request) {
+        free_requests = request->next;
+    }
+    pthread_mutex_unlock(&request_lock);
+    return request ? request : malloc(sizeof(ClientRequest)); // Joins the free list when released
+}
+
+void release_slot(ClientRequest *request)
 {
-    ClientRequest *request = (ClientRequest *)arg;
+    pthread_mutex_lock(&request_lock);
+    request->next = free_requests;
+    free_requests = request;
+    pthread_mutex_unlock(&request_lock);
+}
 
-    char buffer[BUFFER_SIZE];
-    bzero(buffer, BUFFER_SIZE);
+void handle_request(ClientRequest *request)
+{
+    char buffer[BUFFER_SIZE]; // Only the bytes written are ever sent, so it is never cleared
 
     if (strcmp(request->command, "CHECK") == 0) {
         fprintf(stderr, "Thread %lu) Server: Received CHECK request from client port: %d\n", pthread_self(), ntohs(request->client_addr.sin_port));
@@ -51,7 +81,7 @@ void *handle_request(void *arg)
             snprintf(buffer, BUFFER_SIZE, "ERROR File not found");
             sendto(request->server_socket, buffer, strlen(buffer), 0, (struct sockaddr *)&request->client_addr, request->addr_len);
             fprintf(stderr, "Thread %lu) File not found: %s\n", pthread_self(), request->filename);
-            pthread_exit(NULL);
+            return;
         }
         fseek(file, 0, SEEK_END);
         size_t file_size = ftell(file);
@@ -75,7 +105,7 @@ void *handle_request(void *arg)
             snprintf(buffer, BUFFER_SIZE, "ERROR File not found");
             sendto(request->server_socket, buffer, strlen(buffer), 0, (struct sockaddr *)&request->client_addr, request->addr_len);
             fprintf(stderr, "Thread %lu) File not found: %s\n", pthread_self(), request->filename);
-            pthread_exit(NULL);
+            return;
         }
         fseek(file, 0, SEEK_END);
         size_t file_size = ftell(file);
@@ -94,8 +124,6 @@ void *handle_request(void *arg)
         size_t bytes_remaining = request->chunk_size;
         size_t seq_num = 0; // Sequence number for packets
         while (bytes_remaining > 0) {
-            bzero(buffer, BUFFER_SIZE);
-
             // Make data packet
             size_t bytes_to_read = (bytes_remaining > (BUFFER_SIZE - sizeof(seq_num))) ? (BUFFER_SIZE - sizeof(seq_num)) : bytes_remaining;
             size_t bytes_read = fread(buffer + sizeof(seq_num), 1, bytes_to_read, file);
@@ -114,8 +142,7 @@ void *handle_request(void *arg)
             fprintf(stderr, "Thread %lu) [Wait] Sent data pkt to client (seq_num=%zu, bytes_sent=%zu).\n", pthread_self(), seq_num, bytes_sent);
             if (bytes_sent < 0) {
                 perror("Error sending data to client");
-                close(request->server_socket);
-                pthread_exit(NULL);
+                return; // The socket is shared with every other transfer, so it stays open
             }
 
             // Wait for ACK
@@ -143,7 +170,7 @@ void *handle_request(void *arg)
             ssize_t payload_size = bytes_sent - sizeof(seq_num);
             if (payload_size > bytes_remaining) {
                 fprintf(stderr, "Error: Received more payload data than expected! payload_size=%zd, bytes_remaining=%zd\n", payload_size, bytes_remaining);
-                pthread_exit(NULL);
+                return;
             }
 
             // Move to next packet
@@ -154,9 +181,41 @@ void *handle_request(void *arg)
 
         fclose(file);
     }
+}
 
-    free(request);
-    pthread_exit((void *)0); // Success
+void *run_worker(void *arg)
+{
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&request_lock);
+        idle_workers++;
+        while (!pending_head) {
+            pthread_cond_wait(&request_cond, &request_lock);
+        }
+        ClientRequest *request = pending_head;
+        pending_head = request->next;
+        if (!pending_head) {
+            pending_tail = NULL;
+        }
+        pending_count--;
+        idle_workers--;
+        pthread_mutex_unlock(&request_lock);
+
+        handle_request(request);
+        release_slot(request);
+    }
+    return NULL;
+}
+
+int start_worker(void)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_worker, NULL) != 0) {
+        perror("Failed to create worker thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -186,14 +245,22 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Ready to receive requests...\n");
     }
 
+    for (int i = 0; i < MAX_REQUESTS; i++) {
+        release_slot(&request_slots[i]);
+    }
+    for (int i = 0; i < WORKERS; i++) {
+        if (start_worker() == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
     while (1) {
-        char buffer[BUFFER_SIZE];
-        bzero(buffer, BUFFER_SIZE);
+        char buffer[BUFFER_SIZE]; // Terminated after each datagram instead of cleared
 
         struct sockaddr_in client_addr;
         socklen_t addr_len = sizeof(client_addr);
 
-        ssize_t received = recvfrom(server_socket, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&client_addr, &addr_len);
+        ssize_t received = recvfrom(server_socket, buffer, BUFFER_SIZE - 1, 0, (struct sockaddr *)&client_addr, &addr_len);
         if (received < 0) continue;
 
         buffer[received] = '\0';
@@ -217,23 +284,37 @@ int main(int argc, char *argv[]) {
         }
 
         // Handle new request (format: CHECK <filename> or GET <filename> <offset> <chunk_size>)
-        ClientRequest *request = malloc(sizeof(ClientRequest));
+        ClientRequest *request = take_slot();
+        if (!request) {
+            perror("Failed to allocate request"); // The client does not re-send: this one is lost
+            fprintf(stderr, "Dropping: %s\n", buffer);
+            continue;
+        }
         request->client_addr = client_addr;
         request->addr_len = addr_len;
         request->server_socket = server_socket;
+        request->offset = request->chunk_size = 0;
         if (sscanf(buffer, "%9s %255s %zu %zu", request->command, request->filename, &request->offset, &request->chunk_size) < 2) {
             fprintf(stderr, "Malformed request: %s\n", buffer);
-            free(request);
+            release_slot(request);
             continue;
         }
 
-        pthread_t thread;
-        if (pthread_create(&thread, NULL, handle_request, (void *)request) != 0) {
-            fprintf(stderr, "Failed to create thread for request: %s\n", buffer);
-            free(request);
-            continue;
+        // Hand it to an idle worker, or to a new one if they are all busy
+        pthread_mutex_lock(&request_lock);
+        request->next = NULL;
+        if (pending_tail) {
+            pending_tail->next = request;
+        } else {
+            pending_head = request;
+        }
+        pending_tail = request;
+        int grow = (++pending_count > idle_workers);
+        pthread_cond_signal(&request_cond);
+        pthread_mutex_unlock(&request_lock);
+        if (grow) {
+            start_worker(); // On failure the request waits for a busy worker instead
         }
-        pthread_detach(thread); // Automatically clean up thread resources
     }
 
     close(server_socket);